@@ -3,6 +3,10 @@
 #include <memory>
 #include <vector>
 #include <iostream>
+#include <new>
+#include <type_traits>
+#include <utility>
+#include "symbols.h"
 using namespace std;
 
 #define for_all_ast(X) \
@@ -56,11 +60,59 @@ namespace nkqc{
 			virtual ~expr() {}
 		};
 
+		// bump allocator that owns every node parsed from one compilation unit. nodes refer to each other
+		// with plain pointers, and the whole tree is freed in one go when the arena is destroyed
+		class arena {
+			static const size_t block_size = 64 * 1024;
+			vector<unique_ptr<char[]>> blocks;
+			char* cur;
+			size_t left;
+			vector<pair<void*, void(*)(void*)>> dtors;
+
+			void* allocate(size_t size, size_t align) {
+				size_t pad = (align - (size_t)cur % align) % align;
+				if (cur == nullptr || pad + size > left) {
+					size_t n = size + align > block_size ? size + align : block_size;
+					blocks.emplace_back(new char[n]);
+					cur = blocks.back().get();
+					left = n;
+					bytes_reserved += n;
+					pad = (align - (size_t)cur % align) % align;
+				}
+				void* p = cur + pad;
+				cur += pad + size;
+				left -= pad + size;
+				return p;
+			}
+		public:
+			size_t node_count, bytes_reserved;
+
+			arena() : cur(nullptr), left(0), node_count(0), bytes_reserved(0) {}
+			arena(const arena&) = delete;
+			arena& operator=(const arena&) = delete;
+
+			template<typename T, typename... Args>
+			T* make(Args&&... args) {
+				auto x = new (allocate(sizeof(T), alignof(T))) T(forward<Args>(args)...);
+				if (!is_trivially_destructible<T>::value) {
+					void(*dtor)(void*) = [](void* p) { ((T*)p)->~T(); };
+					dtors.push_back({ x, dtor });
+				}
+				node_count++;
+				return x;
+			}
+
+			~arena() {
+				for (auto d = dtors.rbegin(); d != dtors.rend(); ++d)
+					d->second(d->first);
+			}
+		};
+
 		struct id_expr : public expr { 
-			string v;
-			id_expr(const string& V) : v(V) {}
+			symbol v;
+			id_expr(symbol V) : v(V) {}
 
-			void print(ostream& os) const override { os << v; }
+			void print(ostream& os) const override { os << sym_name(v); }
 			
 			void visit(expr_visiter<>* V) const override { V->visit(*this); }
 		};
@@ -98,12 +150,12 @@ namespace nkqc{
 		};
 
 		struct block_expr : public expr {
-			vector<string> argnames; //without leading ':'
-			shared_ptr<expr> body;
-			block_expr(const vector<string>& an, shared_ptr<expr> b) : argnames(an), body(b) {}
+			vector<symbol> argnames; //without leading ':'
+			expr* body;
+			block_expr(const vector<symbol>& an, expr* b) : argnames(an), body(b) {}
 			void print(ostream& os) const override {
 				os << "[ ";
-				for (const auto& a : argnames) os << ":" << a << " ";
+				for (const auto& a : argnames) os << ":" << sym_name(a) << " ";
 				if (argnames.size() > 0) os << "| ";
 				body->print(os);
 				os << " ]";
@@ -112,14 +164,14 @@ namespace nkqc{
 		};
 		
 		struct symbol_expr : public expr { 
-			string v; //missing leading #
-			symbol_expr(const string& V) : v(V) {}
-			void print(ostream& os) const override { os << "#" << v; }
+			symbol v; //missing leading #
+			symbol_expr(symbol V) : v(V) {}
+			void print(ostream& os) const override { os << "#" << sym_name(v); }
 			void visit(expr_visiter<>* V) const override { V->visit(*this); }
 		};
 		struct array_expr : public expr {
-			vector<shared_ptr<expr>> vs;
-			array_expr(const vector<shared_ptr<expr>>& Vs) : vs(Vs) {}
+			vector<expr*> vs;
+			array_expr(const vector<expr*>& Vs) : vs(Vs) {}
 			void print(ostream& os) const override {
 				os << "#( ";
 				for (auto x : vs) {
@@ -132,28 +184,28 @@ namespace nkqc{
 		};
 
 		struct seq_expr : public expr {
-			shared_ptr<expr> first, second;
-			seq_expr(shared_ptr<expr> f, shared_ptr<expr> s) : first(f), second(s) {}
+			expr *first, *second;
+			seq_expr(expr* f, expr* s) : first(f), second(s) {}
 			void print(ostream& os) const override { first->print(os); os << "." << endl; second->print(os); }
 			void visit(expr_visiter<>* V) const override { V->visit(*this); }
 		};
 
 		struct return_expr : public expr {
-			shared_ptr<expr> val;
+			expr* val;
 
-			return_expr(shared_ptr<expr> v) : val(v) {}
+			return_expr(expr* v) : val(v) {}
 			void print(ostream& os) const override { os << "^ "; val->print(os); }
 			void visit(expr_visiter<>* V) const override { V->visit(*this); }
 		};
 
 		struct msgsnd_expr : public expr {
-			shared_ptr<expr> rcv;
-			msgsnd_expr(shared_ptr<expr> rcv_) : rcv(rcv_) {}
+			expr* rcv;
+			msgsnd_expr(expr* rcv_) : rcv(rcv_) {}
 		};
 		struct unary_msgsnd : public msgsnd_expr {
-			string msgname;
-			unary_msgsnd(shared_ptr<expr> rcv_, const string& mn) : msgsnd_expr(rcv_), msgname(mn) {}
-			void print(ostream& os) const override { rcv->print(os); os << " " << msgname; }
+			symbol msgname;
+			unary_msgsnd(expr* rcv_, symbol mn) : msgsnd_expr(rcv_), msgname(mn) {}
+			void print(ostream& os) const override { rcv->print(os); os << " " << sym_name(msgname); }
 			void visit(expr_visiter<>* V) const override { V->visit(*this); }
 		};
 		/*enum class binary_operator { 
@@ -179,27 +231,27 @@ namespace nkqc{
 			or,				// |
 		};*/
 		struct binary_msgsnd : public msgsnd_expr {
-			string op;
-			shared_ptr<expr> rhs;
-			binary_msgsnd(shared_ptr<expr> rcv_, const string& op_, shared_ptr<expr> rhs_) : msgsnd_expr(rcv_), op(op_), rhs(rhs_) {}
-			void print(ostream& os) const override { rcv->print(os); os << " " << op << " "; rhs->print(os); }
+			symbol op;
+			expr* rhs;
+			binary_msgsnd(expr* rcv_, symbol op_, expr* rhs_) : msgsnd_expr(rcv_), op(op_), rhs(rhs_) {}
+			void print(ostream& os) const override { rcv->print(os); os << " " << sym_name(op) << " "; rhs->print(os); }
 			void visit(expr_visiter<>* V) const override { V->visit(*this); }
 		};
 		struct keyword_msgsnd : public msgsnd_expr {
-			string msgname; //concat, [[a: 1 b: 2 c: 3]] ---> 'a:b:c:' with args={1,2,3}
-			vector<shared_ptr<expr>> args;
-			keyword_msgsnd(shared_ptr<expr> rcv_, const string& mn, const vector<shared_ptr<expr>>& args_) : msgsnd_expr(rcv_), msgname(mn), args(args_) {}
+			symbol msgname; //concat, [[a: 1 b: 2 c: 3]] ---> 'a:b:c:' with args={1,2,3}
+			vector<expr*> args;
+			keyword_msgsnd(expr* rcv_, symbol mn, const vector<expr*>& args_) : msgsnd_expr(rcv_), msgname(mn), args(args_) {}
 			void print(ostream& os) const override {
 				rcv->print(os);
-				os << " " << msgname << " ";
+				os << " " << sym_name(msgname) << " ";
 				for (auto a : args) { a->print(os); os << " "; }
 			}
 			void visit(expr_visiter<>* V) const override { V->visit(*this); }
 		};
 		struct cascade_msgsnd : public msgsnd_expr {
-			vector<pair<string,vector<shared_ptr<expr>>>> msgs;
-			cascade_msgsnd(shared_ptr<expr> rcv,
-				vector<pair<string, vector<shared_ptr<expr>>>> f) : msgsnd_expr(rcv), msgs(f) {}
+			vector<pair<symbol,vector<expr*>>> msgs;
+			cascade_msgsnd(expr* rcv,
+				vector<pair<symbol, vector<expr*>>> f) : msgsnd_expr(rcv), msgs(f) {}
 			void print(ostream& os) const override { 
 				//TODO: implement printing for cascades
 			}
@@ -207,11 +259,11 @@ namespace nkqc{
 		};
 		
 		struct assignment_expr : public expr {
-			string name;
-			shared_ptr<expr> val;
-			assignment_expr(const string& n, shared_ptr<expr> v) : name(n), val(v) {}
+			symbol name;
+			expr* val;
+			assignment_expr(symbol n, expr* v) : name(n), val(v) {}
 			void print(ostream& os) const override {
-				os << name << " := ";
+				os << sym_name(name) << " := ";
 				val->print(os);
 			}
 			void visit(expr_visiter<>* V) const override { V->visit(*this); }
@@ -0,0 +1,241 @@
+#include "backend.h"
+
+#include <llvm/ADT/Triple.h>
+#include <llvm/Analysis/ConstantFolding.h>
+#include <llvm/Analysis/TargetLibraryInfo.h>
+#include <llvm/Analysis/TargetTransformInfo.h>
+#include <llvm/ADT/StringMap.h>
+#include <llvm/MC/SubtargetFeature.h>
+#include <llvm/Support/Host.h>
+#include <llvm/Transforms/IPO.h>
+#include <llvm/Transforms/IPO/AlwaysInliner.h>
+#include <llvm/Transforms/IPO/FunctionAttrs.h>
+#include <llvm/Transforms/IPO/Internalize.h>
+#include <llvm/Transforms/IPO/PassManagerBuilder.h>
+#include <llvm/Transforms/Scalar.h>
+
+namespace nkqc {
+	namespace codegen {
+		bool backend_options::parse_opt_flag(const string& arg) {
+			if (arg == "-O0") { opt_level = 0; size_level = 0; }
+			else if (arg == "-O1") { opt_level = 1; size_level = 0; }
+			else if (arg == "-O2") { opt_level = 2; size_level = 0; }
+			else if (arg == "-O3") { opt_level = 3; size_level = 0; }
+			else if (arg == "-Os") { opt_level = 2; size_level = 1; }
+			else return false;
+			return true;
+		}
+
+		bool backend_options::parse_target_flag(const string& arg) {
+			if (arg.compare(0, 6, "-mcpu=") == 0) cpu = arg.substr(6);
+			else if (arg.compare(0, 7, "-mattr=") == 0) features = arg.substr(7);
+			else return false;
+			return true;
+		}
+
+		llvm::CodeGenOpt::Level backend_options::codegen_level() const {
+			switch (opt_level) {
+			case 0: return llvm::CodeGenOpt::None;
+			case 1: return llvm::CodeGenOpt::Less;
+			case 2: return llvm::CodeGenOpt::Default;
+			default: return llvm::CodeGenOpt::Aggressive;
+			}
+		}
+
+		unique_ptr<llvm::TargetMachine> create_target_machine(const string& triple, const backend_options& opts) {
+			string err;
+			auto targ = llvm::TargetRegistry::lookupTarget(triple, err);
+			if (targ == nullptr) throw internal_codegen_error("no target for " + triple + ": " + err);
+			string cpu = opts.cpu.empty() ? "generic" : opts.cpu, features;
+			if (cpu == "native") {
+				cpu = llvm::sys::getHostCPUName().str();
+				llvm::StringMap<bool> host;
+				if (llvm::sys::getHostCPUFeatures(host)) {
+					llvm::SubtargetFeatures f;
+					for (const auto& h : host) f.AddFeature(h.first(), h.second);
+					features = f.getString();
+				}
+			}
+			// later features override earlier ones, so -mattr can turn off something the CPU has
+			if (!opts.features.empty()) features += (features.empty() ? "" : ",") + opts.features;
+			llvm::TargetOptions to;
+			if (opts.fast_math) {
+				to.UnsafeFPMath = to.NoInfsFPMath = to.NoNaNsFPMath = to.NoSignedZerosFPMath = true;
+				to.AllowFPOpFusion = llvm::FPOpFusion::Fast;
+			}
+			unique_ptr<llvm::TargetMachine> mach{ targ->createTargetMachine(triple, cpu, features, to,
+				llvm::Optional<llvm::Reloc::Model>{}, llvm::CodeModel::Default, opts.codegen_level()) };
+			// unoptimized builds are for quick edit-compile loops, so skip the full instruction selector
+			if (opts.opt_level == 0) mach->setFastISel(true);
+			return mach;
+		}
+
+		void target_module(llvm::Module& m, llvm::TargetMachine* tm) {
+			m.setTargetTriple(tm->getTargetTriple().str());
+			m.setDataLayout(tm->createDataLayout());
+			auto cpu = tm->getTargetCPU(), features = tm->getTargetFeatureString();
+			for (auto& f : m) {
+				if (f.isDeclaration()) continue;
+				f.addFnAttr("target-cpu", cpu);
+				if (!features.empty()) f.addFnAttr("target-features", features);
+				// the backend takes these per function, over the target machine's options
+				if (tm->Options.UnsafeFPMath) {
+					f.addFnAttr("unsafe-fp-math", "true");
+					f.addFnAttr("no-infs-fp-math", "true");
+					f.addFnAttr("no-nans-fp-math", "true");
+					f.addFnAttr("no-signed-zeros-fp-math", "true");
+				}
+			}
+		}
+
+		void internalize(llvm::Module& m, const vector<string>& keep) {
+			llvm::internalizeModule(m, [&](const llvm::GlobalValue& g) {
+				return find(keep.begin(), keep.end(), g.getName()) != keep.end();
+			});
+		}
+
+		// the size of the allocation that call makes, if it is an alloc or allocArrayOf: of a constant size
+		static llvm::ConstantInt* allocation_size(llvm::CallInst* call, const llvm::DataLayout& dl) {
+			auto f = call->getCalledFunction();
+			if (f == nullptr) return nullptr;
+			llvm::Value* size;
+			if (f->getName() == "malloc") size = call->getArgOperand(0);
+			else if (f->getName() == "nkqc.pool.take") size = call->getArgOperand(1);
+			else return nullptr;
+			auto c = llvm::dyn_cast<llvm::Constant>(size);
+			if (c == nullptr) return nullptr;
+			return llvm::dyn_cast_or_null<llvm::ConstantInt>(llvm::ConstantFoldConstant(c, dl));
+		}
+
+		// the free or pool give that call makes of p, if it makes one
+		static bool frees(llvm::CallInst* call, llvm::Value* p) {
+			auto f = call->getCalledFunction();
+			if (f == nullptr) return false;
+			if (f->getName() == "free") return call->getArgOperand(0) == p;
+			if (f->getName() == "nkqc.pool.give") return call->getArgOperand(1) == p;
+			return false;
+		}
+
+		// finds every free of the memory a points to, returning false if a might outlive the function call that made
+		// it or be seen by anything but loads and stores through it and calls that don't keep it. runs after mem2reg, so
+		// variables holding a are already its uses, and a pointer that makes it around a loop has to go through a phi
+		static bool stays_local(llvm::Instruction* a, vector<llvm::CallInst*>& freed) {
+			vector<llvm::Value*> ptrs{ a };
+			while (!ptrs.empty()) {
+				auto p = ptrs.back(); ptrs.pop_back();
+				for (auto u : p->users()) {
+					if (llvm::isa<llvm::BitCastInst>(u) || llvm::isa<llvm::GetElementPtrInst>(u)) ptrs.push_back(u);
+					else if (llvm::isa<llvm::LoadInst>(u) || llvm::isa<llvm::ICmpInst>(u)) continue;
+					else if (auto st = llvm::dyn_cast<llvm::StoreInst>(u)) {
+						if (st->getValueOperand() == p) return false;
+					}
+					else if (auto call = llvm::dyn_cast<llvm::CallInst>(u)) {
+						if (frees(call, p)) { freed.push_back(call); continue; }
+						for (unsigned i = 0; i < call->getNumArgOperands(); ++i)
+							if (call->getArgOperand(i) == p && !call->doesNotCapture(i)) return false;
+						if (call->getCalledFunction() == nullptr || call->getCalledFunction()->isDeclaration()) return false;
+					}
+					else return false;
+				}
+			}
+			return true;
+		}
+
+		vector<string> promote_heap_allocations(llvm::Module& m) {
+			vector<string> promoted;
+			auto& dl = m.getDataLayout();
+			for (auto& f : m) {
+				if (f.isDeclaration() || f.getName().startswith("nkqc.")) continue;
+				vector<llvm::CallInst*> sites;
+				for (auto& bb : f) for (auto& i : bb) {
+					auto call = llvm::dyn_cast<llvm::CallInst>(&i);
+					if (call != nullptr && allocation_size(call, dl) != nullptr) sites.push_back(call);
+				}
+				for (auto call : sites) {
+					auto size = allocation_size(call, dl)->getZExtValue();
+					vector<llvm::CallInst*> freed;
+					if (size > max_promoted_bytes || !stays_local(call, freed)) continue;
+					llvm::IRBuilder<> irb(&f.getEntryBlock(), f.getEntryBlock().begin());
+					auto slot = irb.CreateAlloca(llvm::ArrayType::get(irb.getInt8Ty(), size));
+					// as aligned as malloc would have made it
+					slot->setAlignment(16);
+					auto p = irb.CreateBitCast(slot, call->getType());
+					string what;
+					llvm::raw_string_ostream os(what);
+					os << f.getName() << ": " << size << " bytes from " << call->getCalledFunction()->getName();
+					if (call->hasOneUse()) {
+						os << " as ";
+						call->user_back()->getType()->print(os);
+					}
+					promoted.push_back(os.str());
+					for (auto fr : freed) fr->eraseFromParent();
+					call->replaceAllUsesWith(p);
+					call->eraseFromParent();
+				}
+			}
+			return promoted;
+		}
+
+		// moves what it can of m's heap allocations to the stack, listing them if opts asks to
+		static void promote(llvm::Module& m, const backend_options& opts) {
+			// which parameters functions keep, so that a pointer passed to one that doesn't still counts as local
+			llvm::legacy::PassManager attrs;
+			attrs.add(llvm::createPostOrderFunctionAttrsLegacyPass());
+			attrs.run(m);
+			for (const auto& p : promote_heap_allocations(m))
+				if (opts.report_promotions) llvm::errs() << "promoted to the stack: " << p << "\n";
+		}
+
+		void optimize(llvm::Module& m, llvm::TargetMachine* tm, const backend_options& opts) {
+			if (opts.opt_level == 0) {
+				// no pipelines, but allocations still go on the stack. that only needs mem2reg first, which is cheap
+				llvm::legacy::FunctionPassManager fpm(&m);
+				fpm.add(llvm::createPromoteMemoryToRegisterPass());
+				fpm.doInitialization();
+				for (auto& f : m) fpm.run(f);
+				fpm.doFinalization();
+				promote(m, opts);
+				return;
+			}
+			llvm::PassManagerBuilder pmb;
+			pmb.OptLevel = opts.opt_level;
+			pmb.SizeLevel = opts.size_level;
+			if (opts.opt_level > 1) pmb.Inliner = llvm::createFunctionInliningPass(opts.opt_level, opts.size_level, false);
+			else pmb.Inliner = llvm::createAlwaysInlinerLegacyPass();
+			pmb.LoopVectorize = opts.opt_level > 1 && opts.size_level == 0;
+			pmb.SLPVectorize = opts.opt_level > 1 && opts.size_level == 0;
+			pmb.LibraryInfo = new llvm::TargetLibraryInfoImpl(llvm::Triple(m.getTargetTriple()));
+			// slice indexing is bounds checked. counted loops over slices check their range up front, and this splits the
+			// checks in other loops, like whileTrue: ones, out of the iterations that are known to be in bounds
+			pmb.addExtension(llvm::PassManagerBuilder::EP_LoopOptimizerEnd, [](const llvm::PassManagerBuilder&, llvm::legacy::PassManagerBase& pm) {
+				pm.add(llvm::createInductiveRangeCheckEliminationPass());
+			});
+			tm->adjustPassManager(pmb);
+
+			llvm::legacy::FunctionPassManager fpm(&m);
+			fpm.add(llvm::createTargetTransformInfoWrapperPass(tm->getTargetIRAnalysis()));
+			pmb.populateFunctionPassManager(fpm);
+			llvm::legacy::PassManager mpm;
+			mpm.add(llvm::createTargetTransformInfoWrapperPass(tm->getTargetIRAnalysis()));
+			pmb.populateModulePassManager(mpm);
+			if (opts.whole_program) pmb.populateLTOPassManager(mpm);
+
+			fpm.doInitialization();
+			for (auto& f : m) fpm.run(f);
+			fpm.doFinalization();
+			promote(m, opts);
+			mpm.run(m);
+		}
+
+		void emit_object(llvm::Module& m, llvm::TargetMachine* tm, const string& path) {
+			error_code ec;
+			llvm::raw_fd_ostream d(path, ec, llvm::sys::fs::OpenFlags{});
+			if (ec) throw internal_codegen_error("could not write " + path + ": " + ec.message());
+			llvm::legacy::PassManager pass;
+			if (tm->addPassesToEmitFile(pass, d, llvm::TargetMachine::CGFT_ObjectFile))
+				throw internal_codegen_error("target can't emit an object file");
+			pass.run(m);
+			d.flush();
+		}
+	}
+}
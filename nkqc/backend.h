@@ -0,0 +1,51 @@
+#pragma once
+#include "llvm_codegen.h"
+
+namespace nkqc {
+	namespace codegen {
+		struct backend_options {
+			unsigned opt_level;  // -O0 to -O3
+			unsigned size_level; // 1 for -Os
+			string triple;       // --target, empty for the default target
+			string cpu;          // -mcpu, empty for generic. "native" is the host's CPU and features
+			string features;     // -mattr, as +feature,-feature. added to, or overriding, the CPU's own
+			bool whole_program;  // --whole-program, the module is the entire program and only main is called from outside it
+			bool fast_math;      // --fast-math, floating point may be reassociated, contracted and assumed finite
+			bool report_promotions; // --report-promotions, list the heap allocations that were moved to the stack
+			backend_options() : opt_level(0), size_level(0), whole_program(false), fast_math(false), report_promotions(false) {}
+
+			// parses an -O flag, returning false if arg isn't one
+			bool parse_opt_flag(const string& arg);
+			// parses -mcpu=cpu or -mattr=features, returning false if arg is neither
+			bool parse_target_flag(const string& arg);
+			llvm::CodeGenOpt::Level codegen_level() const;
+		};
+
+		// a target machine for triple, set up to generate code for the CPU and features and at the optimization level in opts
+		unique_ptr<llvm::TargetMachine> create_target_machine(const string& triple, const backend_options& opts);
+
+		// sets m's triple and data layout to tm's and tags every function defined in m with tm's CPU and features,
+		// so that the optimizer's target queries and the vectorizers see the real ISA. call after generating m
+		void target_module(llvm::Module& m, llvm::TargetMachine* tm);
+
+		// gives every function defined in m, except those named in keep, internal linkage. the optimizer can then inline,
+		// specialize and drop them across what were separate source files, since it can see every call to them
+		void internalize(llvm::Module& m, const vector<string>& keep);
+
+		// allocations bigger than this stay on the heap, even if they never leave the function that makes them
+		const uint64_t max_promoted_bytes = 4096;
+
+		// turns alloc and allocArrayOf: calls of a constant size whose memory can't outlive the function that makes it
+		// into allocas in its entry block, deleting the frees of that memory. m must have been through mem2reg.
+		// returns a description of each allocation it promoted
+		vector<string> promote_heap_allocations(llvm::Module& m);
+
+		// runs the function and module optimization pipelines for opts over m, which must already have its data layout set.
+		// for a whole program the link time pipeline follows, to propagate constants and attributes between functions.
+		// at -O0 only mem2reg and the promotion of heap allocations to the stack run
+		void optimize(llvm::Module& m, llvm::TargetMachine* tm, const backend_options& opts);
+
+		// writes m as an object file to path
+		void emit_object(llvm::Module& m, llvm::TargetMachine* tm, const string& path);
+	}
+}
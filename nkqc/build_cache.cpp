@@ -0,0 +1,274 @@
+#include "build_cache.h"
+#include <set>
+#include <sstream>
+#include <iomanip>
+#include <algorithm>
+
+#include <llvm/Support/FileSystem.h>
+#include <llvm/Support/MemoryBuffer.h>
+
+namespace nkqc {
+	namespace codegen {
+		// bump this whenever the code generator changes what it emits, so that stale caches are ignored
+		static const char* cache_format = "nkqc-cache-7";
+
+		// the names a type refers to, which include the structs it uses
+		static void names_in(shared_ptr<type_id> t, set<symbol>& out) {
+			if (t == nullptr) return;
+			auto pl = dynamic_pointer_cast<plain_type>(t);
+			if (pl != nullptr) out.insert(pl->name);
+			auto pt = dynamic_pointer_cast<ptr_type>(t);
+			if (pt != nullptr) names_in(pt->inner, out);
+			auto at = dynamic_pointer_cast<array_type>(t);
+			if (at != nullptr) names_in(at->element, out);
+			auto vt = dynamic_pointer_cast<vector_type>(t);
+			if (vt != nullptr) names_in(vt->element, out);
+			auto slt = dynamic_pointer_cast<slice_type>(t);
+			if (slt != nullptr) names_in(slt->element, out);
+			auto ft = dynamic_pointer_cast<function_type>(t);
+			if (ft != nullptr) {
+				for (const auto& a : ft->args) names_in(a, out);
+				names_in(ft->return_type, out);
+			}
+		}
+
+		// collects the selector of every message sent in a function body, and the names in its type expressions
+		struct send_collector : public ast::expr_visiter<> {
+			set<symbol> sels, names;
+
+			void walk(const ast::expr* x) {
+				// type expressions can't be visited, and never send anything
+				auto te = dynamic_cast<const parser::type_expr*>(x);
+				if (te != nullptr) names_in(te->type, names);
+				else x->visit(this);
+			}
+
+			void visit(const ast::id_expr& x) override {}
+			void visit(const ast::string_expr& x) override {}
+			void visit(const ast::number_expr& x) override {}
+			void visit(const ast::block_expr& x) override { walk(x.body); }
+			void visit(const ast::symbol_expr& x) override {}
+			void visit(const ast::char_expr& x) override {}
+			void visit(const ast::array_expr& x) override {
+				for (auto v : x.vs) walk(v);
+			}
+			void visit(const ast::tag_expr& x) override {}
+			void visit(const ast::seq_expr& x) override { walk(x.first); walk(x.second); }
+			void visit(const ast::return_expr& x) override { walk(x.val); }
+			void visit(const ast::unary_msgsnd& x) override {
+				walk(x.rcv);
+				sels.insert(x.msgname);
+			}
+			void visit(const ast::binary_msgsnd& x) override {
+				walk(x.rcv);
+				sels.insert(x.op);
+				walk(x.rhs);
+			}
+			void visit(const ast::keyword_msgsnd& x) override {
+				walk(x.rcv);
+				sels.insert(x.msgname);
+				for (auto a : x.args) walk(a);
+			}
+			void visit(const ast::cascade_msgsnd& x) override {
+				walk(x.rcv);
+				for (const auto& m : x.msgs) {
+					sels.insert(m.first);
+					for (auto a : m.second) walk(a);
+				}
+			}
+			void visit(const ast::assignment_expr& x) override { walk(x.val); }
+		};
+
+		static uint64_t hash_of(const string& s, uint64_t h = fnv1a(nullptr, 0)) {
+			return fnv1a(s.data(), s.size(), h);
+		}
+		static uint64_t hash_of(uint64_t v, uint64_t h) {
+			return fnv1a((const char*)&v, sizeof(v), h);
+		}
+
+		build_cache::build_cache(const string& dir) : dir(dir), hits(0), misses(0) {
+			llvm::sys::fs::create_directories(dir);
+		}
+
+		vector<string> build_cache::keys(const program& p) {
+			auto printed = [](shared_ptr<type_id> t) {
+				if (t == nullptr) return string("-");
+				ostringstream os;
+				t->print(os);
+				return os.str();
+			};
+
+			// options and interface files that change the generated IR key every function, so that switching them never
+			// reuses stale code
+			auto h_common = hash_of(p.fast_math ? "fast-math" : "", hash_of(cache_format));
+			for (const auto& i : p.interfaces) {
+				auto f = llvm::MemoryBuffer::getFile(i);
+				if (f) h_common = fnv1a((*f)->getBufferStart(), (*f)->getBufferSize(), h_common);
+			}
+
+			// the program's structs by name, and by the selector of their initializer, which sending it reaches them by
+			unordered_map<symbol, shared_ptr<type_id>> structs;
+			unordered_map<symbol, vector<symbol>> initializers;
+			for (const auto& t : p.types) {
+				structs[t.first] = t.second;
+				auto st = dynamic_pointer_cast<struct_type>(t.second);
+				if (st == nullptr) continue;
+				string csl;
+				for (const auto& f : st->fields) csl += sym_name(f.first) + ":";
+				initializers[sym(csl)].push_back(t.first);
+			}
+
+			vector<set<symbol>> sends(p.functions.size()), names(p.functions.size());
+			unordered_map<symbol, vector<size_t>> overloads;
+			for (size_t i = 0; i < p.functions.size(); ++i) {
+				const auto& f = p.functions[i];
+				send_collector c;
+				c.walk(f.body);
+				sends[i] = move(c.sels);
+				names[i] = move(c.names);
+				names_in(f.receiver, names[i]);
+				for (const auto& a : f.args) names_in(a.second, names[i]);
+				names_in(f.return_type, names[i]);
+				overloads[f.selector].push_back(i);
+			}
+
+			// the interface of a selector is what a caller can observe of all the functions that implement it
+			unordered_map<symbol, uint64_t> ifaces;
+			function<uint64_t(symbol)> iface = [&](symbol sel) -> uint64_t {
+				auto known = ifaces.find(sel);
+				if (known != ifaces.end()) return known->second;
+				ifaces[sel] = 0; // recursive inference is rejected by the code generator anyway
+				auto h = hash_of(sym_name(sel));
+				auto os = overloads.find(sel);
+				if (os != overloads.end()) {
+					for (auto i : os->second) {
+						const auto& f = p.functions[i];
+						h = hash_of(f.static_function ? "static" : "", h);
+						h = hash_of(printed(f.receiver), h);
+						for (const auto& a : f.args) h = hash_of(printed(a.second), hash_of(sym_name(a.first), h));
+						h = hash_of(printed(f.return_type), h);
+						// callers also depend on whether a block they pass can escape, which only the body tells
+						bool takes_block = false;
+						for (const auto& a : f.args) takes_block = takes_block || dynamic_pointer_cast<function_type>(a.second) != nullptr;
+						if (f.return_type == nullptr || takes_block) {
+							h = hash_of(f.source_hash, h);
+							for (auto s : sends[i]) h = hash_of(iface(s), h);
+						}
+					}
+				}
+				return ifaces[sel] = h;
+			};
+
+			// the names a caller of a selector can reach: in the signatures of the functions that implement it, the
+			// structs it initializes, and everything an inferred body reaches, like iface
+			unordered_map<symbol, set<symbol>> reaches;
+			function<const set<symbol>&(symbol)> reach = [&](symbol sel) -> const set<symbol>& {
+				auto known = reaches.find(sel);
+				if (known != reaches.end()) return known->second;
+				reaches[sel];
+				set<symbol> r;
+				auto in = initializers.find(sel);
+				if (in != initializers.end()) r.insert(in->second.begin(), in->second.end());
+				auto os = overloads.find(sel);
+				if (os != overloads.end()) {
+					for (auto i : os->second) {
+						const auto& f = p.functions[i];
+						bool takes_block = false;
+						for (const auto& a : f.args) takes_block = takes_block || dynamic_pointer_cast<function_type>(a.second) != nullptr;
+						if (f.return_type == nullptr || takes_block) {
+							r.insert(names[i].begin(), names[i].end());
+							for (auto s : sends[i]) {
+								const auto& rs = reach(s);
+								r.insert(rs.begin(), rs.end());
+							}
+						}
+						else {
+							names_in(f.receiver, r);
+							for (const auto& a : f.args) names_in(a.second, r);
+							names_in(f.return_type, r);
+						}
+					}
+				}
+				return reaches[sel] = move(r);
+			};
+
+			vector<string> ks;
+			for (size_t i = 0; i < p.functions.size(); ++i) {
+				auto h = hash_of(p.functions[i].source_hash, h_common);
+				h = hash_of(iface(p.functions[i].selector), h);
+				for (auto s : sends[i]) h = hash_of(iface(s), h);
+
+				// only the structs this function can reach key it, so editing a struct leaves the rest of the cache alone
+				auto used = names[i];
+				const auto& own = reach(p.functions[i].selector);
+				used.insert(own.begin(), own.end());
+				for (auto s : sends[i]) {
+					const auto& rs = reach(s);
+					used.insert(rs.begin(), rs.end());
+				}
+				vector<string> reached;
+				vector<symbol> pending(used.begin(), used.end());
+				set<symbol> seen;
+				while (!pending.empty()) {
+					auto n = pending.back();
+					pending.pop_back();
+					auto st = structs.find(n);
+					if (st == structs.end() || !seen.insert(n).second) continue;
+					reached.push_back(sym_name(n));
+					auto fields = dynamic_pointer_cast<struct_type>(st->second);
+					if (fields == nullptr) continue;
+					set<symbol> field_names;
+					for (const auto& f : fields->fields) names_in(f.second, field_names);
+					pending.insert(pending.end(), field_names.begin(), field_names.end());
+				}
+				// by name, since symbols are numbered in the order the source happens to intern them
+				sort(reached.begin(), reached.end());
+				for (const auto& n : reached) h = hash_of(printed(structs.at(sym(n))), hash_of(n, h));
+
+				ostringstream k;
+				k << hex << setw(16) << setfill('0') << h;
+				ks.push_back(k.str());
+			}
+			return ks;
+		}
+
+		static bool read_entry(const string& path, string& out) {
+			auto f = llvm::MemoryBuffer::getFile(path);
+			if (!f) return false;
+			out = (*f)->getBuffer().str();
+			return true;
+		}
+
+		static void write_entry(const string& path, const string& data) {
+			// written to the side and renamed into place so that an interrupted build never leaves a truncated entry
+			error_code ec;
+			{
+				llvm::raw_fd_ostream o(path + ".tmp", ec, llvm::sys::fs::OpenFlags{});
+				if (ec) return;
+				o << data;
+			}
+			llvm::sys::fs::rename(path + ".tmp", path);
+		}
+
+		bool build_cache::load(const string& key, string& bitcode) {
+			if (!read_entry(dir + "/" + key + ".bc", bitcode)) {
+				misses++;
+				return false;
+			}
+			hits++;
+			return true;
+		}
+
+		void build_cache::store(const string& key, const string& bitcode) {
+			write_entry(dir + "/" + key + ".bc", bitcode);
+		}
+
+		bool build_cache::load_signature(const string& key, string& signature) {
+			return read_entry(dir + "/" + key + ".sig", signature);
+		}
+
+		void build_cache::store_signature(const string& key, const string& signature) {
+			write_entry(dir + "/" + key + ".sig", signature);
+		}
+	}
+}
@@ -0,0 +1,28 @@
+#pragma once
+#include "parallel_codegen.h"
+
+namespace nkqc {
+	namespace codegen {
+		// a directory of generated bitcode for individual functions, keyed by a hash of everything
+		// the function's code depends on, so that a rebuild only regenerates functions whose key changed
+		struct build_cache {
+			string dir;
+			size_t hits, misses;
+
+			build_cache(const string& dir);
+
+			// the key of every function in p. a key covers the function's own source text, every interface file in the
+			// program, the options that change generated code, the interfaces of all the selectors it sends: their
+			// signatures, plus the bodies of any function whose return type is inferred, since changing such a body
+			// can change what its callers generate, and the definitions of the structs reachable from all of those
+			vector<string> keys(const program& p);
+
+			bool load(const string& key, string& bitcode);
+			void store(const string& key, const string& bitcode);
+
+			// a function's signature, as written by write_signatures, so that a rebuild doesn't infer it again
+			bool load_signature(const string& key, string& signature);
+			void store_signature(const string& key, const string& signature);
+		};
+	}
+}
@@ -0,0 +1,373 @@
+#include "llvm_codegen.h"
+
+namespace nkqc {
+	namespace codegen {
+		bool inline_control(symbol sel) {
+			return sel == sym_whileTrue_ || sel == sym_ifTrue_ifFalse_ || sel == sym_to_do_ || sel == sym_to_by_do_ || sel == sym_timesRepeat_;
+		}
+
+		// whether a parameter of type t can take a closure of the block literal blk
+		static shared_ptr<function_type> closure_for(shared_ptr<type_id> t, const ast::block_expr* blk) {
+			auto ft = dynamic_pointer_cast<function_type>(t);
+			return ft != nullptr && ft->args.size() == blk->argnames.size() ? ft : nullptr;
+		}
+
+		// whether a closure of type t passed as argument i of an nargs argument send of sel can outlive the call, for
+		// every overload it could be passed to. with a block literal blk instead of t, for every overload that could
+		// take a closure of it there
+		static bool passed_to_escaping(code_generator* gen, symbol sel, size_t i, size_t nargs, shared_ptr<type_id> t, const ast::block_expr* blk = nullptr) {
+			auto fs = gen->functions.find(sel);
+			if ((t == nullptr && blk == nullptr) || fs == gen->functions.end()) return true;
+			bool any = false;
+			for (auto& f : fs->second) {
+				auto lf = dynamic_pointer_cast<code_generator::llvm_function>(f);
+				if (lf == nullptr) return true; // nothing is known of what a builtin or an extern does with it
+				if (lf->decl.args.size() != nargs) continue;
+				if (blk != nullptr ? closure_for(lf->decl.args[i].second, blk) == nullptr : lf->decl.args[i].second != t) continue;
+				if (gen->parameter_escapes(f.get(), i)) return true;
+				any = true;
+			}
+			return !any;
+		}
+
+		// whether the closure in the variable name can outlive the function body that is walked
+		struct escape_walker : public ast::expr_visiter<> {
+			code_generator* gen;
+			symbol name;
+			shared_ptr<type_id> type;
+			bool escapes;
+			// inside a closure that can escape itself, and would carry name away with it
+			bool captured;
+
+			escape_walker(code_generator* gen, symbol name, shared_ptr<type_id> type)
+				: gen(gen), name(name), type(type), escapes(false), captured(false) {}
+
+			void walk(const ast::expr* x) {
+				// type expressions can't be visited, and never refer to a variable
+				if (!escapes && dynamic_cast<const parser::type_expr*>(x) == nullptr) x->visit(this);
+			}
+			// whether x is a plain use of name where a closure can safely be used
+			bool names(const ast::expr* x) {
+				auto id = dynamic_cast<const ast::id_expr*>(x);
+				return !captured && id != nullptr && id->v == name;
+			}
+			void block_body(const ast::block_expr& x, bool closure_escapes) {
+				// an argument of the same name hides the variable
+				if (find(x.argnames.begin(), x.argnames.end(), name) != x.argnames.end()) return;
+				auto was = captured;
+				captured = captured || closure_escapes;
+				walk(x.body);
+				captured = was;
+			}
+
+			void visit(const ast::id_expr& x) override { if (x.v == name) escapes = true; }
+			void visit(const ast::string_expr& x) override {}
+			void visit(const ast::number_expr& x) override {}
+			// a block anywhere but a control structure or an argument of a call is a closure nothing keeps track of
+			void visit(const ast::block_expr& x) override { block_body(x, true); }
+			void visit(const ast::symbol_expr& x) override {}
+			void visit(const ast::char_expr& x) override {}
+			void visit(const ast::array_expr& x) override {
+				for (auto v : x.vs) walk(v);
+			}
+			void visit(const ast::tag_expr& x) override {}
+			void visit(const ast::seq_expr& x) override { walk(x.first); walk(x.second); }
+			void visit(const ast::return_expr& x) override { walk(x.val); }
+			void visit(const ast::unary_msgsnd& x) override {
+				if (x.msgname == sym_value && names(x.rcv)) return;
+				walk(x.rcv);
+			}
+			void visit(const ast::binary_msgsnd& x) override { walk(x.rcv); walk(x.rhs); }
+			void visit(const ast::keyword_msgsnd& x) override {
+				auto rblk = dynamic_cast<const ast::block_expr*>(x.rcv);
+				if (rblk != nullptr && inline_control(x.msgname)) block_body(*rblk, false);
+				else if (!(x.msgname == sym_value_ && names(x.rcv))) walk(x.rcv);
+				for (size_t i = 0; i < x.args.size(); ++i) {
+					auto blk = dynamic_cast<const ast::block_expr*>(x.args[i]);
+					if (names(x.args[i])) {
+						if (passed_to_escaping(gen, x.msgname, i, x.args.size(), type)) escapes = true;
+					}
+					else if (blk != nullptr && inline_control(x.msgname)) block_body(*blk, false);
+					else if (blk != nullptr)
+						block_body(*blk, passed_to_escaping(gen, x.msgname, i, x.args.size(), nullptr, blk));
+					else walk(x.args[i]);
+				}
+			}
+			void visit(const ast::cascade_msgsnd& x) override {
+				walk(x.rcv);
+				for (const auto& m : x.msgs) {
+					for (auto a : m.second) walk(a);
+				}
+			}
+			// assigning to name only replaces what it holds
+			void visit(const ast::assignment_expr& x) override { walk(x.val); }
+		};
+
+		// every variable a body refers to or assigns
+		struct variable_collector : public ast::expr_visiter<> {
+			vector<symbol> names;
+			set<symbol> assigned;
+
+			void walk(const ast::expr* x) {
+				if (dynamic_cast<const parser::type_expr*>(x) == nullptr) x->visit(this);
+			}
+			void add(symbol v) {
+				if (find(names.begin(), names.end(), v) == names.end()) names.push_back(v);
+			}
+
+			void visit(const ast::id_expr& x) override { add(x.v); }
+			void visit(const ast::string_expr& x) override {}
+			void visit(const ast::number_expr& x) override {}
+			void visit(const ast::block_expr& x) override { walk(x.body); }
+			void visit(const ast::symbol_expr& x) override {}
+			void visit(const ast::char_expr& x) override {}
+			void visit(const ast::array_expr& x) override {
+				for (auto v : x.vs) walk(v);
+			}
+			void visit(const ast::tag_expr& x) override {}
+			void visit(const ast::seq_expr& x) override { walk(x.first); walk(x.second); }
+			void visit(const ast::return_expr& x) override { walk(x.val); }
+			void visit(const ast::unary_msgsnd& x) override { walk(x.rcv); }
+			void visit(const ast::binary_msgsnd& x) override { walk(x.rcv); walk(x.rhs); }
+			void visit(const ast::keyword_msgsnd& x) override {
+				walk(x.rcv);
+				for (auto a : x.args) walk(a);
+			}
+			void visit(const ast::cascade_msgsnd& x) override {
+				walk(x.rcv);
+				for (const auto& m : x.msgs) {
+					for (auto a : m.second) walk(a);
+				}
+			}
+			void visit(const ast::assignment_expr& x) override {
+				add(x.name);
+				assigned.insert(x.name);
+				walk(x.val);
+			}
+		};
+
+		// the variables of a body whose value can change once a closure has captured them: arguments (and instance
+		// variables) it assigns, and variables it assigns more than once or in a loop
+		struct reassignment_finder : public ast::expr_visiter<> {
+			set<symbol> args, assigned, reassigned;
+			size_t loops;
+
+			reassignment_finder() : loops(0) {}
+
+			void walk(const ast::expr* x) {
+				if (dynamic_cast<const parser::type_expr*>(x) == nullptr) x->visit(this);
+			}
+			void block_body(const ast::block_expr& x, bool loop) {
+				auto outer = args;
+				args.insert(x.argnames.begin(), x.argnames.end());
+				if (loop) loops++;
+				walk(x.body);
+				if (loop) loops--;
+				args = outer;
+			}
+
+			void visit(const ast::id_expr& x) override {}
+			void visit(const ast::string_expr& x) override {}
+			void visit(const ast::number_expr& x) override {}
+			// a closure's own variables start over every time it is called, so its body isn't a loop for them
+			void visit(const ast::block_expr& x) override { block_body(x, false); }
+			void visit(const ast::symbol_expr& x) override {}
+			void visit(const ast::char_expr& x) override {}
+			void visit(const ast::array_expr& x) override {
+				for (auto v : x.vs) walk(v);
+			}
+			void visit(const ast::tag_expr& x) override {}
+			void visit(const ast::seq_expr& x) override { walk(x.first); walk(x.second); }
+			void visit(const ast::return_expr& x) override { walk(x.val); }
+			void visit(const ast::unary_msgsnd& x) override { walk(x.rcv); }
+			void visit(const ast::binary_msgsnd& x) override { walk(x.rcv); walk(x.rhs); }
+			void visit(const ast::keyword_msgsnd& x) override {
+				auto loop = inline_control(x.msgname) && x.msgname != sym_ifTrue_ifFalse_;
+				auto rblk = dynamic_cast<const ast::block_expr*>(x.rcv);
+				if (rblk != nullptr && inline_control(x.msgname)) block_body(*rblk, loop);
+				else walk(x.rcv);
+				for (auto a : x.args) {
+					auto blk = dynamic_cast<const ast::block_expr*>(a);
+					if (blk != nullptr && inline_control(x.msgname)) block_body(*blk, loop);
+					else walk(a);
+				}
+			}
+			void visit(const ast::cascade_msgsnd& x) override {
+				walk(x.rcv);
+				for (const auto& m : x.msgs) {
+					for (auto a : m.second) walk(a);
+				}
+			}
+			void visit(const ast::assignment_expr& x) override {
+				if (args.count(x.name) || loops > 0 || !assigned.insert(x.name).second) reassigned.insert(x.name);
+				walk(x.val);
+			}
+		};
+
+		set<symbol> code_generator::reassigned_variables(const parser::fn_decl& fn) {
+			reassignment_finder r;
+			for (const auto& a : fn.args) r.args.insert(a.first);
+			auto pt = dynamic_pointer_cast<ptr_type>(fn.receiver);
+			auto st = pt == nullptr || fn.static_function ? nullptr : dynamic_pointer_cast<struct_type>(pt->inner);
+			if (st != nullptr) {
+				for (const auto& f : st->fields) r.args.insert(f.first);
+			}
+			r.walk(fn.body);
+			return r.reassigned;
+		}
+
+		shared_ptr<function_type> code_generator::closure_type(symbol sel, shared_ptr<type_id> rcv, const vector<shared_ptr<type_id>>& args,
+			const vector<ast::expr*>& arg_exprs, size_t i) {
+			auto fs = functions.find(sel);
+			if (fs == functions.end()) return nullptr;
+			shared_ptr<function_type> res = nullptr;
+			for (auto& f : fs->second) {
+				auto lf = dynamic_pointer_cast<llvm_function>(f);
+				if (lf == nullptr || lf->decl.args.size() != args.size()) continue;
+				// each block literal takes the type of the parameter it is passed for, if it can be a closure for it, and
+				// then the overload has to accept the send as dispatch would
+				auto with = args;
+				bool fits = true;
+				for (size_t j = 0; j < args.size() && fits; ++j) {
+					if (args[j] != nullptr) continue;
+					fits = closure_for(lf->decl.args[j].second, dynamic_cast<const ast::block_expr*>(arg_exprs[j])) != nullptr;
+					with[j] = lf->decl.args[j].second;
+				}
+				if (!fits || !f->can_apply(rcv, with)) continue;
+				auto ft = dynamic_pointer_cast<function_type>(with[i]);
+				if (res != nullptr && res != ft) return nullptr;
+				res = ft;
+			}
+			return res;
+		}
+
+		bool code_generator::parameter_escapes(function* f, size_t i) {
+			auto lf = dynamic_cast<llvm_function*>(f);
+			if (lf == nullptr || lf->decl.body == nullptr) return true;
+			auto key = make_pair((const function*)f, i);
+			if (escape_assumptions.count(key)) return false;
+			auto known = escaping_params.find(key);
+			if (known != escaping_params.end()) return known->second;
+			escape_assumptions.insert(key);
+			escape_walker w{ this, lf->decl.args[i].first, lf->decl.args[i].second };
+			w.walk(dynamic_cast<ast::block_expr*>(lf->decl.body)->body);
+			escape_assumptions.erase(key);
+			// a parameter found not to escape only under an assumption still being checked may turn out to escape
+			if (w.escapes || escape_assumptions.empty()) escaping_params[key] = w.escapes;
+			return w.escapes;
+		}
+
+		void code_generator::expr_generator::closure(const nkqc::ast::block_expr& x, bool on_stack) {
+			auto ft = dynamic_pointer_cast<function_type>(gen->type_of(&x, cx));
+			auto& c = irb.getContext();
+			auto closure_t = llvm::cast<llvm::StructType>(gen->type_of(ft));
+			auto code_t = llvm::cast<llvm::FunctionType>(closure_t->getElementType(0)->getPointerElementType());
+			auto i8p = llvm::Type::getInt8PtrTy(c);
+
+			// the variables of this function the body refers to, as the places they are stored if the environment is
+			// on the stack and as their values otherwise. loop counters are values either way. a copy doesn't see later
+			// assignments the way the variable itself would, so a variable that can change can't be copied
+			variable_collector refs;
+			refs.walk(x.body);
+			vector<pair<symbol, pair<llvm::Value*, shared_ptr<type_id>>>> captures;
+			vector<llvm::Type*> fields;
+			for (auto name : refs.names) {
+				if (find(x.argnames.begin(), x.argnames.end(), name) != x.argnames.end()) continue;
+				auto v = cx->find(name);
+				if (v == cx->end() || v->second.first == nullptr) continue;
+				auto val = v->second.first;
+				if (!on_stack && val->getType() != gen->type_of(v->second.second)) {
+					if (gen->reassigned.count(name))
+						throw internal_codegen_error("a block that can escape can't capture " + sym_name(name) + ", which can be assigned after the block is made");
+					val = irb.CreateLoad(val);
+				}
+				captures.push_back({ name, { val, v->second.second } });
+				fields.push_back(val->getType());
+			}
+			auto env_t = llvm::StructType::get(c, fields);
+
+			auto F = llvm::Function::Create(code_t, llvm::Function::InternalLinkage,
+				irb.GetInsertBlock()->getParent()->getName() + ".block", gen->mod.get());
+			auto entry = llvm::BasicBlock::Create(c, "entry", F);
+			llvm::IRBuilder<> eb(entry);
+			// the body sees nothing of this function but what it captured
+			expr_context bcx;
+			auto a = F->arg_begin();
+			auto env = eb.CreateBitCast(&*a++, env_t->getPointerTo());
+			for (unsigned i = 0; i < captures.size(); ++i)
+				bcx[captures[i].first] = { eb.CreateLoad(eb.CreateStructGEP(env_t, env, i)), captures[i].second.second };
+			for (size_t i = 0; i < x.argnames.size(); ++i, ++a) {
+				auto alc = eb.CreateAlloca(a->getType());
+				eb.CreateStore(&*a, alc);
+				bcx[x.argnames[i]] = { alc, ft->args[i] };
+			}
+			expr_generator body_gen(gen, entry, &bcx);
+			x.body->visit(&body_gen);
+			if (body_gen.irb.GetInsertBlock()->getTerminator() == nullptr) {
+				if (ft->return_type == gen->universe.unit()) body_gen.irb.CreateRetVoid();
+				else body_gen.irb.CreateRet(body_gen.s.top());
+			}
+
+			llvm::Value* envp = llvm::ConstantPointerNull::get(i8p);
+			if (!captures.empty()) {
+				llvm::Value* e;
+				if (on_stack) {
+					auto& fentry = irb.GetInsertBlock()->getParent()->getEntryBlock();
+					llvm::IRBuilder<> ab(&fentry, fentry.begin());
+					e = ab.CreateAlloca(env_t, nullptr, "env");
+				}
+				else {
+					auto it = gen->size_type();
+					e = llvm::CallInst::CreateMalloc(irb.GetInsertBlock(),
+						it, env_t, llvm::ConstantExpr::getTruncOrBitCast(llvm::ConstantExpr::getSizeOf(env_t), it), nullptr, nullptr, "env");
+					irb.GetInsertBlock()->getInstList().push_back(llvm::cast<llvm::Instruction>(e));
+				}
+				for (unsigned i = 0; i < captures.size(); ++i)
+					irb.CreateStore(captures[i].second.first, irb.CreateStructGEP(env_t, e, i));
+				envp = irb.CreateBitCast(e, i8p);
+			}
+			llvm::Value* v = llvm::UndefValue::get(closure_t);
+			v = irb.CreateInsertValue(v, F, 0);
+			s.push(irb.CreateInsertValue(v, envp, 1));
+			gen->closure_code[s.top()] = F;
+		}
+
+		llvm::Function* code_generator::specialize(shared_ptr<llvm_function> f, size_t i, llvm::Function* code) {
+			auto key = make_tuple((const function*)f.get(), i, (const llvm::Function*)code);
+			if (!specialize_blocks) return nullptr;
+			auto known = specializations.find(key);
+			if (known != specializations.end()) return known->second;
+			// the argument is bound to its value, which a body that assigns to it can't have
+			variable_collector vars;
+			if (f->decl.body != nullptr) vars.walk(f->decl.body);
+			if (f->decl.body == nullptr || vars.assigned.count(f->decl.args[i].first)) return specializations[key] = nullptr;
+
+			auto F = llvm::Function::Create(f->f->getFunctionType(), llvm::Function::InternalLinkage,
+				f->f->getName() + "." + code->getName(), mod.get());
+			F->setAttributes(f->f->getAttributes());
+			// registered first so that a recursive call passing the block on calls the specialization itself
+			specializations[key] = F;
+			// the callee's body is typed in place of the function being generated, which gets its types back after
+			auto caller_types = move(expr_types);
+			auto caller_body = typed_body;
+			auto caller_visits = typer_visits;
+			expr_types.clear();
+			typed_body = nullptr;
+			auto restore = [&]() {
+				expr_types = move(caller_types);
+				typed_body = caller_body;
+				typer_visits = caller_visits;
+			};
+			try {
+				generate_body(f, F, i, code);
+			} catch (...) {
+				restore();
+				specializations.erase(key);
+				F->eraseFromParent();
+				throw;
+			}
+			restore();
+			return F;
+		}
+	}
+}
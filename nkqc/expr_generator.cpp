@@ -3,12 +3,16 @@
 namespace nkqc {
 	namespace codegen {
 		void code_generator::expr_generator::visit(const nkqc::ast::id_expr &x) {
-			if (x.v == "true")
+			if (x.v == sym_true)
 				s.push(llvm::ConstantInt::get(llvm::Type::getInt1Ty(gen->mod->getContext()), 1));
-			else if (x.v == "false")
+			else if (x.v == sym_false)
 				s.push(llvm::ConstantInt::get(llvm::Type::getInt1Ty(gen->mod->getContext()), 0));
-			else
-				s.push(irb.CreateLoad(cx->at(x.v).first));
+			else {
+				auto& v = cx->at(x.v);
+				// the counter of a counted loop is bound to its value, every other variable to where it is stored
+				if (v.first->getType() == gen->type_of(v.second)) s.push(v.first);
+				else s.push(irb.CreateLoad(v.first));
+			}
 		}
 		void code_generator::expr_generator::visit(const nkqc::ast::string_expr &x)  {
 			//					s.push(irb.CreateAlloca(llvm::ArrayType::get(llvm::Type::getInt8Ty(gen->mod->getContext()), x.v.size())));
@@ -16,11 +20,14 @@ namespace nkqc {
 				llvm::ArrayRef<uint8_t>((uint8_t*)x.v.c_str(), x.v.size() + 1)));
 		}
 		void code_generator::expr_generator::visit(const nkqc::ast::number_expr &x) {
-			s.push(llvm::ConstantInt::get(llvm::Type::getInt32Ty(gen->mod->getContext()), x.iv));
+			if (x.type == 'f') s.push(llvm::ConstantFP::get(llvm::Type::getDoubleTy(gen->mod->getContext()), x.fv));
+			else s.push(llvm::ConstantInt::get(llvm::Type::getInt32Ty(gen->mod->getContext()), x.iv));
 		}
 		void code_generator::expr_generator::visit(const nkqc::ast::block_expr &x) {
-			// if we get here this is a proper closure
-			throw;
+			// blocks passed to a parameter of function type are generated by keyword_msgsnd, with escape analysis
+			if (dynamic_pointer_cast<function_type>(gen->type_of(&x, cx)) == nullptr)
+				throw internal_codegen_error("a block can only be passed to a control structure or a parameter of function type");
+			closure(x, false);
 		}
 		void code_generator::expr_generator::visit(const nkqc::ast::symbol_expr &x) {
 			throw;
@@ -29,26 +36,44 @@ namespace nkqc {
 			throw;
 		}
 		void code_generator::expr_generator::visit(const nkqc::ast::array_expr &x) {
-			throw;
+			// the typer has checked that every element is a number literal
+			vector<llvm::Constant*> lanes;
+			for (auto v : x.vs) {
+				v->visit(this);
+				lanes.push_back(llvm::cast<llvm::Constant>(s.top()));
+				s.pop();
+			}
+			s.push(llvm::ConstantVector::get(lanes));
 		}
 		void code_generator::expr_generator::visit(const nkqc::ast::tag_expr &x) {
-			cout << "tag " << x.v << endl;
+			if (gen->trace) cout << "tag " << x.v << endl;
 		}
 		void code_generator::expr_generator::visit(const nkqc::ast::seq_expr &x) {
 			x.first->visit(this);
 			x.second->visit(this);
 		}
 		void code_generator::expr_generator::visit(const nkqc::ast::return_expr &x) {
+			auto id = dynamic_cast<ast::id_expr*>(x.val);
+			auto nrv = cx->sret != nullptr && id != nullptr ? cx->find(id->v) : cx->end();
+			if (nrv != cx->end() && nrv->second.first == cx->sret) {
+				// the named return value, already in the caller's slot
+				s.push(irb.CreateRetVoid());
+				return;
+			}
 			x.val->visit(this);
 			auto v = s.top(); s.pop();
-			s.push(irb.CreateRet(v));
+			if (cx->sret != nullptr) {
+				irb.CreateStore(v, cx->sret);
+				s.push(irb.CreateRetVoid());
+			}
+			else s.push(irb.CreateRet(v));
 		}
 		
 		void code_generator::expr_generator::visit(const nkqc::ast::unary_msgsnd &x) {
-			auto glob = dynamic_pointer_cast<nkqc::ast::symbol_expr>(x.rcv);
-			auto tx = dynamic_pointer_cast<nkqc::parser::type_expr>(x.rcv);
+			auto glob = dynamic_cast<nkqc::ast::symbol_expr*>(x.rcv);
+			auto tx = dynamic_cast<nkqc::parser::type_expr*>(x.rcv);
 			shared_ptr<type_id> rcv_t;
-			if (glob != nullptr && glob->v == "G")
+			if (glob != nullptr && glob->v == sym_G)
 				s.push(nullptr);
 			else if (tx != nullptr) {
 				s.push(nullptr);
@@ -57,13 +82,13 @@ namespace nkqc {
 			else {
 				// all receivers are passed by reference
 				rcv_t = gen->type_of(x.rcv, cx);
-				auto id = dynamic_pointer_cast<ast::id_expr>(x.rcv);
+				auto id = dynamic_cast<ast::id_expr*>(x.rcv);
 				if (id != nullptr) {
 					s.push(cx->at(id->v).first);
 				}
 				else x.rcv->visit(this);
 				if (rcv_t->receive_by_ref()) {
-					rcv_t = make_shared<ptr_type>(rcv_t);
+					rcv_t = gen->universe.ptr_to(rcv_t);
 					//if (!llvm::isa<llvm::AllocaInst>(s.top())) //->getType()->isPointerTy()) {
 					//	allocate();
 				}
@@ -76,7 +101,7 @@ namespace nkqc {
 			else throw no_such_function_error("unary message", x.msgname, rcv_t, {});
 		}
 		void code_generator::expr_generator::visit(const nkqc::ast::binary_msgsnd &x) {
-			auto tx = dynamic_pointer_cast<parser::type_expr>(x.rcv);
+			auto tx = dynamic_cast<parser::type_expr*>(x.rcv);
 			auto rhs_type = gen->type_of(x.rhs, cx);
 			if (tx != nullptr) {
 				auto txt = tx->type->resolve(gen);
@@ -105,21 +130,21 @@ namespace nkqc {
 			}
 		}
 		void code_generator::expr_generator::visit(const nkqc::ast::keyword_msgsnd &x) {
-			auto glob = dynamic_pointer_cast<nkqc::ast::symbol_expr>(x.rcv);
-			auto tx = dynamic_pointer_cast<nkqc::parser::type_expr>(x.rcv);
-			auto block_rcv = dynamic_pointer_cast<nkqc::ast::block_expr>(x.rcv);
+			auto glob = dynamic_cast<nkqc::ast::symbol_expr*>(x.rcv);
+			auto tx = dynamic_cast<nkqc::parser::type_expr*>(x.rcv);
+			auto block_rcv = dynamic_cast<nkqc::ast::block_expr*>(x.rcv);
 			vector<shared_ptr<type_id>> arg_t;
 			for (const auto& arg : x.args)
 				arg_t.push_back(gen->type_of(arg, cx));
 			shared_ptr<type_id> rcv_t;
-			if (glob != nullptr && glob->v == "G")
+			if (glob != nullptr && glob->v == sym_G)
 				s.push(nullptr);
 			else if (tx != nullptr) {
 				s.push(nullptr);
 				rcv_t = tx->type->resolve(gen);
 			}
 			else if (block_rcv != nullptr) {
-				if (x.msgname == "whileTrue:") {
+				if (x.msgname == sym_whileTrue_) {
 					if (arg_t.size() != 1) throw no_such_function_error("while loop must only have body", x.msgname, nullptr, arg_t);
 					auto cond_t = gen->type_of(block_rcv->body, cx);
 					if (dynamic_pointer_cast<bool_type>(cond_t) == nullptr)
@@ -134,9 +159,10 @@ namespace nkqc {
 					//		after-loop-code
 					auto loop_chk_bb = llvm::BasicBlock::Create(irb.getContext(), "loopchk", F);
 					irb.CreateBr(loop_chk_bb);
-					auto loop_bb = llvm::BasicBlock::Create(irb.getContext(), "loop");
+					// the body goes in F before it is generated, since control flow in it finds F through its blocks
+					auto loop_bb = llvm::BasicBlock::Create(irb.getContext(), "loop", F);
 					auto loopend_bb = llvm::BasicBlock::Create(irb.getContext(), "loopend");
-					auto body_blk = dynamic_pointer_cast<ast::block_expr>(x.args[0]);
+					auto body_blk = dynamic_cast<ast::block_expr*>(x.args[0]);
 					if (body_blk == nullptr) throw no_such_function_error("while loop body must be block", x.msgname, nullptr, arg_t);
 
 					expr_generator loop_chk_gen(gen, loop_chk_bb, cx);
@@ -151,7 +177,6 @@ namespace nkqc {
 					body_blk->body->visit(&loop_gen);
 					loop_gen.irb.CreateBr(loop_chk_bb);
 					cx->pop_scope();
-					F->getBasicBlockList().push_back(loop_bb);
 
 					F->getBasicBlockList().push_back(loopend_bb);
 					irb.SetInsertPoint(loopend_bb);
@@ -164,9 +189,15 @@ namespace nkqc {
 			else {
 				rcv_t = gen->type_of(x.rcv, cx);
 				x.rcv->visit(this);
+				if (dynamic_pointer_cast<integer_type>(rcv_t) != nullptr
+					&& (x.msgname == sym_to_do_ || x.msgname == sym_to_by_do_ || x.msgname == sym_timesRepeat_)) {
+					auto start = s.top(); s.pop();
+					counted_loop(x, start, rcv_t);
+					return;
+				}
 				if (dynamic_pointer_cast<bool_type>(rcv_t) != nullptr) {
-					if (x.msgname == "ifTrue:ifFalse:") {
-						if (arg_t.size() != 2 || !arg_t[0]->equals(arg_t[1]))
+					if (x.msgname == sym_ifTrue_ifFalse_) {
+						if (arg_t.size() != 2 || arg_t[0] != arg_t[1])
 							throw no_such_function_error("if statment branches must have same type", x.msgname, rcv_t, arg_t);
 						auto F = irb.GetInsertBlock()->getParent();
 						auto true_bb = llvm::BasicBlock::Create(irb.getContext(), "then", F);
@@ -174,7 +205,7 @@ namespace nkqc {
 						auto merge_bb = llvm::BasicBlock::Create(irb.getContext(), "merge");
 						irb.CreateCondBr(s.top(), true_bb, false_bb);
 						expr_generator true_gen(gen, true_bb, cx), false_gen(gen, false_bb, cx);
-						auto blk = dynamic_pointer_cast<ast::block_expr>(x.args[0]);
+						auto blk = dynamic_cast<ast::block_expr*>(x.args[0]);
 						if (blk) {
 							cx->push_scope();
 							blk->body->visit(&true_gen);
@@ -186,7 +217,7 @@ namespace nkqc {
 							true_gen.irb.CreateBr(merge_bb);
 						}
 						F->getBasicBlockList().push_back(false_bb);
-						blk = dynamic_pointer_cast<ast::block_expr>(x.args[1]);
+						blk = dynamic_cast<ast::block_expr*>(x.args[1]);
 						if (blk) {
 							cx->push_scope();
 							blk->body->visit(&false_gen);
@@ -211,16 +242,152 @@ namespace nkqc {
 			}
 
 			auto rcv = s.top(); s.pop();
+			auto f = gen->lookup_function(x.msgname, rcv_t, arg_t);
+			if (f == nullptr) throw no_such_function_error("keyword message", x.msgname, rcv_t, arg_t);
 			vector<llvm::Value*> args;
-			for (const auto& arg : x.args) {
-				arg->visit(this);
+			for (size_t i = 0; i < x.args.size(); ++i) {
+				auto blk = dynamic_cast<ast::block_expr*>(x.args[i]);
+				// a block passed for a parameter that can't outlive the call keeps its environment in this frame
+				if (blk != nullptr && dynamic_pointer_cast<function_type>(arg_t[i]) != nullptr)
+					closure(*blk, !gen->parameter_escapes(f.get(), i));
+				else x.args[i]->visit(this);
 				args.push_back(s.top()); s.pop();
 			}
-			auto f = gen->lookup_function(x.msgname, rcv_t, arg_t);
-			if (f != nullptr) {
-				f->apply(this, rcv, args, rcv_t, arg_t);
+			// a callee that is passed a closure whose code is known here is specialized for it
+			auto lf = dynamic_pointer_cast<llvm_function>(f);
+			for (size_t i = 0; lf != nullptr && i < args.size(); ++i) {
+				auto code = gen->closure_code.find(args[i]);
+				if (code == gen->closure_code.end() || gen->parameter_escapes(f.get(), i)) continue;
+				auto spec = gen->specialize(lf, i, code->second);
+				if (spec != nullptr) {
+					lf->apply_as(spec, this, rcv, args, rcv_t, arg_t);
+					return;
+				}
 			}
-			else throw no_such_function_error("keyword message", x.msgname, rcv_t, arg_t);
+			f->apply(this, rcv, args, rcv_t, arg_t);
+		}
+		void code_generator::expr_generator::counted_loop(const nkqc::ast::keyword_msgsnd& x, llvm::Value* start, shared_ptr<type_id> counter_t) {
+			//		bounds, branch to after-loop if the loop runs no times
+			//loop:
+			//		i = phi [start, before-loop], [next, end of loop-body]
+			//		loop-body
+			//		next = i + step, branch to loop if step still fits between i and the end
+			//after-loop:
+			//		after-loop-code
+			auto signed_ = dynamic_pointer_cast<integer_type>(counter_t)->signed_;
+			auto times = x.msgname == sym_timesRepeat_;
+			auto body_blk = dynamic_cast<ast::block_expr*>(x.args.back());
+			if (body_blk == nullptr || body_blk->argnames.size() != (times ? 0 : 1))
+				throw no_such_function_error(times ? "loop body must be a block without arguments" : "loop body must be a block taking the counter",
+					x.msgname, counter_t, {});
+			vector<llvm::Value*> bounds;
+			for (size_t i = 0; i + 1 < x.args.size(); ++i) {
+				auto t = gen->type_of(x.args[i], cx);
+				if (t != counter_t) throw type_mismatch_error("loop bounds must have the type of the counter", counter_t, t);
+				x.args[i]->visit(this);
+				bounds.push_back(s.top()); s.pop();
+			}
+			// n timesRepeat: counts from 0 up to but not including n, to: includes its end
+			llvm::Value *stop, *step;
+			if (times) {
+				stop = start;
+				start = llvm::ConstantInt::get(start->getType(), 0);
+			}
+			else stop = bounds[0];
+			step = bounds.size() > 1 ? bounds[1] : llvm::ConstantInt::get(start->getType(), 1);
+			// only a signed step that isn't a constant needs a check for which way the loop goes at run time
+			auto cstep = llvm::dyn_cast<llvm::ConstantInt>(step);
+			// a loop that never moves would never end
+			if (cstep != nullptr && cstep->isZero()) throw internal_codegen_error("the step of a loop can't be 0");
+			if (cstep == nullptr) {
+				auto F = irb.GetInsertBlock()->getParent();
+				auto moves_bb = llvm::BasicBlock::Create(irb.getContext(), "step", F), zero_bb = llvm::BasicBlock::Create(irb.getContext(), "zerostep", F);
+				irb.CreateCondBr(irb.CreateIsNotNull(step), moves_bb, zero_bb, llvm::MDBuilder(irb.getContext()).createBranchWeights(1 << 20, 1));
+				irb.SetInsertPoint(zero_bb);
+				irb.CreateCall(llvm::Intrinsic::getDeclaration(gen->mod.get(), llvm::Intrinsic::trap));
+				irb.CreateUnreachable();
+				irb.SetInsertPoint(moves_bb);
+			}
+			auto up = !signed_ || (cstep != nullptr && !cstep->isNegative());
+			auto down = signed_ && cstep != nullptr && cstep->isNegative();
+			auto within = [&](llvm::IRBuilder<>& b, llvm::Value* i) -> llvm::Value* {
+				llvm::Value *asc = nullptr, *desc = nullptr;
+				if (!down) asc = b.CreateICmp(times ? (signed_ ? llvm::CmpInst::ICMP_SLT : llvm::CmpInst::ICMP_ULT)
+					: (signed_ ? llvm::CmpInst::ICMP_SLE : llvm::CmpInst::ICMP_ULE), i, stop);
+				if (!up) desc = b.CreateICmpSGE(i, stop);
+				if (up) return asc;
+				if (down) return desc;
+				return b.CreateSelect(b.CreateICmpSGT(step, llvm::ConstantInt::get(step->getType(), 0)), asc, desc);
+			};
+			// whether another step from i, which is within the bounds, stays within them. i + step itself can overflow
+			// on the last iteration, so this compares the step with the distance left, which can't
+			auto again = [&](llvm::IRBuilder<>& b, llvm::Value* i) -> llvm::Value* {
+				llvm::Value *asc = nullptr, *desc = nullptr;
+				if (!down) asc = times ? b.CreateICmpUGT(b.CreateSub(stop, i), step) : b.CreateICmpUGE(b.CreateSub(stop, i), step);
+				if (!up) desc = b.CreateICmpUGE(b.CreateSub(i, stop), b.CreateNeg(step));
+				if (up) return asc;
+				if (down) return desc;
+				return b.CreateSelect(b.CreateICmpSGT(step, llvm::ConstantInt::get(step->getType(), 0)), asc, desc);
+			};
+
+			// the counter stays between start and stop, so if both are in bounds for every slice the body indexes with it,
+			// so is every index. that is checked once here, and the checks in the body pass without comparing if it holds
+			auto slices = times ? vector<symbol>{} : gen->slices_indexed_by(body_blk->argnames[0], body_blk, cx);
+			llvm::Value* ok = nullptr;
+			if (!slices.empty()) {
+				auto wide = llvm::Type::getInt64Ty(irb.getContext());
+				auto lo = up ? start : down ? stop : irb.CreateSelect(irb.CreateICmpSLT(start, stop), start, stop);
+				auto hi = up ? stop : down ? start : irb.CreateSelect(irb.CreateICmpSLT(start, stop), stop, start);
+				lo = irb.CreateIntCast(lo, wide, signed_);
+				hi = irb.CreateIntCast(hi, wide, signed_);
+				ok = signed_ ? irb.CreateICmpSGE(lo, llvm::ConstantInt::get(wide, 0)) : irb.getTrue();
+				for (auto v : slices) {
+					auto& b = cx->at(v);
+					auto sl = b.first->getType() == gen->type_of(b.second) ? b.first : irb.CreateLoad(b.first);
+					ok = irb.CreateAnd(ok, irb.CreateICmpULT(hi, irb.CreateZExt(irb.CreateExtractValue(sl, 1), wide)));
+				}
+			}
+
+			auto F = irb.GetInsertBlock()->getParent();
+			auto loopend_bb = llvm::BasicBlock::Create(irb.getContext(), "loopend");
+			auto before_bb = irb.GetInsertBlock();
+			auto loop_bb = llvm::BasicBlock::Create(irb.getContext(), "loop", F);
+			irb.CreateCondBr(within(irb, start), loop_bb, loopend_bb);
+
+			expr_generator loop_gen(gen, loop_bb, cx);
+			auto i = loop_gen.irb.CreatePHI(start->getType(), 2, "i");
+			i->addIncoming(start, before_bb);
+			for (auto v : slices) gen->in_bounds[{ cx->at(v).first, i }] = ok;
+			cx->push_scope();
+			if (!times) (*cx)[body_blk->argnames[0]] = { i, counter_t };
+			body_blk->body->visit(&loop_gen);
+			cx->pop_scope();
+			for (auto v : slices) gen->in_bounds.erase({ cx->at(v).first, i });
+			// only taken back to loop when it doesn't overflow
+			auto next = signed_ ? loop_gen.irb.CreateNSWAdd(i, step, "next") : loop_gen.irb.CreateNUWAdd(i, step, "next");
+			i->addIncoming(next, loop_gen.irb.GetInsertBlock());
+			loop_gen.irb.CreateCondBr(again(loop_gen.irb, i), loop_bb, loopend_bb);
+
+			F->getBasicBlockList().push_back(loopend_bb);
+			irb.SetInsertPoint(loopend_bb);
+		}
+		void code_generator::expr_generator::call(llvm::Function* fn, vector<llvm::Value*> args) {
+			llvm::Value* slot = nullptr;
+			if (fn->hasStructRetAttr()) {
+				slot = entry_alloca(fn->getFunctionType()->getParamType(0)->getPointerElementType(), "sret");
+				args.insert(args.begin(), slot);
+			}
+			for (unsigned i = 0; i < args.size(); ++i) {
+				if (fn->hasParamAttribute(i, llvm::Attribute::ByVal)) {
+					auto copy = entry_alloca(args[i]->getType(), "byval");
+					irb.CreateStore(args[i], copy);
+					args[i] = copy;
+				}
+			}
+			auto c = irb.CreateCall(gen->callee(fn), args);
+			c->setAttributes(fn->getAttributes());
+			if (slot != nullptr) s.push(irb.CreateLoad(slot));
+			else s.push(c);
 		}
 		void code_generator::expr_generator::visit(const nkqc::ast::cascade_msgsnd &x) {
 		}
@@ -233,14 +400,20 @@ namespace nkqc {
 				cx->insert_or_assign(x.name, vt, s.top());
 			}
 			else {
-				llvm::outs() << "assignment: ";
-				v->second.first->getType()->print(llvm::outs());
-				llvm::outs() << " -> ";
-				s.top()->getType()->print(llvm::outs());
-				llvm::outs() << "\n";
-				llvm::outs().flush();
-				if (!v->second.second->equals(vt))
+				if (gen->trace) {
+					llvm::outs() << "assignment: ";
+					v->second.first->getType()->print(llvm::outs());
+					llvm::outs() << " -> ";
+					s.top()->getType()->print(llvm::outs());
+					llvm::outs() << "\n";
+					llvm::outs().flush();
+				}
+				// the named return value has its slot before it has a type
+				if (v->second.second != vt && v->second.second != nullptr)
 					throw type_mismatch_error("assignment", v->second.second, vt);
+				v->second.second = vt;
+				if (v->second.first->getType() == gen->type_of(vt))
+					throw internal_codegen_error("can't assign to " + sym_name(x.name) + ", which is a loop counter or a copy captured by a block that can escape");
 				irb.CreateStore(s.top(), v->second.first);
 			}
 		}
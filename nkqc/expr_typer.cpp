@@ -2,55 +2,73 @@
 
 namespace nkqc {
 	namespace codegen {
+		void code_generator::expr_typer::annotate(const ast::expr* x) {
+			auto depth = s.size();
+			x->visit(this);
+			gen->typer_visits++;
+			if (record && s.size() > depth)
+				gen->expr_types[x] = s.top()->resolve(gen);
+		}
 		void code_generator::expr_typer::visit(const nkqc::ast::id_expr &x) {
-			if (x.v == "true" || x.v == "false") {
-				s.push(make_shared<bool_type>());
+			if (x.v == sym_true || x.v == sym_false) {
+				s.push(gen->universe.boolean());
 			}
 			else s.push(cx->at(x.v).second);
 		}
 		void code_generator::expr_typer::visit(const nkqc::ast::string_expr &x) {
-			s.push(make_shared<array_type>(x.v.size(), make_shared<integer_type>(false, 8)));
+			s.push(gen->universe.array_of(x.v.size(), gen->universe.integer(false, 8)));
 		}
 		void code_generator::expr_typer::visit(const nkqc::ast::number_expr &x) {
 			if (x.type == 'i') {
-				s.push(make_shared<integer_type>(true, 32));
+				s.push(gen->universe.integer(true, 32));
 			}
-			else throw internal_codegen_error("floating point literals currently unsupported");
+			else s.push(gen->universe.floating(64));
 		}
 		void code_generator::expr_typer::visit(const nkqc::ast::block_expr &x) {
-			x.body->visit(this);
+			annotate(x.body);
 		}
 		void code_generator::expr_typer::visit(const nkqc::ast::symbol_expr &x) {
 		}
 		void code_generator::expr_typer::visit(const nkqc::ast::char_expr &x) {
 		}
 		void code_generator::expr_typer::visit(const nkqc::ast::array_expr &x) {
+			// a literal array of numbers is a constant vector, of i32 lanes for integers and f64 lanes for floats
+			shared_ptr<type_id> lane;
+			for (auto v : x.vs) {
+				auto n = dynamic_cast<ast::number_expr*>(v);
+				if (n == nullptr) throw internal_codegen_error("only number literals can appear in a vector literal");
+				auto t = n->type == 'i' ? gen->universe.integer(true, 32) : gen->universe.floating(64);
+				if (lane != nullptr && lane != t) throw internal_codegen_error("vector literal mixes integers and floats");
+				lane = t;
+			}
+			if (lane == nullptr) throw internal_codegen_error("empty vector literal");
+			s.push(gen->universe.vector_of(x.vs.size(), lane));
 		}
 		void code_generator::expr_typer::visit(const nkqc::ast::tag_expr &x) {
 		}
 		void code_generator::expr_typer::visit(const nkqc::ast::seq_expr &x) {
-			x.first->visit(this);
+			annotate(x.first);
 			s.pop(); // discard type of first expression, evaluate it only for side effects
-			x.second->visit(this);
+			annotate(x.second);
 		}
 		void code_generator::expr_typer::visit(const nkqc::ast::return_expr &x) {
-			x.val->visit(this);
+			annotate(x.val);
 		}
 		void code_generator::expr_typer::visit(const nkqc::ast::unary_msgsnd &x) {
-			auto glob = dynamic_pointer_cast<nkqc::ast::symbol_expr>(x.rcv);
-			auto tx = dynamic_pointer_cast<nkqc::parser::type_expr>(x.rcv);
+			auto glob = dynamic_cast<nkqc::ast::symbol_expr*>(x.rcv);
+			auto tx = dynamic_cast<nkqc::parser::type_expr*>(x.rcv);
 			shared_ptr<type_id> rcv_t;
-			if (glob != nullptr && glob->v == "G") {
+			if (glob != nullptr && glob->v == sym_G) {
 				rcv_t = nullptr;
 			}
 			else if (tx != nullptr) {
 				rcv_t = tx->type->resolve(gen);
 			}
 			else {
-				x.rcv->visit(this);
+				annotate(x.rcv);
 				rcv_t = s.top()->resolve(gen); s.pop();
 				if (rcv_t->receive_by_ref())
-					rcv_t = make_shared<ptr_type>(rcv_t);
+					rcv_t = gen->universe.ptr_to(rcv_t);
 			}
 			auto f = gen->lookup_function(x.msgname, rcv_t, {});
 			if (f != nullptr) {
@@ -59,18 +77,18 @@ namespace nkqc {
 			else throw no_such_function_error("attempted to compute return type for unary function", x.msgname, rcv_t, {});
 		}
 		void code_generator::expr_typer::visit(const nkqc::ast::binary_msgsnd &x) {
-			auto tx = dynamic_pointer_cast<parser::type_expr>(x.rcv);
-			x.rhs->visit(this);
+			auto tx = dynamic_cast<parser::type_expr*>(x.rcv);
+			annotate(x.rhs);
 			shared_ptr<type_id> rhs = s.top()->resolve(gen), rcv = nullptr;
 			s.pop();
 			if (tx != nullptr) {
 				rcv = tx->type->resolve(gen);
 			}
 			else {
-				x.rcv->visit(this);
+				annotate(x.rcv);
 				rcv = s.top()->resolve(gen); s.pop();
 				if (rcv->receive_by_ref())
-					rcv = make_shared<ptr_type>(rcv);
+					rcv = gen->universe.ptr_to(rcv);
 			}
 			auto sf = gen->lookup_function(x.op, rcv, { rhs });
 			if (sf != nullptr)
@@ -79,33 +97,66 @@ namespace nkqc {
 				throw no_such_function_error("attempted to compute return type", x.op, rcv, { rhs });
 		}
 		void code_generator::expr_typer::visit(const nkqc::ast::keyword_msgsnd &x) {
-			auto glob = dynamic_pointer_cast<nkqc::ast::symbol_expr>(x.rcv);
-			auto tx = dynamic_pointer_cast<nkqc::parser::type_expr>(x.rcv);
-			auto block_rcv = dynamic_pointer_cast<nkqc::ast::block_expr>(x.rcv);
+			auto glob = dynamic_cast<nkqc::ast::symbol_expr*>(x.rcv);
+			auto tx = dynamic_cast<nkqc::parser::type_expr*>(x.rcv);
+			auto block_rcv = dynamic_cast<nkqc::ast::block_expr*>(x.rcv);
 			shared_ptr<type_id> rcv_t;
-			if (glob != nullptr && glob->v == "G") {
+			if (glob != nullptr && glob->v == sym_G) {
 				rcv_t = nullptr;
 			}
 			else if (tx != nullptr) {
 				rcv_t = tx->type->resolve(gen);
 			}
 			else if (block_rcv != nullptr) {
-				s.push(make_shared<unit_type>());
+				// type the condition and the loop body too so that they are annotated for the generator
+				annotate(x.rcv); s.pop();
+				for (const auto& arg : x.args) {
+					annotate(arg); s.pop();
+				}
+				s.push(gen->universe.unit());
 				return;
 			}
 			else {
-				x.rcv->visit(this);
+				annotate(x.rcv);
 				rcv_t = s.top()->resolve(gen); s.pop();
 				if (rcv_t->receive_by_ref())
-					rcv_t = make_shared<ptr_type>(rcv_t);
+					rcv_t = gen->universe.ptr_to(rcv_t);
 			}
-			vector<shared_ptr<type_id>> arg_t;
-			for (const auto& arg : x.args) {
-				arg->visit(this);
-				arg_t.push_back(s.top()->resolve(gen)); s.pop();
+			if (dynamic_pointer_cast<integer_type>(rcv_t) != nullptr
+				&& (x.msgname == sym_to_do_ || x.msgname == sym_to_by_do_ || x.msgname == sym_timesRepeat_)) {
+				// the bounds are typed as usual, the body with its argument bound to the counter
+				for (size_t i = 0; i + 1 < x.args.size(); ++i) {
+					annotate(x.args[i]); s.pop();
+				}
+				auto body = dynamic_cast<ast::block_expr*>(x.args.back());
+				cx->push_scope();
+				if (body != nullptr && body->argnames.size() == 1) (*cx)[body->argnames[0]].second = rcv_t;
+				annotate(x.args.back()); s.pop();
+				cx->pop_scope();
+				s.push(gen->universe.unit());
+				return;
+			}
+			// the other arguments are typed first, so that each block literal is typed for the overload they pick out
+			vector<shared_ptr<type_id>> arg_t(x.args.size());
+			for (size_t i = 0; i < x.args.size(); ++i) {
+				if (dynamic_cast<ast::block_expr*>(x.args[i]) != nullptr) continue;
+				annotate(x.args[i]);
+				arg_t[i] = s.top()->resolve(gen); s.pop();
+			}
+			auto known = arg_t;
+			for (size_t i = 0; i < x.args.size(); ++i) {
+				auto blk = dynamic_cast<ast::block_expr*>(x.args[i]);
+				if (blk == nullptr) continue;
+				auto ft = gen->closure_type(x.msgname, rcv_t, known, x.args, i);
+				if (ft != nullptr) {
+					arg_t[i] = closure(*blk, ft);
+					continue;
+				}
+				annotate(x.args[i]);
+				arg_t[i] = s.top()->resolve(gen); s.pop();
 			}
 			if (dynamic_pointer_cast<bool_type>(rcv_t) != nullptr) {
-				if (x.msgname == "ifTrue:ifFalse:") {
+				if (x.msgname == sym_ifTrue_ifFalse_) {
 					s.push(arg_t[0]);
 					return;
 				}
@@ -116,13 +167,26 @@ namespace nkqc {
 			}
 			else throw no_such_function_error("attempted to compute return type", x.msgname, rcv_t, arg_t);
 		}
+		shared_ptr<type_id> code_generator::expr_typer::closure(const ast::block_expr& x, shared_ptr<function_type> ft) {
+			// the body sees the block's arguments and every variable in scope where the block is written
+			cx->push_scope();
+			for (size_t i = 0; i < x.argnames.size(); ++i) (*cx)[x.argnames[i]].second = ft->args[i];
+			annotate(x.body);
+			auto rt = s.top()->resolve(gen); s.pop();
+			cx->pop_scope();
+			// the value of a block returning () is thrown away, so its body can end in anything
+			if (ft->return_type != gen->universe.unit() && rt != ft->return_type)
+				throw type_mismatch_error("block returns a different type than the parameter it is passed for", ft->return_type, rt);
+			if (record) gen->expr_types[&x] = ft;
+			return ft;
+		}
 		void code_generator::expr_typer::visit(const nkqc::ast::cascade_msgsnd &x) {
 		}
 		void code_generator::expr_typer::visit(const nkqc::ast::assignment_expr &x) {
-			x.val->visit(this);
+			annotate(x.val);
 			cx->insert_or_assign(x.name, s.top());
 			s.pop();
-			s.push(make_shared<unit_type>());
+			s.push(gen->universe.unit());
 		}
 	}
 }
\ No newline at end of file
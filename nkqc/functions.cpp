@@ -2,16 +2,23 @@
 
 namespace nkqc {
 	namespace codegen {
+		// the lane type of a vector, or t itself for a scalar
+		static shared_ptr<type_id> lane_type(shared_ptr<type_id> t) {
+			auto vt = dynamic_pointer_cast<vector_type>(t);
+			return vt != nullptr ? vt->element : t;
+		}
+		static bool is_number(shared_ptr<type_id> t) {
+			return dynamic_pointer_cast<integer_type>(t) != nullptr || dynamic_pointer_cast<float_type>(t) != nullptr;
+		}
+
 		// ------binary operator-----------------------------
 		void code_generator::binary_llvm_op::apply(expr_generator* g, llvm::Value* rcv, const vector<llvm::Value*>& args, shared_ptr<type_id> rcv_t, const vector<shared_ptr<type_id>>& args_t) {
-			g->s.push(g->irb.CreateBinOp(op, rcv, args[0]));
+			g->s.push(g->irb.CreateBinOp(rcv->getType()->getScalarType()->isFloatingPointTy() ? fop : op, rcv, args[0]));
 		}
 
 		bool code_generator::binary_llvm_op::can_apply(shared_ptr<type_id> rcv, const vector<shared_ptr<type_id>>& args) {
 			if (args.size() != 1) return false;
-			auto rcv_int = dynamic_pointer_cast<integer_type>(rcv);
-			auto arg_int = dynamic_pointer_cast<integer_type>(args[0]);
-			return rcv_int != nullptr && arg_int != nullptr && rcv_int->bitwidth == arg_int->bitwidth && rcv_int->signed_ == arg_int->signed_;
+			return rcv == args[0] && is_number(lane_type(rcv));
 		}
 
 		shared_ptr<type_id> code_generator::binary_llvm_op::return_type(code_generator* e, shared_ptr<type_id> rcv, const vector<shared_ptr<type_id>>& args) {
@@ -31,18 +38,21 @@ namespace nkqc {
 		}
 
 		bool code_generator::numeric_comp_op::can_apply(shared_ptr<type_id> rcv, const vector<shared_ptr<type_id>>& args) {
-			if (args.size() != 1 || !rcv->equals(args[0])) return false;
+			if (args.size() != 1 || rcv != args[0]) return false;
 			if (floating) {
-				throw internal_codegen_error("floating not yet supported");
+				return dynamic_pointer_cast<float_type>(lane_type(rcv)) != nullptr;
 			}
 			else {
-				return dynamic_pointer_cast<integer_type>(rcv) != nullptr;
+				return dynamic_pointer_cast<integer_type>(lane_type(rcv)) != nullptr;
 			}
 		}
 
 		shared_ptr<type_id> code_generator::numeric_comp_op::return_type(code_generator* e, shared_ptr<type_id> rcv, const vector<shared_ptr<type_id>>& args) {
 			if (!can_apply(rcv, args)) throw internal_codegen_error("tried to find return type for invalid function application");
-			return make_shared<bool_type>();
+			// vectors compare lane by lane
+			auto vt = dynamic_pointer_cast<vector_type>(rcv);
+			if (vt != nullptr) return e->universe.vector_of(vt->count, e->universe.boolean());
+			return e->universe.boolean();
 		}
 		// -------------------------------------------------
 
@@ -67,22 +77,24 @@ namespace nkqc {
 			if (rcv != nullptr) throw internal_codegen_error("tried to apply an external function with a non-null reciever");
 			for (int i = 0; i < args.size(); ++i) {
 				auto v = args[i];
-				v->getType()->print(llvm::outs(), true);
-				llvm::outs() << ",";
-				llvm::outs().flush();
+				if (g->gen->trace) {
+					v->getType()->print(llvm::outs(), true);
+					llvm::outs() << ",";
+					llvm::outs().flush();
+				}
 				if (v->getType() != args_t[i]->llvm_type(g->gen->mod->getContext())) {
 					throw internal_codegen_error("tried to apply external function and found values that had types that did not match given argument types");
 				}
 			}
-			llvm::outs() << "\n";
-			g->s.push(g->irb.CreateCall(f, args));
+			if (g->gen->trace) llvm::outs() << "\n";
+			g->s.push(g->irb.CreateCall(g->gen->callee(f), args));
 		}
 
 		bool code_generator::extern_fn::can_apply(shared_ptr<type_id> rcv, const vector<shared_ptr<type_id>>& targs) {
 			if (rcv != nullptr) return false;
 			if (targs.size() != args.size()) return false;
 			for (int i = 0; i < args.size(); ++i) {
-				if (!targs[i]->equals(args[i].second)) return false;
+				if (targs[i] != args[i].second) return false;
 			}
 			return true;
 		}
@@ -95,13 +107,17 @@ namespace nkqc {
 		
 		// -----generic llvm function-----------------------
 		void code_generator::llvm_function::apply(expr_generator* g, llvm::Value* rcv, const vector<llvm::Value*>& args, shared_ptr<type_id> rcv_t, const vector<shared_ptr<type_id>>& args_t) {
-			g->s.push(g->irb.CreateCall(f, args));
+			apply_as(f, g, rcv, args, rcv_t, args_t);
+		}
+
+		void code_generator::llvm_function::apply_as(llvm::Function* fn, expr_generator* g, llvm::Value* rcv, const vector<llvm::Value*>& args, shared_ptr<type_id> rcv_t, const vector<shared_ptr<type_id>>& args_t) {
+			g->call(fn, args);
 		}
 
 		bool code_generator::llvm_function::can_apply(shared_ptr<type_id> rcv, const vector<shared_ptr<type_id>>& args) {
 			if (args.size() != decl.args.size()) return false;
 			for (int i = 0; i < args.size(); ++i) {
-				if (!args[i]->equals(decl.args[i].second)) return false;
+				if (args[i] != decl.args[i].second) return false;
 			}
 			return true;
 		}
@@ -111,36 +127,74 @@ namespace nkqc {
 			if (decl.return_type) {
 				return decl.return_type->resolve(gen);
 			}
-			else {
-				expr_context fncx;
-				expr_typer ty{ gen, &fncx };
-				for (int i = 0; i < decl.args.size(); ++i) {
-					ty.cx->insert_or_assign(decl.args[i].first, args[i]);
-				}
-				ty.visit(decl.body);
-				auto v = ty.s.top(); ty.s.pop();
+			auto key = make_pair((const function*)this, type_signature(rcv, args));
+			auto cached = gen->inferred_return_types.find(key);
+			if (cached != gen->inferred_return_types.end()) {
+				if (cached->second == nullptr)
+					throw internal_codegen_error("cannot infer the return type of recursive function " + sym_name(decl.selector) + ", it must be declared with -> type");
+				return cached->second;
+			}
+			gen->inferred_return_types[key] = nullptr;
+			try {
+				auto v = infer_return_type(gen, rcv, args);
+				gen->inferred_return_types[key] = v;
 				return v;
 			}
+			catch (...) {
+				gen->inferred_return_types.erase(key);
+				throw;
+			}
+		}
+
+		shared_ptr<type_id> code_generator::llvm_function::infer_return_type(code_generator* gen, shared_ptr<type_id> rcv, const vector<shared_ptr<type_id>>& args) {
+			expr_context fncx;
+			expr_typer ty{ gen, &fncx };
+			for (int i = 0; i < decl.args.size(); ++i) {
+				ty.cx->insert_or_assign(decl.args[i].first, args[i]);
+			}
+			ty.annotate(decl.body);
+			auto v = ty.s.top()->resolve(gen); ty.s.pop();
+			return v;
+		}
+		// -------------------------------------------------
+
+		// -----closure call--------------------------------
+		void code_generator::closure_call_op::apply(expr_generator* g, llvm::Value* rcv, const vector<llvm::Value*>& args, shared_ptr<type_id> rcv_t, const vector<shared_ptr<type_id>>& args_t) {
+			// a variable sent a unary message arrives as the place it is stored
+			if (rcv->getType()->isPointerTy()) rcv = g->irb.CreateLoad(rcv);
+			vector<llvm::Value*> cargs{ g->irb.CreateExtractValue(rcv, 1) };
+			cargs.insert(cargs.end(), args.begin(), args.end());
+			g->s.push(g->irb.CreateCall(g->irb.CreateExtractValue(rcv, 0), cargs));
+		}
+		bool code_generator::closure_call_op::can_apply(shared_ptr<type_id> rcv, const vector<shared_ptr<type_id>>& args) {
+			auto ft = dynamic_pointer_cast<function_type>(rcv);
+			if (ft == nullptr || ft->args.size() != args.size()) return false;
+			for (size_t i = 0; i < args.size(); ++i) {
+				if (args[i] != ft->args[i]) return false;
+			}
+			return true;
+		}
+		shared_ptr<type_id> code_generator::closure_call_op::return_type(code_generator* e, shared_ptr<type_id> rcv, const vector<shared_ptr<type_id>>& args) {
+			if (!can_apply(rcv, args)) throw internal_codegen_error("tried to find return type for invalid function application");
+			return dynamic_pointer_cast<function_type>(rcv)->return_type;
 		}
 		// -------------------------------------------------
 
 		// -----struct initializer--------------------------
 		void code_generator::struct_initializer::apply(expr_generator* g, llvm::Value* rcv, const vector<llvm::Value*>& args, shared_ptr<type_id> rcv_t, const vector<shared_ptr<type_id>>& args_t) {
-			auto v = g->irb.CreateAlloca(type->llvm_type(g->gen->mod->getContext()));
-			auto i32t = llvm::Type::getInt32Ty(g->gen->mod->getContext());
-			auto zero = llvm::ConstantInt::get(i32t, 0, false);
-			for (int i = 0; i < args.size(); ++i) {
-				auto p = g->irb.CreateGEP(v, { zero, llvm::ConstantInt::get(i32t, i, false) });
-				g->irb.CreateStore(args[i], p);
+			// built up in registers, so a struct that is returned or passed on is never stored on the way
+			llvm::Value* v = llvm::UndefValue::get(type->llvm_type(g->gen->mod->getContext()));
+			for (unsigned i = 0; i < args.size(); ++i) {
+				v = g->irb.CreateInsertValue(v, args[i], i);
 			}
-			g->s.push(g->irb.CreateLoad(g->irb.CreateGEP(v, { zero })));
+			g->s.push(v);
 		}
 
 		bool code_generator::struct_initializer::can_apply(shared_ptr<type_id> rcv, const vector<shared_ptr<type_id>>& args) {
-			if (!type->equals(rcv)) return false;
+			if (type != rcv) return false;
 			if (args.size() != type->fields.size()) return false;
 			for (int i = 0; i < args.size(); ++i) {
-				if (!args[i]->equals(type->fields[i].second)) return false;
+				if (args[i] != type->fields[i].second) return false;
 			}
 			return true;
 		}
@@ -152,7 +206,7 @@ namespace nkqc {
 		// -------------------------------------------------
 
 		// -----method--------------------------------------
-		void code_generator::method::apply(expr_generator* g, llvm::Value* rcv, const vector<llvm::Value*>& args, shared_ptr<type_id> rcv_t, const vector<shared_ptr<type_id>>& args_t) {
+		void code_generator::method::apply_as(llvm::Function* fn, expr_generator* g, llvm::Value* rcv, const vector<llvm::Value*>& args, shared_ptr<type_id> rcv_t, const vector<shared_ptr<type_id>>& args_t) {
 			if (rcv == nullptr) throw internal_codegen_error("tried to apply a method function with a non-null reciever");
 			vector<llvm::Value*> aargs;
 
@@ -161,50 +215,51 @@ namespace nkqc {
 			auto zero = llvm::ConstantInt::get(g->irb.getContext(), llvm::APInt(32, 0));
 			auto ref = g->irb.CreateGEP(rcv->getType(), alc, { zero, });*/
 
-			llvm::outs() << "\n--\nf = ";
-			f->getType()->print(llvm::outs(), true);
-			llvm::outs() << "\nrcv  = ";
-			rcv->getType()->print(llvm::outs());
-			llvm::outs() << "\nrcv_t = ";
-			rcv_t->llvm_type(g->irb.getContext())->print(llvm::outs());
-			llvm::outs() << " ~ ";
-			llvm::outs().flush();
-			rcv_t->print(cout);
-			cout.flush();
-			llvm::outs() << "\nd_rcv = ";
-			decl.receiver->llvm_type(g->irb.getContext())->print(llvm::outs());
-			llvm::outs() << " ~ ";
-			llvm::outs().flush();
-			decl.receiver->print(cout);
-			cout.flush();
-			/*llvm::outs() << "\n";
-			ref->getType()->print(llvm::outs());
-			llvm::outs() << "=";
-			alc->getType()->print(llvm::outs());*/
-			llvm::outs() << "\n--\n";
-			llvm::outs().flush();
+			if (g->gen->trace) {
+				llvm::outs() << "\n--\nf = ";
+				f->getType()->print(llvm::outs(), true);
+				llvm::outs() << "\nrcv  = ";
+				rcv->getType()->print(llvm::outs());
+				llvm::outs() << "\nrcv_t = ";
+				rcv_t->llvm_type(g->irb.getContext())->print(llvm::outs());
+				llvm::outs() << " ~ ";
+				llvm::outs().flush();
+				rcv_t->print(cout);
+				cout.flush();
+				llvm::outs() << "\nd_rcv = ";
+				decl.receiver->llvm_type(g->irb.getContext())->print(llvm::outs());
+				llvm::outs() << " ~ ";
+				llvm::outs().flush();
+				decl.receiver->print(cout);
+				cout.flush();
+				/*llvm::outs() << "\n";
+				ref->getType()->print(llvm::outs());
+				llvm::outs() << "=";
+				alc->getType()->print(llvm::outs());*/
+				llvm::outs() << "\n--\n";
+				llvm::outs().flush();
+			}
 
 			if (rcv->getType()->isPointerTy() && rcv->getType()->getPointerElementType()->isPointerTy()) //dynamic_pointer_cast<ptr_type>(rcv_t) != nullptr)
 				aargs.push_back(g->irb.CreateLoad(rcv));
 			else
 				aargs.push_back(rcv);
 			aargs.insert(aargs.end(), args.begin(), args.end());
-			g->s.push(g->irb.CreateCall(f, aargs));
+			g->call(fn, aargs);
 		}
 
 		bool code_generator::method::can_apply(shared_ptr<type_id> rcv, const vector<shared_ptr<type_id>>& args) {
-			if (!rcv->equals(decl.receiver)) return false;
+			if (rcv != decl.receiver) return false;
 			return llvm_function::can_apply(rcv, args);
 		}
 
-		shared_ptr<type_id> code_generator::method::return_type(code_generator* gen, shared_ptr<type_id> rcv, const vector<shared_ptr<type_id>>& args) {
-			if (!can_apply(rcv, args)) throw internal_codegen_error("tried to find return type for invalid function application");
+		shared_ptr<type_id> code_generator::method::infer_return_type(code_generator* gen, shared_ptr<type_id> rcv, const vector<shared_ptr<type_id>>& args) {
 			expr_context fncx;
 			expr_typer ty{ gen, &fncx };
 			for (int i = 0; i < decl.args.size(); ++i) {
 				ty.cx->insert_or_assign(decl.args[i].first, args[i]);
 			}
-			ty.cx->insert_or_assign("self", rcv);
+			ty.cx->insert_or_assign(sym_self, rcv);
 			auto ptr = dynamic_pointer_cast<ptr_type>(rcv);
 			if (ptr != nullptr) {
 				auto strct = dynamic_pointer_cast<struct_type>(ptr->inner);
@@ -214,8 +269,8 @@ namespace nkqc {
 					}
 				}
 			}
-			ty.visit(decl.body);
-			auto v = ty.s.top(); ty.s.pop();
+			ty.annotate(decl.body);
+			auto v = ty.s.top()->resolve(gen); ty.s.pop();
 			return v;
 		}
 		// -------------------------------------------------
@@ -241,36 +296,193 @@ namespace nkqc {
 			auto p = dynamic_pointer_cast<ptr_type>(rcv);
 			return p != nullptr &&
 				args.size() == 2 && dynamic_pointer_cast<integer_type>(args[0]) != nullptr &&
-				p->inner->equals(args[1]);
+				p->inner == args[1];
 		}
 		shared_ptr<type_id> code_generator::pointer_index_store_op::return_type(code_generator* e, shared_ptr<type_id> rcv, const vector<shared_ptr<type_id>>& args) {
 			if (!can_apply(rcv, args)) throw internal_codegen_error("tried to find return type for invalid function application");
-			return make_shared<unit_type>();
+			return e->universe.unit();
+		}
+		// -------------------------------------------------
+
+		// -----vector operations---------------------------
+		// unary sends pass a variable receiver by its address, other sends pass the value
+		static llvm::Value* by_value(code_generator::expr_generator* g, llvm::Value* rcv) {
+			return rcv->getType()->isPointerTy() ? g->irb.CreateLoad(rcv) : rcv;
+		}
+		static llvm::Value* shuffle_mask(llvm::LLVMContext& c, const vector<uint32_t>& lanes) {
+			return llvm::ConstantDataVector::get(c, lanes);
+		}
+
+		void code_generator::vector_splat_op::apply(expr_generator* g, llvm::Value* rcv, const vector<llvm::Value*>& args, shared_ptr<type_id> rcv_t, const vector<shared_ptr<type_id>>& args_t) {
+			if (rcv != nullptr) throw internal_codegen_error("tried to apply splat: with a non-null reciever");
+			g->s.push(g->irb.CreateVectorSplat((unsigned)dynamic_pointer_cast<vector_type>(rcv_t)->count, args[0]));
+		}
+		bool code_generator::vector_splat_op::can_apply(shared_ptr<type_id> rcv, const vector<shared_ptr<type_id>>& args) {
+			auto vt = dynamic_pointer_cast<vector_type>(rcv);
+			return vt != nullptr && args.size() == 1 && args[0] == vt->element;
+		}
+		shared_ptr<type_id> code_generator::vector_splat_op::return_type(code_generator* e, shared_ptr<type_id> rcv, const vector<shared_ptr<type_id>>& args) {
+			if (!can_apply(rcv, args)) throw internal_codegen_error("tried to find return type for invalid function application");
+			return rcv;
+		}
+
+		void code_generator::vector_extract_op::apply(expr_generator* g, llvm::Value* rcv, const vector<llvm::Value*>& args, shared_ptr<type_id> rcv_t, const vector<shared_ptr<type_id>>& args_t) {
+			g->s.push(g->irb.CreateExtractElement(rcv, args[0]));
+		}
+		bool code_generator::vector_extract_op::can_apply(shared_ptr<type_id> rcv, const vector<shared_ptr<type_id>>& args) {
+			return dynamic_pointer_cast<vector_type>(rcv) != nullptr && args.size() == 1 && dynamic_pointer_cast<integer_type>(args[0]) != nullptr;
+		}
+		shared_ptr<type_id> code_generator::vector_extract_op::return_type(code_generator* e, shared_ptr<type_id> rcv, const vector<shared_ptr<type_id>>& args) {
+			if (!can_apply(rcv, args)) throw internal_codegen_error("tried to find return type for invalid function application");
+			return dynamic_pointer_cast<vector_type>(rcv)->element;
+		}
+
+		void code_generator::vector_insert_op::apply(expr_generator* g, llvm::Value* rcv, const vector<llvm::Value*>& args, shared_ptr<type_id> rcv_t, const vector<shared_ptr<type_id>>& args_t) {
+			g->s.push(g->irb.CreateInsertElement(rcv, args[1], args[0]));
+		}
+		bool code_generator::vector_insert_op::can_apply(shared_ptr<type_id> rcv, const vector<shared_ptr<type_id>>& args) {
+			auto vt = dynamic_pointer_cast<vector_type>(rcv);
+			return vt != nullptr && args.size() == 2 && dynamic_pointer_cast<integer_type>(args[0]) != nullptr && args[1] == vt->element;
+		}
+		shared_ptr<type_id> code_generator::vector_insert_op::return_type(code_generator* e, shared_ptr<type_id> rcv, const vector<shared_ptr<type_id>>& args) {
+			if (!can_apply(rcv, args)) throw internal_codegen_error("tried to find return type for invalid function application");
+			return rcv;
+		}
+
+		void code_generator::vector_shuffle_op::apply(expr_generator* g, llvm::Value* rcv, const vector<llvm::Value*>& args, shared_ptr<type_id> rcv_t, const vector<shared_ptr<type_id>>& args_t) {
+			if (!llvm::isa<llvm::Constant>(args[1])) throw internal_codegen_error("a shuffle mask must be a vector literal");
+			// lanes pick from the receiver and then the argument, so they index 2 * count lanes
+			auto lanes = 2 * dynamic_pointer_cast<vector_type>(rcv_t)->count;
+			auto mask = llvm::cast<llvm::Constant>(args[1]);
+			for (size_t i = 0; i < dynamic_pointer_cast<vector_type>(args_t[1])->count; ++i) {
+				auto lane = llvm::dyn_cast_or_null<llvm::ConstantInt>(mask->getAggregateElement((unsigned)i));
+				if (lane == nullptr || lane->getValue().uge(lanes))
+					throw internal_codegen_error("shuffle mask lane " + to_string(i) + " is not a lane of the two vectors");
+			}
+			g->s.push(g->irb.CreateShuffleVector(rcv, args[0], args[1]));
+		}
+		bool code_generator::vector_shuffle_op::can_apply(shared_ptr<type_id> rcv, const vector<shared_ptr<type_id>>& args) {
+			if (dynamic_pointer_cast<vector_type>(rcv) == nullptr || args.size() != 2 || args[0] != rcv) return false;
+			auto mask = dynamic_pointer_cast<vector_type>(args[1]);
+			return mask != nullptr && dynamic_pointer_cast<integer_type>(mask->element) != nullptr;
+		}
+		shared_ptr<type_id> code_generator::vector_shuffle_op::return_type(code_generator* e, shared_ptr<type_id> rcv, const vector<shared_ptr<type_id>>& args) {
+			if (!can_apply(rcv, args)) throw internal_codegen_error("tried to find return type for invalid function application");
+			return e->universe.vector_of(dynamic_pointer_cast<vector_type>(args[1])->count, dynamic_pointer_cast<vector_type>(rcv)->element);
+		}
+
+		void code_generator::vector_reduce_op::apply(expr_generator* g, llvm::Value* rcv, const vector<llvm::Value*>& args, shared_ptr<type_id> rcv_t, const vector<shared_ptr<type_id>>& args_t) {
+			auto vt = dynamic_pointer_cast<vector_type>(rcv_t);
+			auto it = dynamic_pointer_cast<integer_type>(vt->element);
+			auto& irb = g->irb;
+			auto combine = [&](llvm::Value* a, llvm::Value* b) -> llvm::Value* {
+				switch (kind) {
+				case sum: return it != nullptr ? irb.CreateAdd(a, b) : irb.CreateFAdd(a, b);
+				case product: return it != nullptr ? irb.CreateMul(a, b) : irb.CreateFMul(a, b);
+				default: {
+					llvm::Value* lt;
+					if (it == nullptr) lt = kind == min ? irb.CreateFCmpOLT(a, b) : irb.CreateFCmpOGT(a, b);
+					else if (it->signed_) lt = kind == min ? irb.CreateICmpSLT(a, b) : irb.CreateICmpSGT(a, b);
+					else lt = kind == min ? irb.CreateICmpULT(a, b) : irb.CreateICmpUGT(a, b);
+					return irb.CreateSelect(lt, a, b);
+				}
+				}
+			};
+			auto v = by_value(g, rcv);
+			auto n = vt->count;
+			while (n > 1 && n % 2 == 0) {
+				vector<uint32_t> lo, hi;
+				for (uint32_t i = 0; i < n / 2; ++i) {
+					lo.push_back(i);
+					hi.push_back(i + (uint32_t)n / 2);
+				}
+				auto undef = llvm::UndefValue::get(v->getType());
+				v = combine(irb.CreateShuffleVector(v, undef, shuffle_mask(irb.getContext(), lo)),
+					irb.CreateShuffleVector(v, undef, shuffle_mask(irb.getContext(), hi)));
+				n /= 2;
+			}
+			auto r = irb.CreateExtractElement(v, irb.getInt32(0));
+			for (uint32_t i = 1; i < n; ++i) r = combine(r, irb.CreateExtractElement(v, irb.getInt32(i)));
+			g->s.push(r);
+		}
+		bool code_generator::vector_reduce_op::can_apply(shared_ptr<type_id> rcv, const vector<shared_ptr<type_id>>& args) {
+			auto vt = dynamic_pointer_cast<vector_type>(rcv);
+			return vt != nullptr && args.size() == 0 && is_number(vt->element);
+		}
+		shared_ptr<type_id> code_generator::vector_reduce_op::return_type(code_generator* e, shared_ptr<type_id> rcv, const vector<shared_ptr<type_id>>& args) {
+			if (!can_apply(rcv, args)) throw internal_codegen_error("tried to find return type for invalid function application");
+			return dynamic_pointer_cast<vector_type>(rcv)->element;
+		}
+
+		// the alignment of one lane of a vector, which is all a pointer into an array of its elements guarantees
+		static unsigned lane_alignment(llvm::Type* vt) {
+			return max(1u, vt->getScalarSizeInBits() / 8);
+		}
+
+		void code_generator::vector_load_op::apply(expr_generator* g, llvm::Value* rcv, const vector<llvm::Value*>& args, shared_ptr<type_id> rcv_t, const vector<shared_ptr<type_id>>& args_t) {
+			if (rcv != nullptr) throw internal_codegen_error("tried to apply load:at: with a non-null reciever");
+			auto vt = g->gen->type_of(rcv_t);
+			auto p = g->irb.CreateBitCast(g->irb.CreateGEP(args[0], args[1]), vt->getPointerTo());
+			g->s.push(g->irb.CreateAlignedLoad(p, lane_alignment(vt)));
+		}
+		bool code_generator::vector_load_op::can_apply(shared_ptr<type_id> rcv, const vector<shared_ptr<type_id>>& args) {
+			auto vt = dynamic_pointer_cast<vector_type>(rcv);
+			if (vt == nullptr || args.size() != 2 || dynamic_pointer_cast<integer_type>(args[1]) == nullptr) return false;
+			auto p = dynamic_pointer_cast<ptr_type>(args[0]);
+			return p != nullptr && p->inner == vt->element;
+		}
+		shared_ptr<type_id> code_generator::vector_load_op::return_type(code_generator* e, shared_ptr<type_id> rcv, const vector<shared_ptr<type_id>>& args) {
+			if (!can_apply(rcv, args)) throw internal_codegen_error("tried to find return type for invalid function application");
+			return rcv;
+		}
+
+		void code_generator::vector_store_op::apply(expr_generator* g, llvm::Value* rcv, const vector<llvm::Value*>& args, shared_ptr<type_id> rcv_t, const vector<shared_ptr<type_id>>& args_t) {
+			auto p = g->irb.CreateBitCast(g->irb.CreateGEP(args[0], args[1]), rcv->getType()->getPointerTo());
+			g->s.push(g->irb.CreateAlignedStore(rcv, p, lane_alignment(rcv->getType())));
+		}
+		bool code_generator::vector_store_op::can_apply(shared_ptr<type_id> rcv, const vector<shared_ptr<type_id>>& args) {
+			return vector_load_op().can_apply(rcv, args);
+		}
+		shared_ptr<type_id> code_generator::vector_store_op::return_type(code_generator* e, shared_ptr<type_id> rcv, const vector<shared_ptr<type_id>>& args) {
+			if (!can_apply(rcv, args)) throw internal_codegen_error("tried to find return type for invalid function application");
+			return e->universe.unit();
 		}
 		// -------------------------------------------------
 
 		// -----alloc---------------------------------------
+		// runs {t} new, if t has one, to fill in the t that p points to
+		static void initialize(code_generator::expr_generator* g, llvm::Value* p, shared_ptr<type_id> t) {
+			auto f = g->gen->lookup_function(sym_new, t, {});
+			if (f == nullptr || f->return_type(g->gen, t, {}) != t) return;
+			f->apply(g, nullptr, {}, t, {});
+			g->irb.CreateStore(g->s.top(), p);
+			g->s.pop();
+		}
+
 		void code_generator::alloc_fn::apply(expr_generator* g, llvm::Value* rcv, const vector<llvm::Value*>& args, shared_ptr<type_id> rcv_t, const vector<shared_ptr<type_id>>& args_t) {
 			if (rcv != nullptr) throw internal_codegen_error("tried to call alloc with a non-null reciever");
 			auto t = rcv_t->llvm_type(g->irb.getContext());
-			auto it = llvm::Type::getInt32Ty(g->irb.getContext());
-			g->s.push(llvm::CallInst::CreateMalloc(g->irb.GetInsertBlock(),
-				it, t, llvm::ConstantExpr::getTruncOrBitCast(llvm::ConstantExpr::getSizeOf(t), it), nullptr, nullptr, ""));
-			g->irb.GetInsertBlock()->getInstList().push_back(llvm::cast<llvm::Instruction>(g->s.top()));
-			auto f = g->gen->lookup_function("new", rcv_t, {});
-			if (f != nullptr) {
-				auto v = g->s.top();
-				f->apply(g, nullptr, {}, rcv_t, {});
-				g->irb.CreateStore(g->s.top(), v);
-				g->s.pop();
+			auto st = dynamic_pointer_cast<struct_type>(rcv_t);
+			if (st != nullptr) {
+				// structs come from their type's pool, which release gives them back to. its slots come from malloc, so
+				// free works on them like on anything else alloc returns
+				auto p = g->irb.CreateCall(g->gen->pool_take_function(), { g->gen->pool_of(st), llvm::ConstantExpr::getSizeOf(t) });
+				g->s.push(g->irb.CreateBitCast(p, t->getPointerTo()));
+			}
+			else {
+				auto it = g->gen->size_type();
+				g->s.push(llvm::CallInst::CreateMalloc(g->irb.GetInsertBlock(),
+					it, t, llvm::ConstantExpr::getTruncOrBitCast(llvm::ConstantExpr::getSizeOf(t), it), nullptr, nullptr, ""));
+				g->irb.GetInsertBlock()->getInstList().push_back(llvm::cast<llvm::Instruction>(g->s.top()));
 			}
+			initialize(g, g->s.top(), rcv_t);
 		}
 		bool code_generator::alloc_fn::can_apply(shared_ptr<type_id> rcv, const vector<shared_ptr<type_id>>& args) {
 			return args.size() == 0;
 		}
 		shared_ptr<type_id> code_generator::alloc_fn::return_type(code_generator* e, shared_ptr<type_id> rcv, const vector<shared_ptr<type_id>>& args) {
 			if (!can_apply(rcv, args)) throw internal_codegen_error("tried to find return type for invalid function application");
-			return make_shared<ptr_type>(rcv);
+			return e->universe.ptr_to(rcv);
 		}
 		// -------------------------------------------------
 
@@ -278,12 +490,14 @@ namespace nkqc {
 		void code_generator::alloc_array_fn::apply(expr_generator* g, llvm::Value* rcv, const vector<llvm::Value*>& args, shared_ptr<type_id> rcv_t, const vector<shared_ptr<type_id>>& args_t) {
 			if (rcv != nullptr) throw internal_codegen_error("tried to call alloc with a non-null reciever");
 			auto t = rcv_t->llvm_type(g->irb.getContext());
-			auto it = (llvm::Type*)llvm::Type::getInt32Ty(g->irb.getContext());
-			it->print(llvm::outs());
-			llvm::outs() << "---";
-			args[0]->getType()->print(llvm::outs());
-			llvm::outs() << "\n";
-			llvm::outs().flush();
+			auto it = (llvm::Type*)g->gen->size_type();
+			if (g->gen->trace) {
+				it->print(llvm::outs());
+				llvm::outs() << "---";
+				args[0]->getType()->print(llvm::outs());
+				llvm::outs() << "\n";
+				llvm::outs().flush();
+			}
 			g->s.push(llvm::CallInst::CreateMalloc(g->irb.GetInsertBlock(),
 				it, t, (llvm::Value*)llvm::ConstantExpr::getTruncOrBitCast(llvm::ConstantExpr::getSizeOf(t), it), args[0], nullptr, ""));
 			g->irb.GetInsertBlock()->getInstList().push_back(llvm::cast<llvm::Instruction>(g->s.top()));
@@ -293,20 +507,212 @@ namespace nkqc {
 		}
 		shared_ptr<type_id> code_generator::alloc_array_fn::return_type(code_generator* e, shared_ptr<type_id> rcv, const vector<shared_ptr<type_id>>& args) {
 			if (!can_apply(rcv, args)) throw internal_codegen_error("tried to find return type for invalid function application");
-			return make_shared<ptr_type>(rcv);
+			return e->universe.ptr_to(rcv);
 		}
 		// -------------------------------------------------
 
 		// -----free----------------------------------------
+		// a unary send to a variable receives where the variable is stored, any other receiver its value
+		static llvm::Value* receiver_value(code_generator::expr_generator* g, llvm::Value* rcv, shared_ptr<type_id> rcv_t) {
+			if (rcv->getType() == g->gen->type_of(rcv_t)->getPointerTo()) return g->irb.CreateLoad(rcv);
+			return rcv;
+		}
+
 		void code_generator::free_fn::apply(expr_generator* g, llvm::Value* rcv, const vector<llvm::Value*>& args, shared_ptr<type_id> rcv_t, const vector<shared_ptr<type_id>>& args_t) {
-			g->irb.GetInsertBlock()->getInstList().push_back(llvm::CallInst::CreateFree(g->irb.CreateLoad(rcv), g->irb.GetInsertBlock()));
+			auto p = receiver_value(g, rcv, rcv_t);
+			if (to_pool) {
+				// only structs from alloc can go back: a pointer from allocArrayOf:, an arena or outside would be handed
+				// out again by the next alloc of its type
+				auto st = dynamic_pointer_cast<struct_type>(dynamic_pointer_cast<ptr_type>(rcv_t)->inner);
+				g->irb.CreateCall(g->gen->pool_give_function(), { g->gen->pool_of(st), g->irb.CreateBitCast(p, g->irb.getInt8PtrTy()) });
+				return;
+			}
+			// a slice frees what it points to, which should have come from allocSliceOf:, and a closure its environment,
+			// which is on the heap (or null) for any closure that can be kept long enough to be freed
+			if (dynamic_pointer_cast<slice_type>(rcv_t) != nullptr) p = g->irb.CreateExtractValue(p, 0);
+			else if (dynamic_pointer_cast<function_type>(rcv_t) != nullptr) p = g->irb.CreateExtractValue(p, 1);
+			g->irb.GetInsertBlock()->getInstList().push_back(llvm::CallInst::CreateFree(p, g->irb.GetInsertBlock()));
 		}
 		bool code_generator::free_fn::can_apply(shared_ptr<type_id> rcv, const vector<shared_ptr<type_id>>& args) {
-			return dynamic_pointer_cast<ptr_type>(rcv) != nullptr && args.size() == 0;
+			if (to_pool) {
+				auto pt = dynamic_pointer_cast<ptr_type>(rcv);
+				return pt != nullptr && dynamic_pointer_cast<struct_type>(pt->inner) != nullptr && args.size() == 0;
+			}
+			return (dynamic_pointer_cast<ptr_type>(rcv) != nullptr || dynamic_pointer_cast<slice_type>(rcv) != nullptr
+				|| dynamic_pointer_cast<function_type>(rcv) != nullptr) && args.size() == 0;
 		}
 		shared_ptr<type_id> code_generator::free_fn::return_type(code_generator* e, shared_ptr<type_id> rcv, const vector<shared_ptr<type_id>>& args) {
 			if (!can_apply(rcv, args)) throw internal_codegen_error("tried to find return type for invalid function application");
-			return make_shared<unit_type>();
+			return e->universe.unit();
+		}
+		// -------------------------------------------------
+
+		// -----arena new-----------------------------------
+		void code_generator::arena_new_fn::apply(expr_generator* g, llvm::Value* rcv, const vector<llvm::Value*>& args, shared_ptr<type_id> rcv_t, const vector<shared_ptr<type_id>>& args_t) {
+			auto t = rcv_t->llvm_type(g->irb.getContext());
+			auto it = g->gen->size_type();
+			auto p = llvm::CallInst::CreateMalloc(g->irb.GetInsertBlock(),
+				it, t, llvm::ConstantExpr::getTruncOrBitCast(llvm::ConstantExpr::getSizeOf(t), it), nullptr, nullptr, "");
+			g->irb.GetInsertBlock()->getInstList().push_back(llvm::cast<llvm::Instruction>(p));
+			// no chunks yet, the first allocation makes one
+			g->irb.CreateStore(llvm::ConstantAggregateZero::get(t), p);
+			g->s.push(p);
+		}
+		bool code_generator::arena_new_fn::can_apply(shared_ptr<type_id> rcv, const vector<shared_ptr<type_id>>& args) {
+			return rcv == arena && args.size() == 0;
+		}
+		shared_ptr<type_id> code_generator::arena_new_fn::return_type(code_generator* e, shared_ptr<type_id> rcv, const vector<shared_ptr<type_id>>& args) {
+			if (!can_apply(rcv, args)) throw internal_codegen_error("tried to find return type for invalid function application");
+			return e->universe.ptr_to(rcv);
+		}
+		// -------------------------------------------------
+
+		// -----arena alloc---------------------------------
+		void code_generator::arena_alloc_fn::apply(expr_generator* g, llvm::Value* rcv, const vector<llvm::Value*>& args, shared_ptr<type_id> rcv_t, const vector<shared_ptr<type_id>>& args_t) {
+			if (rcv != nullptr) throw internal_codegen_error("tried to allocate in an arena with a non-null reciever");
+			auto t = rcv_t->llvm_type(g->irb.getContext());
+			auto i64 = g->irb.getInt64Ty();
+			llvm::Value* size = llvm::ConstantExpr::getSizeOf(t);
+			if (array) size = g->irb.CreateMul(size, g->irb.CreateIntCast(args[0], i64, dynamic_pointer_cast<integer_type>(args_t[0])->signed_));
+			auto p = g->irb.CreateCall(g->gen->arena_alloc_function(), { args.back(), size, llvm::ConstantExpr::getAlignOf(t) });
+			g->s.push(g->irb.CreateBitCast(p, t->getPointerTo()));
+			if (!array) initialize(g, g->s.top(), rcv_t);
+		}
+		bool code_generator::arena_alloc_fn::can_apply(shared_ptr<type_id> rcv, const vector<shared_ptr<type_id>>& args) {
+			if (rcv == nullptr || args.empty() || args.back() != arena_ptr) return false;
+			if (array) return args.size() == 2 && dynamic_pointer_cast<integer_type>(args[0]) != nullptr;
+			return args.size() == 1;
+		}
+		shared_ptr<type_id> code_generator::arena_alloc_fn::return_type(code_generator* e, shared_ptr<type_id> rcv, const vector<shared_ptr<type_id>>& args) {
+			if (!can_apply(rcv, args)) throw internal_codegen_error("tried to find return type for invalid function application");
+			return e->universe.ptr_to(rcv);
+		}
+		// -------------------------------------------------
+
+		// -----arena reset/free----------------------------
+		void code_generator::arena_release_fn::apply(expr_generator* g, llvm::Value* rcv, const vector<llvm::Value*>& args, shared_ptr<type_id> rcv_t, const vector<shared_ptr<type_id>>& args_t) {
+			auto F = reset ? g->gen->arena_reset_function() : g->gen->arena_free_function();
+			g->s.push(g->irb.CreateCall(F, { receiver_value(g, rcv, rcv_t) }));
+		}
+		bool code_generator::arena_release_fn::can_apply(shared_ptr<type_id> rcv, const vector<shared_ptr<type_id>>& args) {
+			return rcv == arena_ptr && args.size() == 0;
+		}
+		shared_ptr<type_id> code_generator::arena_release_fn::return_type(code_generator* e, shared_ptr<type_id> rcv, const vector<shared_ptr<type_id>>& args) {
+			if (!can_apply(rcv, args)) throw internal_codegen_error("tried to find return type for invalid function application");
+			return e->universe.unit();
+		}
+		// -------------------------------------------------
+
+		// -----slice index---------------------------------
+		// traps unless ok, which is expected to be almost always true
+		static void check(code_generator::expr_generator* g, llvm::Value* ok) {
+			auto& c = g->irb.getContext();
+			auto F = g->irb.GetInsertBlock()->getParent();
+			auto pass = llvm::BasicBlock::Create(c, "inbounds", F), fail = llvm::BasicBlock::Create(c, "outofbounds", F);
+			g->irb.CreateCondBr(ok, pass, fail, llvm::MDBuilder(c).createBranchWeights(1 << 20, 1));
+			g->irb.SetInsertPoint(fail);
+			g->irb.CreateCall(llvm::Intrinsic::getDeclaration(g->gen->mod.get(), llvm::Intrinsic::trap));
+			g->irb.CreateUnreachable();
+			g->irb.SetInsertPoint(pass);
+		}
+
+		// i and the size n of a slice, extended to whichever of their types is wider. a negative i becomes an index too
+		// big to be in bounds, so an unsigned i < n is the whole check
+		static pair<llvm::Value*, llvm::Value*> as_index(code_generator::expr_generator* g, llvm::Value* i, shared_ptr<type_id> i_t, llvm::Value* n) {
+			auto t = i->getType()->getIntegerBitWidth() > n->getType()->getIntegerBitWidth() ? i->getType() : n->getType();
+			return { g->irb.CreateIntCast(i, t, dynamic_pointer_cast<integer_type>(i_t)->signed_), g->irb.CreateZExt(n, t) };
+		}
+
+		void code_generator::slice_index_op::apply(expr_generator* g, llvm::Value* rcv, const vector<llvm::Value*>& args, shared_ptr<type_id> rcv_t, const vector<shared_ptr<type_id>>& args_t) {
+			// a counted loop that checked its whole range against this slice before it started may have proven the index.
+			// the flag is loop invariant, so unswitching takes the check out of the copy of the loop where it is set
+			auto where = llvm::isa<llvm::LoadInst>(rcv) ? llvm::cast<llvm::LoadInst>(rcv)->getPointerOperand() : rcv;
+			auto in = as_index(g, args[0], args_t[0], g->irb.CreateExtractValue(rcv, 1));
+			auto ok = g->irb.CreateICmpULT(in.first, in.second);
+			auto proven = g->gen->in_bounds.find({ where, args[0] });
+			check(g, proven != g->gen->in_bounds.end() ? g->irb.CreateOr(proven->second, ok) : ok);
+			auto p = g->irb.CreateGEP(g->irb.CreateExtractValue(rcv, 0), in.first);
+			if (store) g->s.push(g->irb.CreateStore(args[1], p));
+			else g->s.push(g->irb.CreateLoad(p));
+		}
+		bool code_generator::slice_index_op::can_apply(shared_ptr<type_id> rcv, const vector<shared_ptr<type_id>>& args) {
+			auto sl = dynamic_pointer_cast<slice_type>(rcv);
+			if (sl == nullptr || args.size() != (store ? 2 : 1) || dynamic_pointer_cast<integer_type>(args[0]) == nullptr) return false;
+			return !store || sl->element == args[1];
+		}
+		shared_ptr<type_id> code_generator::slice_index_op::return_type(code_generator* e, shared_ptr<type_id> rcv, const vector<shared_ptr<type_id>>& args) {
+			if (!can_apply(rcv, args)) throw internal_codegen_error("tried to find return type for invalid function application");
+			return store ? e->universe.unit() : dynamic_pointer_cast<slice_type>(rcv)->element;
+		}
+		// -------------------------------------------------
+
+		// -----slice size----------------------------------
+		void code_generator::slice_size_op::apply(expr_generator* g, llvm::Value* rcv, const vector<llvm::Value*>& args, shared_ptr<type_id> rcv_t, const vector<shared_ptr<type_id>>& args_t) {
+			g->s.push(g->irb.CreateExtractValue(receiver_value(g, rcv, rcv_t), 1));
+		}
+		bool code_generator::slice_size_op::can_apply(shared_ptr<type_id> rcv, const vector<shared_ptr<type_id>>& args) {
+			return dynamic_pointer_cast<slice_type>(rcv) != nullptr && args.size() == 0;
+		}
+		shared_ptr<type_id> code_generator::slice_size_op::return_type(code_generator* e, shared_ptr<type_id> rcv, const vector<shared_ptr<type_id>>& args) {
+			if (!can_apply(rcv, args)) throw internal_codegen_error("tried to find return type for invalid function application");
+			return e->universe.integer(true, 32);
+		}
+		// -------------------------------------------------
+
+		// -----slice range---------------------------------
+		void code_generator::slice_range_op::apply(expr_generator* g, llvm::Value* rcv, const vector<llvm::Value*>& args, shared_ptr<type_id> rcv_t, const vector<shared_ptr<type_id>>& args_t) {
+			auto n = g->irb.CreateExtractValue(rcv, 1);
+			auto from = as_index(g, args[0], args_t[0], n), to = as_index(g, args[1], args_t[1], n);
+			// 0 <= from <= to <= size, with negative bounds too big to pass
+			auto t = from.first->getType()->getIntegerBitWidth() > to.first->getType()->getIntegerBitWidth() ? from.first->getType() : to.first->getType();
+			auto a = g->irb.CreateZExt(from.first, t), b = g->irb.CreateZExt(to.first, t);
+			check(g, g->irb.CreateAnd(g->irb.CreateICmpULE(a, b), g->irb.CreateICmpULE(b, g->irb.CreateZExt(n, t))));
+			llvm::Value* sl = llvm::UndefValue::get(rcv->getType());
+			sl = g->irb.CreateInsertValue(sl, g->irb.CreateGEP(g->irb.CreateExtractValue(rcv, 0), from.first), 0);
+			sl = g->irb.CreateInsertValue(sl, g->irb.CreateTrunc(g->irb.CreateSub(b, a), n->getType()), 1);
+			g->s.push(sl);
+		}
+		bool code_generator::slice_range_op::can_apply(shared_ptr<type_id> rcv, const vector<shared_ptr<type_id>>& args) {
+			return dynamic_pointer_cast<slice_type>(rcv) != nullptr && args.size() == 2 &&
+				dynamic_pointer_cast<integer_type>(args[0]) != nullptr && dynamic_pointer_cast<integer_type>(args[1]) != nullptr;
+		}
+		shared_ptr<type_id> code_generator::slice_range_op::return_type(code_generator* e, shared_ptr<type_id> rcv, const vector<shared_ptr<type_id>>& args) {
+			if (!can_apply(rcv, args)) throw internal_codegen_error("tried to find return type for invalid function application");
+			return rcv;
+		}
+		// -------------------------------------------------
+
+		// -----make slice----------------------------------
+		void code_generator::make_slice_op::apply(expr_generator* g, llvm::Value* rcv, const vector<llvm::Value*>& args, shared_ptr<type_id> rcv_t, const vector<shared_ptr<type_id>>& args_t) {
+			auto& c = g->irb.getContext();
+			auto it = g->irb.getInt32Ty();
+			// a count the i32 size can't hold traps, a negative one included, rather than wrapping to a size that
+			// every index is unsigned less than
+			auto ct = llvm::IntegerType::get(c, max(64u, args[0]->getType()->getIntegerBitWidth()));
+			auto count = g->irb.CreateIntCast(args[0], ct, dynamic_pointer_cast<integer_type>(args_t[0])->signed_);
+			check(g, g->irb.CreateICmpULE(count, llvm::ConstantInt::get(ct, INT32_MAX)));
+			auto n = g->irb.CreateTrunc(count, it);
+			llvm::Value* p = rcv;
+			if (alloc) {
+				auto t = rcv_t->llvm_type(c);
+				auto st = g->gen->size_type();
+				auto mul = llvm::Intrinsic::getDeclaration(g->gen->mod.get(), llvm::Intrinsic::umul_with_overflow, { st });
+				auto size = g->irb.CreateCall(mul, { llvm::ConstantExpr::getTruncOrBitCast(llvm::ConstantExpr::getSizeOf(t), st), g->irb.CreateZExt(n, st) });
+				check(g, g->irb.CreateNot(g->irb.CreateExtractValue(size, 1)));
+				p = llvm::CallInst::CreateMalloc(g->irb.GetInsertBlock(), st, t, g->irb.CreateExtractValue(size, 0), nullptr, nullptr, "");
+				g->irb.GetInsertBlock()->getInstList().push_back(llvm::cast<llvm::Instruction>(p));
+			}
+			llvm::Value* sl = llvm::UndefValue::get(llvm::StructType::get(g->irb.getContext(), { p->getType(), it }));
+			sl = g->irb.CreateInsertValue(sl, p, 0);
+			g->s.push(g->irb.CreateInsertValue(sl, n, 1));
+		}
+		bool code_generator::make_slice_op::can_apply(shared_ptr<type_id> rcv, const vector<shared_ptr<type_id>>& args) {
+			if (args.size() != 1 || dynamic_pointer_cast<integer_type>(args[0]) == nullptr) return false;
+			return alloc ? rcv != nullptr : dynamic_pointer_cast<ptr_type>(rcv) != nullptr;
+		}
+		shared_ptr<type_id> code_generator::make_slice_op::return_type(code_generator* e, shared_ptr<type_id> rcv, const vector<shared_ptr<type_id>>& args) {
+			if (!can_apply(rcv, args)) throw internal_codegen_error("tried to find return type for invalid function application");
+			return e->universe.slice_of(alloc ? rcv : dynamic_pointer_cast<ptr_type>(rcv)->inner);
 		}
 		// -------------------------------------------------
 	}
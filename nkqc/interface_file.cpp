@@ -0,0 +1,352 @@
+#include "interface_file.h"
+#include <algorithm>
+#include <cstring>
+
+#include <llvm/Support/MemoryBuffer.h>
+#include <llvm/Bitcode/BitcodeReader.h>
+#include <llvm/Bitcode/BitcodeWriter.h>
+#include <llvm/Linker/Linker.h>
+#include <llvm/Transforms/Utils/Cloning.h>
+
+namespace nkqc {
+	namespace codegen {
+		static const char interface_magic[8] = { 'n', 'k', 'q', 'c', 'i', 'f', '0', '2' };
+
+		enum type_tag : uint8_t { tag_none, tag_unit, tag_bool, tag_integer, tag_ptr, tag_array, tag_function, tag_struct, tag_float, tag_vector, tag_slice };
+		enum function_kind : uint8_t { kind_extern, kind_global, kind_static, kind_method };
+
+		struct interface_writer {
+			string out;
+			unordered_map<const type_id*, symbol> struct_names;
+
+			void u8(uint8_t v) { out += (char)v; }
+			void u32(uint32_t v) { out.append((const char*)&v, sizeof(v)); }
+			void u64(uint64_t v) { out.append((const char*)&v, sizeof(v)); }
+			void str(const string& s) { u32((uint32_t)s.size()); out += s; }
+
+			// structs are written by name, and must already have been written themselves
+			void type(shared_ptr<type_id> t) {
+				if (t == nullptr) { u8(tag_none); return; }
+				if (dynamic_pointer_cast<unit_type>(t) != nullptr) { u8(tag_unit); return; }
+				if (dynamic_pointer_cast<bool_type>(t) != nullptr) { u8(tag_bool); return; }
+				auto it = dynamic_pointer_cast<integer_type>(t);
+				if (it != nullptr) {
+					u8(tag_integer); u8(it->signed_); u8(it->bitwidth);
+					return;
+				}
+				auto flt = dynamic_pointer_cast<float_type>(t);
+				if (flt != nullptr) {
+					u8(tag_float); u8(flt->bitwidth);
+					return;
+				}
+				auto pt = dynamic_pointer_cast<ptr_type>(t);
+				if (pt != nullptr) {
+					u8(tag_ptr); type(pt->inner);
+					return;
+				}
+				auto at = dynamic_pointer_cast<array_type>(t);
+				if (at != nullptr) {
+					u8(tag_array); u64(at->count); type(at->element);
+					return;
+				}
+				auto vt = dynamic_pointer_cast<vector_type>(t);
+				if (vt != nullptr) {
+					u8(tag_vector); u64(vt->count); type(vt->element);
+					return;
+				}
+				auto slt = dynamic_pointer_cast<slice_type>(t);
+				if (slt != nullptr) {
+					u8(tag_slice); type(slt->element);
+					return;
+				}
+				auto ft = dynamic_pointer_cast<function_type>(t);
+				if (ft != nullptr) {
+					u8(tag_function); u32((uint32_t)ft->args.size());
+					for (const auto& a : ft->args) type(a);
+					type(ft->return_type);
+					return;
+				}
+				auto sn = struct_names.find(t.get());
+				if (sn != struct_names.end()) {
+					u8(tag_struct); str(sym_name(sn->second));
+					return;
+				}
+				throw internal_codegen_error("can't write type to an interface file");
+			}
+		};
+
+		struct interface_reader {
+			const char *p, *end;
+
+			void need(size_t n) {
+				if ((size_t)(end - p) < n) throw internal_codegen_error("truncated interface file");
+			}
+			uint8_t u8() { need(1); return (uint8_t)*p++; }
+			uint32_t u32() { uint32_t v; need(sizeof(v)); memcpy(&v, p, sizeof(v)); p += sizeof(v); return v; }
+			uint64_t u64() { uint64_t v; need(sizeof(v)); memcpy(&v, p, sizeof(v)); p += sizeof(v); return v; }
+			llvm::StringRef str() {
+				auto n = u32();
+				need(n);
+				llvm::StringRef s(p, n);
+				p += n;
+				return s;
+			}
+			symbol sym() { auto s = str(); return nkqc::sym(s.data(), s.size()); }
+
+			shared_ptr<type_id> type(code_generator& gen) {
+				switch (u8()) {
+				case tag_none: return nullptr;
+				case tag_unit: return gen.universe.unit();
+				case tag_bool: return gen.universe.boolean();
+				case tag_integer: {
+					auto s = u8() != 0;
+					return gen.universe.integer(s, u8());
+				}
+				case tag_float: return gen.universe.floating(u8());
+				case tag_ptr: return gen.universe.ptr_to(type(gen));
+				case tag_array: {
+					auto n = u64();
+					return gen.universe.array_of(n, type(gen));
+				}
+				case tag_vector: {
+					auto n = u64();
+					return gen.universe.vector_of(n, type(gen));
+				}
+				case tag_slice: return gen.universe.slice_of(type(gen));
+				case tag_function: {
+					vector<shared_ptr<type_id>> args(u32());
+					for (auto& a : args) a = type(gen);
+					auto rt = type(gen);
+					return make_shared<function_type>(args, rt)->resolve(&gen);
+				}
+				case tag_struct: return gen.type_for_name(sym());
+				default: throw internal_codegen_error("bad type in interface file");
+				}
+			}
+		};
+
+		// every struct reachable from t
+		static void structs_in(shared_ptr<type_id> t, vector<shared_ptr<struct_type>>& out) {
+			if (t == nullptr) return;
+			auto st = dynamic_pointer_cast<struct_type>(t);
+			if (st != nullptr) { out.push_back(st); return; }
+			auto pt = dynamic_pointer_cast<ptr_type>(t);
+			if (pt != nullptr) structs_in(pt->inner, out);
+			auto at = dynamic_pointer_cast<array_type>(t);
+			if (at != nullptr) structs_in(at->element, out);
+			auto slt = dynamic_pointer_cast<slice_type>(t);
+			if (slt != nullptr) structs_in(slt->element, out);
+			auto ft = dynamic_pointer_cast<function_type>(t);
+			if (ft != nullptr) {
+				for (const auto& a : ft->args) structs_in(a, out);
+				structs_in(ft->return_type, out);
+			}
+		}
+
+		// names every struct gen defines so that w can write types that use them
+		static void name_structs(interface_writer& w, code_generator& gen) {
+			for (const auto& t : gen.types) {
+				auto st = dynamic_pointer_cast<struct_type>(t.second.type);
+				if (st != nullptr) w.struct_names[st.get()] = t.first;
+			}
+		}
+
+		// writes the signature of f, registered with gen as sel. returns false for functions that every
+		// code_generator recreates itself
+		static bool write_function(interface_writer& w, code_generator& gen, const string& sel, shared_ptr<code_generator::function> f) {
+			auto ef = dynamic_pointer_cast<code_generator::extern_fn>(f);
+			if (ef != nullptr) {
+				w.u8(kind_extern); w.str(sel); w.str(ef->f->getName().str());
+				w.type(nullptr);
+				w.u32((uint32_t)ef->args.size());
+				for (const auto& a : ef->args) { w.str(sym_name(a.first)); w.type(a.second); }
+				w.type(ef->return_t);
+				return true;
+			}
+			auto lf = dynamic_pointer_cast<code_generator::llvm_function>(f);
+			if (lf == nullptr) return false; // builtins and struct initializers are recreated by every code_generator
+			const auto& d = lf->decl;
+			w.u8(dynamic_pointer_cast<code_generator::method>(f) != nullptr ? kind_method
+				: dynamic_pointer_cast<code_generator::static_fn>(f) != nullptr ? kind_static : kind_global);
+			w.str(sel); w.str(lf->f->getName().str());
+			w.type(d.receiver);
+			w.u32((uint32_t)d.args.size());
+			vector<shared_ptr<type_id>> arg_t;
+			for (const auto& a : d.args) {
+				w.str(sym_name(a.first)); w.type(a.second);
+				arg_t.push_back(a.second);
+			}
+			w.type(lf->return_type(&gen, d.receiver, arg_t));
+			return true;
+		}
+
+		// reads a signature written by write_function and registers it with gen, without a body
+		static shared_ptr<code_generator::function> read_function(interface_reader& r, code_generator& gen) {
+			auto kind = r.u8();
+			auto sel = r.sym();
+			auto name = r.str();
+			auto rcv = r.type(gen);
+			vector<pair<symbol, shared_ptr<type_id>>> args(r.u32());
+			for (auto& a : args) {
+				a.first = r.sym();
+				a.second = r.type(gen);
+			}
+			auto ret = r.type(gen);
+
+			if (kind == kind_extern) {
+				vector<llvm::Type*> params;
+				for (const auto& a : args) params.push_back(gen.type_of(a.second));
+				auto F_t = llvm::FunctionType::get(gen.type_of(ret), params, false);
+				auto F = llvm::cast<llvm::Function>(gen.mod->getOrInsertFunction(name, F_t));
+				F->setLinkage(llvm::Function::LinkageTypes::ExternalLinkage);
+				F->setDLLStorageClass(llvm::GlobalValue::DLLStorageClassTypes::DLLImportStorageClass);
+				auto ef = make_shared<code_generator::extern_fn>(F, args, ret);
+				gen.add_function(sel, ef);
+				return ef;
+			}
+			vector<shared_ptr<type_id>> arg_types;
+			for (const auto& a : args) arg_types.push_back(a.second);
+			auto F = gen.get_or_insert_function(name.str(), kind == kind_method ? rcv : nullptr, arg_types, ret);
+			parser::fn_decl d(kind == kind_static, rcv, sel, args, nullptr, ret);
+			shared_ptr<code_generator::llvm_function> fobj;
+			switch (kind) {
+			case kind_global: fobj = make_shared<code_generator::global_fn>(d, F); break;
+			case kind_static: fobj = make_shared<code_generator::static_fn>(d, F); break;
+			case kind_method: fobj = make_shared<code_generator::method>(d, F); break;
+			default: throw internal_codegen_error("bad function in interface file");
+			}
+			gen.add_function(sel, fobj);
+			return fobj;
+		}
+
+		void write_interface(code_generator& gen, const string& path) {
+			interface_writer w;
+			w.out.append(interface_magic, sizeof(interface_magic));
+			name_structs(w, gen);
+
+			// structs, sorted by name and then so that every struct comes after the structs its fields use
+			vector<pair<string, shared_ptr<struct_type>>> structs;
+			for (const auto& t : gen.types) {
+				auto st = dynamic_pointer_cast<struct_type>(t.second.type);
+				if (st == nullptr || st == gen.arena_t) continue; // Arena is built in, every code_generator has its own
+				structs.push_back({ sym_name(t.first), st });
+			}
+			sort(structs.begin(), structs.end(), [](const pair<string, shared_ptr<struct_type>>& a, const pair<string, shared_ptr<struct_type>>& b) { return a.first < b.first; });
+			vector<shared_ptr<struct_type>> ordered;
+			unordered_map<const type_id*, bool> visited;
+			function<void(shared_ptr<struct_type>)> visit = [&](shared_ptr<struct_type> st) {
+				if (visited[st.get()] || st == gen.arena_t) return;
+				visited[st.get()] = true;
+				vector<shared_ptr<struct_type>> deps;
+				for (const auto& f : st->fields) structs_in(f.second, deps);
+				for (const auto& d : deps) visit(d);
+				ordered.push_back(st);
+			};
+			for (const auto& s : structs) visit(s.second);
+			w.u32((uint32_t)ordered.size());
+			for (const auto& st : ordered) {
+				w.str(sym_name(w.struct_names.at(st.get())));
+				w.u32((uint32_t)st->fields.size());
+				for (const auto& f : st->fields) {
+					w.str(sym_name(f.first));
+					w.type(f.second);
+				}
+			}
+
+			// functions, sorted by selector and then in the order they were defined
+			vector<pair<string, const vector<shared_ptr<code_generator::function>>*>> selectors;
+			for (const auto& fs : gen.functions) selectors.push_back({ sym_name(fs.first), &fs.second });
+			sort(selectors.begin(), selectors.end(), [](const pair<string, const vector<shared_ptr<code_generator::function>>*>& a, const pair<string, const vector<shared_ptr<code_generator::function>>*>& b) { return a.first < b.first; });
+			string fns;
+			uint32_t fn_count = 0;
+			swap(w.out, fns);
+			for (const auto& sel : selectors) {
+				for (const auto& f : *sel.second) {
+					// functions without a body were loaded from another interface, which their users load themselves
+					auto lf = dynamic_pointer_cast<code_generator::llvm_function>(f);
+					if (lf != nullptr && lf->decl.body == nullptr) continue;
+					if (write_function(w, gen, sel.first, f)) fn_count++;
+				}
+			}
+			swap(w.out, fns);
+			w.u32(fn_count);
+			w.out += fns;
+
+			// and for the same reason the code linked in from other interfaces is left out, or it would be defined twice
+			unordered_set<const llvm::GlobalValue*> loaded;
+			for (const auto& fs : gen.functions) {
+				for (const auto& f : fs.second) {
+					auto lf = dynamic_pointer_cast<code_generator::llvm_function>(f);
+					if (lf != nullptr && lf->decl.body == nullptr) loaded.insert(lf->f);
+				}
+			}
+			llvm::ValueToValueMapTy vmap;
+			auto own = llvm::CloneModule(gen.mod.get(), vmap, [&loaded](const llvm::GlobalValue* gv) { return loaded.count(gv) == 0; });
+			string bc;
+			llvm::raw_string_ostream bcs(bc);
+			llvm::WriteBitcodeToFile(own.get(), bcs);
+			bcs.flush();
+			w.u64(bc.size());
+			w.out += bc;
+
+			error_code ec;
+			llvm::raw_fd_ostream o(path, ec, llvm::sys::fs::OpenFlags{});
+			if (ec) throw internal_codegen_error("could not write interface file " + path + ": " + ec.message());
+			o << w.out;
+		}
+
+		void load_interface(code_generator& gen, const string& path, bool with_code) {
+			auto file = llvm::MemoryBuffer::getFile(path);
+			if (!file) throw internal_codegen_error("could not read interface file " + path + ": " + file.getError().message());
+			interface_reader r{ (*file)->getBufferStart(), (*file)->getBufferEnd() };
+			r.need(sizeof(interface_magic));
+			if (memcmp(r.p, interface_magic, sizeof(interface_magic)) != 0)
+				throw internal_codegen_error(path + " is not an interface file for this version of nkqc");
+			r.p += sizeof(interface_magic);
+
+			for (auto n = r.u32(); n > 0; --n) {
+				auto name = r.sym();
+				vector<pair<symbol, shared_ptr<type_id>>> fields(r.u32());
+				for (auto& f : fields) {
+					f.first = r.sym();
+					f.second = r.type(gen);
+				}
+				gen.define_type(name, make_shared<struct_type>(fields));
+			}
+
+			// the bodies live in the interface's bitcode, so the declarations only need their signatures
+			vector<pair<shared_ptr<code_generator::llvm_function>, string>> loaded;
+			for (auto n = r.u32(); n > 0; --n) {
+				auto lf = dynamic_pointer_cast<code_generator::llvm_function>(read_function(r, gen));
+				if (lf != nullptr) loaded.push_back({ lf, lf->f->getName().str() });
+			}
+
+			auto bc_size = r.u64();
+			r.need(bc_size);
+			if (!with_code) return;
+			auto code = llvm::parseBitcodeFile(llvm::MemoryBufferRef(llvm::StringRef(r.p, bc_size), path), gen.mod->getContext());
+			if (!code) throw internal_codegen_error("bad code in interface file " + path + ": " + llvm::toString(code.takeError()));
+			if (llvm::Linker::linkModules(*gen.mod, move(*code)))
+				throw internal_codegen_error("failed to link interface file " + path);
+			// the linker replaces a declaration with a new function when it links in its definition
+			for (const auto& l : loaded) l.first->f = gen.mod->getFunction(l.second);
+		}
+	
+		string write_signatures(code_generator& gen, const vector<pair<symbol, shared_ptr<code_generator::function>>>& fns) {
+			interface_writer w;
+			name_structs(w, gen);
+			for (const auto& f : fns) {
+				if (!write_function(w, gen, sym_name(f.first), f.second))
+					throw internal_codegen_error(sym_name(f.first) + " has no signature to write");
+			}
+			return w.out;
+		}
+
+		vector<shared_ptr<code_generator::function>> load_signatures(code_generator& gen, const string& table) {
+			interface_reader r{ table.data(), table.data() + table.size() };
+			vector<shared_ptr<code_generator::function>> fns;
+			while (r.p != r.end) fns.push_back(read_function(r, gen));
+			return fns;
+		}
+	}
+}
@@ -0,0 +1,25 @@
+#pragma once
+#include "llvm_codegen.h"
+
+namespace nkqc {
+	namespace codegen {
+		// interface files hold the structs and resolved function signatures a code_generator has defined, followed by
+		// the bitcode of its module, so that a prelude can be compiled once and loaded without parsing or typing it again.
+		// they are a build artifact for one machine: numbers are stored in native byte order
+
+		// writes every struct and non-builtin function defined in gen, and gen.mod, to path
+		void write_interface(code_generator& gen, const string& path);
+
+		// registers the structs and functions in the interface file at path with gen, as if they had been defined in
+		// source, and links its code into gen.mod unless with_code is false
+		void load_interface(code_generator& gen, const string& path, bool with_code = true);
+
+		// the signatures of fns, each declared with gen under its selector, in the same format without the header,
+		// structs or code. return types are written resolved, so reading them back never types a body
+		string write_signatures(code_generator& gen, const vector<pair<symbol, shared_ptr<code_generator::function>>>& fns);
+
+		// registers every signature in a table from write_signatures with gen, in order, and returns them. the structs
+		// they use must already be defined in gen
+		vector<shared_ptr<code_generator::function>> load_signatures(code_generator& gen, const string& table);
+	}
+}
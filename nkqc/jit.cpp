@@ -0,0 +1,85 @@
+#include "jit.h"
+
+#include <llvm/ExecutionEngine/RTDyldMemoryManager.h>
+#include <llvm/ExecutionEngine/SectionMemoryManager.h>
+#include <llvm/ExecutionEngine/Orc/LambdaResolver.h>
+#include <llvm/IR/Mangler.h>
+#include <llvm/Support/DynamicLibrary.h>
+
+namespace nkqc {
+	namespace codegen {
+		jit::jit(unique_ptr<llvm::TargetMachine> tm)
+			: tm(move(tm)), dl(this->tm->createDataLayout()),
+			objects([]() { return make_shared<llvm::SectionMemoryManager>(); }),
+			compiler(objects, llvm::orc::SimpleCompiler(*this->tm)) {
+			// make the host process's own symbols visible to getSymbolAddressInProcess
+			llvm::sys::DynamicLibrary::LoadLibraryPermanently(nullptr);
+			auto make_stubs = llvm::orc::createLocalIndirectStubsManagerBuilder(this->tm->getTargetTriple());
+			if (make_stubs) stubs = make_stubs();
+		}
+
+		jit::module_handle jit::add_module(shared_ptr<llvm::Module> m) {
+			auto resolver = llvm::orc::createLambdaResolver(
+				[this](const string& name) {
+					if (stubs != nullptr)
+						if (auto s = stubs->findStub(name, false)) return s;
+					if (auto s = compiler.findSymbol(name, false)) return s;
+					return llvm::JITSymbol(nullptr);
+				},
+				[](const string& name) {
+					if (auto a = llvm::RTDyldMemoryManager::getSymbolAddressInProcess(name))
+						return llvm::JITSymbol(a, llvm::JITSymbolFlags::Exported);
+					return llvm::JITSymbol(nullptr);
+				});
+			return llvm::cantFail(compiler.addModule(move(m), move(resolver)));
+		}
+
+		void jit::remove_module(module_handle h) {
+			llvm::cantFail(compiler.removeModule(h));
+		}
+
+		void jit::redirect(const string& name, module_handle h) {
+			if (stubs == nullptr) throw internal_codegen_error("can't replace functions on " + tm->getTargetTriple().str());
+			auto mangled = mangle(name);
+			auto s = compiler.findSymbolIn(h, mangled, false);
+			if (!s) throw internal_codegen_error("can't redirect " + name + " to a module that doesn't define it");
+			auto addr = llvm::cantFail(s.getAddress());
+			if (stubs->findStub(mangled, false)) llvm::cantFail(stubs->updatePointer(mangled, addr));
+			else llvm::cantFail(stubs->createStub(mangled, addr, llvm::JITSymbolFlags::Exported));
+		}
+
+		string jit::mangle(const string& name) {
+			string mangled;
+			llvm::raw_string_ostream ms(mangled);
+			llvm::Mangler::getNameWithPrefix(ms, name, dl);
+			return ms.str();
+		}
+
+		uint64_t jit::address_of(const string& name) {
+			auto s = compiler.findSymbol(mangle(name), true);
+			if (!s) return 0;
+			return llvm::cantFail(s.getAddress());
+		}
+
+		int jit::call_entry(llvm::Function* entry) {
+			if (entry->arg_size() != 0) throw internal_codegen_error("entry function " + entry->getName().str() + " can't take arguments");
+			auto addr = address_of(entry->getName().str());
+			if (addr == 0) throw internal_codegen_error("entry function " + entry->getName().str() + " was not compiled");
+			auto rt = entry->getReturnType();
+			if (rt->isVoidTy()) {
+				((void(*)())addr)();
+				return 0;
+			}
+			if (rt->isIntegerTy()) {
+				switch (rt->getIntegerBitWidth()) {
+				case 1: return ((bool(*)())addr)() ? 1 : 0;
+				case 8: return ((int8_t(*)())addr)();
+				case 16: return ((int16_t(*)())addr)();
+				case 32: return ((int32_t(*)())addr)();
+				case 64: return (int)((int64_t(*)())addr)();
+				}
+			}
+			throw internal_codegen_error("entry function " + entry->getName().str() + " must return () or an integer");
+		}
+	}
+}
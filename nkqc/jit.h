@@ -0,0 +1,43 @@
+#pragma once
+#include "llvm_codegen.h"
+
+#include <llvm/ExecutionEngine/JITSymbol.h>
+#include <llvm/ExecutionEngine/Orc/CompileUtils.h>
+#include <llvm/ExecutionEngine/Orc/IRCompileLayer.h>
+#include <llvm/ExecutionEngine/Orc/IndirectionUtils.h>
+#include <llvm/ExecutionEngine/Orc/RTDyldObjectLinkingLayer.h>
+#include <llvm/Support/Host.h>
+
+namespace nkqc {
+	namespace codegen {
+		// compiles modules into this process. symbols a module doesn't define are looked up in the modules added
+		// before it and then in the process itself, so extern functions like putchar resolve to the host's libc
+		struct jit {
+			unique_ptr<llvm::TargetMachine> tm;
+			const llvm::DataLayout dl;
+			llvm::orc::RTDyldObjectLinkingLayer objects;
+			llvm::orc::IRCompileLayer<decltype(objects), llvm::orc::SimpleCompiler> compiler;
+			typedef decltype(compiler)::ModuleHandleT module_handle;
+			// one per redirected function, null if there is no stub support for the host
+			unique_ptr<llvm::orc::IndirectStubsManager> stubs;
+
+			jit(unique_ptr<llvm::TargetMachine> tm);
+
+			// m must use dl as its data layout
+			module_handle add_module(shared_ptr<llvm::Module> m);
+			void remove_module(module_handle h);
+
+			// sends every call to name, from any module added afterwards, through a stub that points at name's definition
+			// in h. redirecting again replaces the function without recompiling its callers
+			void redirect(const string& name, module_handle h);
+
+			// the address of a function in the added modules, compiling it first if needed. 0 if there is no such function
+			uint64_t address_of(const string& name);
+
+			// calls a function taking no arguments that has been added, and returns its result as an exit code
+			int call_entry(llvm::Function* entry);
+		private:
+			string mangle(const string& name);
+		};
+	}
+}
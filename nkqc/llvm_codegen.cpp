@@ -3,130 +3,306 @@
 namespace nkqc {
 	namespace codegen {
 		code_generator::code_generator(shared_ptr<llvm::Module> mod)
-			: mod(mod) {
-			functions["+"].push_back(make_shared<binary_llvm_op>(llvm::BinaryOperator::BinaryOps::Add));
-			functions["*"].push_back(make_shared<binary_llvm_op>(llvm::BinaryOperator::BinaryOps::Mul));
-			functions["-"].push_back(make_shared<binary_llvm_op>(llvm::BinaryOperator::BinaryOps::Sub));
-			functions["/"].push_back(make_shared<binary_llvm_op>(llvm::BinaryOperator::BinaryOps::SDiv));
-			functions["%"].push_back(make_shared<binary_llvm_op>(llvm::BinaryOperator::BinaryOps::SRem));
-			functions["=="].push_back(make_shared<numeric_comp_op>(llvm::CmpInst::Predicate::ICMP_EQ, false));
-			functions["!="].push_back(make_shared<numeric_comp_op>(llvm::CmpInst::Predicate::ICMP_NE, false));
-			functions["<"].push_back(make_shared<numeric_comp_op>(llvm::CmpInst::Predicate::ICMP_SLT, false));
-			functions[">"].push_back(make_shared<numeric_comp_op>(llvm::CmpInst::Predicate::ICMP_SGT, false));
-			functions["<="].push_back(make_shared<numeric_comp_op>(llvm::CmpInst::Predicate::ICMP_SLE, false));
-			functions[">="].push_back(make_shared<numeric_comp_op>(llvm::CmpInst::Predicate::ICMP_SGE, false));
-			functions["~"].push_back(make_shared<cast_op>());
-			functions["at:"].push_back(make_shared<pointer_index_op>());
-			functions["at:put:"].push_back(make_shared<pointer_index_store_op>());
-			functions["alloc"].push_back(make_shared<alloc_fn>());
-			functions["allocArrayOf:"].push_back(make_shared<alloc_array_fn>());
-			functions["free"].push_back(make_shared<free_fn>());
+			: mod(mod), typer_visits(0), typed_body(nullptr), trace(true), fast_math(false), specialize_blocks(true) {
+			functions[sym("+")].push_back(make_shared<binary_llvm_op>(llvm::BinaryOperator::BinaryOps::Add, llvm::BinaryOperator::BinaryOps::FAdd));
+			functions[sym("*")].push_back(make_shared<binary_llvm_op>(llvm::BinaryOperator::BinaryOps::Mul, llvm::BinaryOperator::BinaryOps::FMul));
+			functions[sym("-")].push_back(make_shared<binary_llvm_op>(llvm::BinaryOperator::BinaryOps::Sub, llvm::BinaryOperator::BinaryOps::FSub));
+			functions[sym("/")].push_back(make_shared<binary_llvm_op>(llvm::BinaryOperator::BinaryOps::SDiv, llvm::BinaryOperator::BinaryOps::FDiv));
+			functions[sym("%")].push_back(make_shared<binary_llvm_op>(llvm::BinaryOperator::BinaryOps::SRem, llvm::BinaryOperator::BinaryOps::FRem));
+			functions[sym("==")].push_back(make_shared<numeric_comp_op>(llvm::CmpInst::Predicate::ICMP_EQ, false));
+			functions[sym("!=")].push_back(make_shared<numeric_comp_op>(llvm::CmpInst::Predicate::ICMP_NE, false));
+			functions[sym("<")].push_back(make_shared<numeric_comp_op>(llvm::CmpInst::Predicate::ICMP_SLT, false));
+			functions[sym(">")].push_back(make_shared<numeric_comp_op>(llvm::CmpInst::Predicate::ICMP_SGT, false));
+			functions[sym("<=")].push_back(make_shared<numeric_comp_op>(llvm::CmpInst::Predicate::ICMP_SLE, false));
+			functions[sym(">=")].push_back(make_shared<numeric_comp_op>(llvm::CmpInst::Predicate::ICMP_SGE, false));
+			functions[sym("==")].push_back(make_shared<numeric_comp_op>(llvm::CmpInst::Predicate::FCMP_OEQ, true));
+			functions[sym("!=")].push_back(make_shared<numeric_comp_op>(llvm::CmpInst::Predicate::FCMP_UNE, true));
+			functions[sym("<")].push_back(make_shared<numeric_comp_op>(llvm::CmpInst::Predicate::FCMP_OLT, true));
+			functions[sym(">")].push_back(make_shared<numeric_comp_op>(llvm::CmpInst::Predicate::FCMP_OGT, true));
+			functions[sym("<=")].push_back(make_shared<numeric_comp_op>(llvm::CmpInst::Predicate::FCMP_OLE, true));
+			functions[sym(">=")].push_back(make_shared<numeric_comp_op>(llvm::CmpInst::Predicate::FCMP_OGE, true));
+			functions[sym("~")].push_back(make_shared<cast_op>());
+			functions[sym("at:")].push_back(make_shared<pointer_index_op>());
+			functions[sym("at:put:")].push_back(make_shared<pointer_index_store_op>());
+			functions[sym("at:")].push_back(make_shared<slice_index_op>(false));
+			functions[sym("at:put:")].push_back(make_shared<slice_index_op>(true));
+			functions[sym("size")].push_back(make_shared<slice_size_op>());
+			functions[sym("from:to:")].push_back(make_shared<slice_range_op>());
+			functions[sym("slice:")].push_back(make_shared<make_slice_op>(false));
+			functions[sym("allocSliceOf:")].push_back(make_shared<make_slice_op>(true));
+			functions[sym("alloc")].push_back(make_shared<alloc_fn>());
+			functions[sym("allocArrayOf:")].push_back(make_shared<alloc_array_fn>());
+			// Arena is { cur, end, chunks }, see runtime.cpp. its free comes before the general one
+			auto byte_p = universe.ptr_to(universe.integer(false, 8));
+			arena_t = make_shared<struct_type>(vector<pair<symbol, shared_ptr<type_id>>>{ { sym("cur"), byte_p }, { sym("end"), byte_p }, { sym("chunks"), byte_p } });
+			arena_t->init(mod->getContext(), "Arena");
+			types[sym_Arena] = type_record{ arena_t,{} };
+			auto arena_p = universe.ptr_to(intern(arena_t));
+			functions[sym_new].push_back(make_shared<arena_new_fn>(arena_t));
+			functions[sym("allocIn:")].push_back(make_shared<arena_alloc_fn>(arena_p, false));
+			functions[sym("allocArrayOf:in:")].push_back(make_shared<arena_alloc_fn>(arena_p, true));
+			functions[sym("reset")].push_back(make_shared<arena_release_fn>(arena_p, true));
+			functions[sym("free")].push_back(make_shared<arena_release_fn>(arena_p, false));
+			functions[sym("free")].push_back(make_shared<free_fn>(false));
+			functions[sym("release")].push_back(make_shared<free_fn>(true));
+			functions[sym("splat:")].push_back(make_shared<vector_splat_op>());
+			functions[sym("lane:")].push_back(make_shared<vector_extract_op>());
+			functions[sym("lane:put:")].push_back(make_shared<vector_insert_op>());
+			functions[sym("shuffle:mask:")].push_back(make_shared<vector_shuffle_op>());
+			functions[sym("sum")].push_back(make_shared<vector_reduce_op>(vector_reduce_op::sum));
+			functions[sym("product")].push_back(make_shared<vector_reduce_op>(vector_reduce_op::product));
+			functions[sym("min")].push_back(make_shared<vector_reduce_op>(vector_reduce_op::min));
+			functions[sym("max")].push_back(make_shared<vector_reduce_op>(vector_reduce_op::max));
+			functions[sym("load:at:")].push_back(make_shared<vector_load_op>());
+			functions[sym("store:at:")].push_back(make_shared<vector_store_op>());
+			// the parser gives every send of value: value: ... the selector value:, whatever its arity
+			functions[sym_value].push_back(make_shared<closure_call_op>());
+			functions[sym_value_].push_back(make_shared<closure_call_op>());
 		}
 
 		llvm::Function* code_generator::define_function(nkqc::parser::fn_decl fn) {
+			auto F = declare_function(fn);
+			if (F == nullptr) return nullptr;
+			generate_body(F);
+			return F->f;
+		}
+
+		// the variable every return in a body returns, if there is one
+		struct returned_variable_finder : public ast::expr_visiter<> {
+			bool found, all_same;
+			symbol v;
+			returned_variable_finder() : found(false), all_same(true), v(0) {}
+
+			void walk(const ast::expr* x) {
+				if (dynamic_cast<const parser::type_expr*>(x) == nullptr) x->visit(this);
+			}
+			void visit(const ast::id_expr& x) override {}
+			void visit(const ast::string_expr& x) override {}
+			void visit(const ast::number_expr& x) override {}
+			void visit(const ast::block_expr& x) override { walk(x.body); }
+			void visit(const ast::symbol_expr& x) override {}
+			void visit(const ast::char_expr& x) override {}
+			void visit(const ast::array_expr& x) override {}
+			void visit(const ast::tag_expr& x) override {}
+			void visit(const ast::seq_expr& x) override { walk(x.first); walk(x.second); }
+			void visit(const ast::return_expr& x) override {
+				auto id = dynamic_cast<const ast::id_expr*>(x.val);
+				if (id == nullptr || (found && id->v != v)) all_same = false;
+				else { found = true; v = id->v; }
+				walk(x.val);
+			}
+			void visit(const ast::unary_msgsnd& x) override { walk(x.rcv); }
+			void visit(const ast::binary_msgsnd& x) override { walk(x.rcv); walk(x.rhs); }
+			void visit(const ast::keyword_msgsnd& x) override {
+				walk(x.rcv);
+				for (auto a : x.args) walk(a);
+			}
+			void visit(const ast::cascade_msgsnd& x) override {
+				walk(x.rcv);
+				for (const auto& m : x.msgs) {
+					for (auto a : m.second) walk(a);
+				}
+			}
+			void visit(const ast::assignment_expr& x) override { walk(x.val); }
+		};
+		static pair<bool, symbol> returned_variable(const ast::expr* body) {
+			returned_variable_finder f;
+			f.walk(body);
+			return { f.found && f.all_same, f.v };
+		}
+
+		code_generator::expr_context code_generator::function_scope(const parser::fn_decl& fn) {
 			expr_context cx;
 			for (const auto& arg : fn.args) {
 				cx[arg.first] = pair<llvm::Value*, shared_ptr<type_id>>{ nullptr, arg.second };
 			}
-			auto cfn = dynamic_pointer_cast<ast::array_expr>(fn.body);
+			// declare instance variables
+			if (fn.receiver != nullptr && !fn.static_function) {
+				auto strct = dynamic_pointer_cast<struct_type>(dynamic_pointer_cast<ptr_type>(fn.receiver)->inner);
+				if (strct != nullptr) {
+					for (const auto& f : strct->fields) {
+						cx[f.first].second = f.second;
+					}
+				}
+			}
+			return cx;
+		}
+
+		void code_generator::type_body(const parser::fn_decl& fn) {
+			expr_types.clear();
+			typer_visits = 0;
+			expr_context tcx = function_scope(fn);
+			if (fn.receiver != nullptr && !fn.static_function)
+				tcx[sym_self].second = fn.receiver;
+			expr_typer ty{ this, &tcx, true };
+			ty.annotate(fn.body);
+			typed_body = fn.body;
+		}
+
+		shared_ptr<code_generator::llvm_function> code_generator::declare_function(nkqc::parser::fn_decl fn) {
+			// argument types are resolved up front so that overload resolution can compare them by identity
+			for (auto& arg : fn.args) {
+				arg.second = arg.second->resolve(this);
+			}
+			auto cfn = dynamic_cast<ast::array_expr*>(fn.body);
 			if (cfn != nullptr) {
 				vector<llvm::Type*> params;
 				for (const auto& arg : fn.args) {
 					params.push_back(type_of(arg.second));
 				}
-				auto ret_t = dynamic_pointer_cast<parser::type_expr>(cfn->vs[1])->type;
-				auto fn_t = llvm::FunctionType::get(ret_t->llvm_type(mod->getContext()), params, false);
-				auto name = dynamic_pointer_cast<ast::symbol_expr>(cfn->vs[0])->v;
+				auto ret_t = dynamic_cast<parser::type_expr*>(cfn->vs[1])->type->resolve(this);
+				auto fn_t = llvm::FunctionType::get(type_of(ret_t), params, false);
+				auto name = sym_name(dynamic_cast<ast::symbol_expr*>(cfn->vs[0])->v);
 				auto F = llvm::cast<llvm::Function>(mod->getOrInsertFunction(name, fn_t));
 				F->setLinkage(llvm::Function::LinkageTypes::ExternalLinkage);
 				F->setDLLStorageClass(llvm::GlobalValue::DLLStorageClassTypes::DLLImportStorageClass);
-				functions[fn.selector].push_back(make_shared<extern_fn>(F, fn.args, ret_t));
-				return F;
+				add_function(fn.selector, make_shared<extern_fn>(F, fn.args, ret_t));
+				return nullptr;
+			}
+			if (fn.receiver != nullptr) { // pre-resolve the receiver type and store it in case the function itself needs it
+				fn.receiver = fn.receiver->resolve(this);
+				if (!fn.static_function)
+					// all receivers are passed by reference to allow for mutation
+					fn.receiver = universe.ptr_to(fn.receiver);
+			}
+			vector<shared_ptr<type_id>> arg_types;
+			for (const auto& arg : fn.args) {
+				arg_types.push_back(arg.second);
 			}
+			shared_ptr<type_id> return_type;
+			if (fn.return_type) return_type = fn.return_type->resolve(this);
 			else {
-				shared_ptr<struct_type> strct = nullptr;
-				if (fn.receiver != nullptr) { // pre-resolve the receiver type and store it in case the function itself needs it
-					fn.receiver = fn.receiver->resolve(this);
-					strct = dynamic_pointer_cast<struct_type>(fn.receiver);
-					if (!fn.static_function)
-						// all receivers are passed by reference to allow for mutation
-						fn.receiver = make_shared<ptr_type>(fn.receiver);
-				}
-				// declare instance variables
-				if (strct != nullptr && !fn.static_function) {
-					for (const auto& f : strct->fields) {
-						cx[f.first].second = f.second;
-					}
+				type_body(fn);
+				return_type = expr_types.at(fn.body);
+			}
+			auto F = get_or_insert_function(sym_name(fn.selector), fn.static_function ? nullptr : fn.receiver, arg_types, return_type);
+			if (!F->empty()) throw internal_codegen_error(sym_name(fn.selector) + " is defined more than once");
+			shared_ptr<llvm_function> fobj;
+			if (fn.receiver != nullptr) {
+				if (fn.static_function) {
+					fobj = make_shared<static_fn>(fn, F);
 				}
-				vector<llvm::Type*> params;
-				if (fn.receiver != nullptr && !fn.static_function)
-					params.push_back(type_of(fn.receiver));
-				for (const auto& arg : fn.args) {
-					params.push_back(type_of(arg.second));
+				else {
+					fobj = make_shared<method>(fn, F);
 				}
-				shared_ptr<type_id> return_type;
-				if (fn.return_type) return_type = fn.return_type->resolve(this);
-				else return_type = type_of(fn.body, &cx);
-				auto F_t = llvm::FunctionType::get(return_type->llvm_type(mod->getContext()), params, false);
-				auto F = llvm::cast<llvm::Function>(mod->getOrInsertFunction(fn.selector, F_t));
-				auto entry_block = llvm::BasicBlock::Create(mod->getContext(), "entry", F);
-				auto vals = F->arg_begin();
-				// for member functions/methods initialize `self` variable and instance variables
-				if (fn.receiver != nullptr && !fn.static_function) {
-					/*llvm::IRBuilder<> irb(entry_block);
-					auto self = cx["self"].first = irb.CreateAlloca(v->getType()); vals++;
-					irb.CreateStore(llvm::cast<llvm::Value>(&*vals), self);*/
-					auto self = cx["self"].first = llvm::cast<llvm::Value>(&*vals);
-					cx["self"].second = fn.receiver;
-					/*auto llvm_argument_type = cx["self"].first->getType();
-					llvm_argument_type->print(llvm::outs());
-					llvm::outs() << "-";
-					llvm_argument_type->getPointerElementType()->print(llvm::outs());
-					llvm::outs() << "\n";
-					auto nkqc_type = cx["self"].second->resolve(this)->llvm_type(mod->getContext());
-					nkqc_type->print(llvm::outs());
-					llvm::outs() << "-";
-					nkqc_type->getPointerElementType()->print(llvm::outs());
-					llvm::outs().flush();*/
-					if (strct != nullptr) {
-						// assign values to instance variables
-						auto zero = llvm::ConstantInt::get(mod->getContext(), llvm::APInt(32, 0));
-						for (int i = 0; i < strct->fields.size(); ++i) {
-							cx[strct->fields[i].first].first =
-								llvm::GetElementPtrInst::Create(self->getType()->getPointerElementType(), self, { zero, llvm::ConstantInt::get(mod->getContext(), llvm::APInt(32, i)) }, "", entry_block);
-						}
+			}
+			else fobj = make_shared<global_fn>(fn, F);
+			add_function(fn.selector, fobj);
+			if (!fn.return_type) {
+				// seed the inferred return type so that call sites never have to re-type this body
+				vector<shared_ptr<type_id>> arg_t;
+				for (const auto& arg : fn.args) arg_t.push_back(arg.second->resolve(this));
+				inferred_return_types[{ fobj.get(), type_signature(fn.receiver, arg_t) }] = return_type;
+			}
+			return fobj;
+		}
+
+		void code_generator::generate_body(shared_ptr<llvm_function> fobj) {
+			closure_code.clear();
+			generate_body(fobj, fobj->f, 0, nullptr);
+		}
+
+		void code_generator::generate_body(shared_ptr<llvm_function> fobj, llvm::Function* F, size_t block_arg, llvm::Function* block_code) {
+			const auto& fn = fobj->decl;
+			expr_context cx = function_scope(fn);
+			// a specialization is generated in the middle of its caller, which gets its own variables back after
+			auto caller_reassigned = move(reassigned);
+			reassigned = reassigned_variables(fn);
+			auto entry_block = llvm::BasicBlock::Create(mod->getContext(), "entry", F);
+			auto vals = F->arg_begin();
+			if (F->hasStructRetAttr()) cx.sret = llvm::cast<llvm::Value>(&*vals++);
+			// a variable that every return returns is built in the sret slot itself, so returning it copies nothing
+			auto nrv = returned_variable(fn.body);
+			if (cx.sret != nullptr && nrv.first && cx.find(nrv.second) == cx.end())
+				cx[nrv.second] = { cx.sret, nullptr };
+			// for member functions/methods initialize `self` variable and instance variables
+			if (fn.receiver != nullptr && !fn.static_function) {
+				/*llvm::IRBuilder<> irb(entry_block);
+				auto self = cx[sym_self].first = irb.CreateAlloca(v->getType()); vals++;
+				irb.CreateStore(llvm::cast<llvm::Value>(&*vals), self);*/
+				auto self = cx[sym_self].first = llvm::cast<llvm::Value>(&*vals);
+				cx[sym_self].second = fn.receiver;
+				auto strct = dynamic_pointer_cast<struct_type>(dynamic_pointer_cast<ptr_type>(fn.receiver)->inner);
+				if (strct != nullptr) {
+					// assign values to instance variables
+					auto zero = llvm::ConstantInt::get(mod->getContext(), llvm::APInt(32, 0));
+					for (int i = 0; i < strct->fields.size(); ++i) {
+						cx[strct->fields[i].first].first =
+							llvm::GetElementPtrInst::Create(self->getType()->getPointerElementType(), self, { zero, llvm::ConstantInt::get(mod->getContext(), llvm::APInt(32, i)) }, "", entry_block);
 					}
 				}
-				llvm::IRBuilder<> irb(entry_block);
-				for (const auto& arg : fn.args) {
-					auto alc = irb.CreateAlloca(vals->getType());
-					irb.CreateStore(llvm::cast<llvm::Value>(&*vals), alc);
-					cx[arg.first] = { alc, arg.second };
+			}
+			llvm::IRBuilder<> irb(entry_block);
+			for (size_t i = 0; i < fn.args.size(); ++i) {
+				const auto& arg = fn.args[i];
+				if (block_code != nullptr && i == block_arg) {
+					// only the environment comes from the caller. the closure is bound to its value, so that it is never
+					// stored and the call through it folds to a direct call
+					auto c = irb.CreateInsertValue(llvm::cast<llvm::Value>(&*vals), block_code, 0);
+					closure_code[c] = block_code;
+					cx[arg.first] = { c, arg.second };
 					vals++;
+					continue;
 				}
-				if (fn.receiver != nullptr) {
-					if (fn.static_function) {
-						functions[fn.selector].push_back(make_shared<static_fn>(fn, F));
-					}
-					else {
-						functions[fn.selector].push_back(make_shared<method>(fn, F));
-					}
+				if (F->hasParamAttribute((unsigned)vals->getArgNo(), llvm::Attribute::ByVal)) {
+					// already a copy that belongs to this call
+					cx[arg.first] = { llvm::cast<llvm::Value>(&*vals), arg.second };
+					vals++;
+					continue;
 				}
-				else functions[fn.selector].push_back(make_shared<global_fn>(fn, F));
-				generate_expr(cx, dynamic_pointer_cast<ast::block_expr>(fn.body)->body, entry_block);
-				return F;
+				auto alc = irb.CreateAlloca(vals->getType());
+				irb.CreateStore(llvm::cast<llvm::Value>(&*vals), alc);
+				cx[arg.first] = { alc, arg.second };
+				vals++;
+			}
+			// the body is typed after registration so that recursive sends resolve, unless declare_function
+			// already had to type it to infer the return type and nothing has been typed since
+			if (typed_body != fn.body) type_body(fn);
+			generate_expr(cx, dynamic_cast<ast::block_expr*>(fn.body)->body, entry_block);
+			reassigned = move(caller_reassigned);
+		}
+
+		bool code_generator::passed_in_memory(llvm::Type* t) {
+			// measured with the default data layout, so that every module agrees on how a function is called whatever
+			// target it is for and whether its layout has been set yet
+			static const llvm::DataLayout layout("");
+			return t->isStructTy() && layout.getTypeAllocSize(t) > register_struct_bytes;
+		}
+
+		llvm::Function* code_generator::get_or_insert_function(const string& name, shared_ptr<type_id> rcv, const vector<shared_ptr<type_id>>& args, shared_ptr<type_id> ret) {
+			vector<llvm::Type*> params;
+			auto ret_t = type_of(ret);
+			auto sret = passed_in_memory(ret_t);
+			if (sret) params.push_back(ret_t->getPointerTo());
+			if (rcv != nullptr) params.push_back(type_of(rcv));
+			for (const auto& a : args) {
+				auto t = type_of(a);
+				params.push_back(passed_in_memory(t) ? t->getPointerTo() : t);
+			}
+			auto F_t = llvm::FunctionType::get(sret ? llvm::Type::getVoidTy(mod->getContext()) : ret_t, params, false);
+			auto F = llvm::cast<llvm::Function>(mod->getOrInsertFunction(name, F_t));
+			if (sret) {
+				F->addParamAttr(0, llvm::Attribute::StructRet);
+				F->addParamAttr(0, llvm::Attribute::NoAlias);
+			}
+			auto first_arg = (unsigned)(params.size() - args.size());
+			for (unsigned i = 0; i < args.size(); ++i) {
+				if (passed_in_memory(type_of(args[i]))) F->addParamAttr(first_arg + i, llvm::Attribute::ByVal);
 			}
+			return F;
 		}
 
-		void code_generator::define_type(const string& name, shared_ptr<type_id> type) {
+		void code_generator::define_type(symbol name, shared_ptr<type_id> type) {
 			types[name] = type_record{ type,{} };
 			auto st = dynamic_pointer_cast<struct_type>(type);
 			if (st != nullptr) {
-				st->init(mod->getContext(), name);
+				for (auto& f : st->fields)
+					f.second = f.second->resolve(this);
+				st->init(mod->getContext(), sym_name(name));
 				string csl = "";
 				for (const auto& f : st->fields)
-					csl += f.first + ":";
-				functions[csl].push_back(make_shared<struct_initializer>(st));
+					csl += sym_name(f.first) + ":";
+				add_function(sym(csl), make_shared<struct_initializer>(st));
 			}
 		}
 	}
@@ -4,6 +4,8 @@
 #include <iostream>
 #include <fstream>
 #include <unordered_map>
+#include <map>
+#include <set>
 #include <functional>
 #include <stack>
 #include <list>
@@ -17,6 +19,8 @@
 #include <llvm/ADT/APInt.h>
 #include <llvm/IR/InstrTypes.h>
 #include <llvm/IR/Constants.h>
+#include <llvm/IR/Intrinsics.h>
+#include <llvm/IR/MDBuilder.h>
 #include <llvm/IR/LegacyPassManager.h>
 #include <llvm/Support/raw_ostream.h>
 #include <llvm/Support/TargetRegistry.h>
@@ -30,11 +34,11 @@ namespace nkqc {
 			internal_codegen_error(const string& m) : runtime_error(m) {}
 		};
 		struct no_such_function_error : public runtime_error {
-			string selector;
+			symbol selector;
 			shared_ptr<type_id> reciever;
 			vector<shared_ptr<type_id>> arguments;
 
-			no_such_function_error(const string& m, const string& sel, shared_ptr<type_id> rcv, const vector<shared_ptr<type_id>>& arg)
+			no_such_function_error(const string& m, symbol sel, shared_ptr<type_id> rcv, const vector<shared_ptr<type_id>>& arg)
 				: runtime_error(m), selector(sel), reciever(rcv), arguments(arg) {}
 		};
 		struct type_mismatch_error : public runtime_error {
@@ -43,15 +47,20 @@ namespace nkqc {
 				: runtime_error(m), a(a), b(b) {}
 		};
 
+		// selectors whose block arguments expr_generator generates inline rather than as closures (closures.cpp)
+		bool inline_control(symbol sel);
+
 		struct code_generator : public typing_context {
 			shared_ptr<llvm::Module> mod;
 
-			//typedef unordered_map<string, pair<llvm::Value*, shared_ptr<type_id>>> expr_context;
+			//typedef unordered_map<symbol, pair<llvm::Value*, shared_ptr<type_id>>> expr_context;
 			struct expr_context {
-				typedef unordered_map<string, pair<llvm::Value*, shared_ptr<type_id>>> scope;
+				typedef unordered_map<symbol, pair<llvm::Value*, shared_ptr<type_id>>> scope;
 				list<scope> scopes;
+				// the caller's slot for the result of a function that returns a struct through memory, null otherwise
+				llvm::Value* sret;
 
-				expr_context() : scopes{{}} {}
+				expr_context() : scopes{{}}, sret(nullptr) {}
 
 				class iterator {
 					list<scope>::iterator cur_scope;
@@ -78,7 +87,7 @@ namespace nkqc {
 					const scope::value_type& operator ->() const { return *cur_val; }
 				};
 
-				void insert_or_assign(const string& name, shared_ptr<type_id> type, llvm::Value* value = nullptr) {
+				void insert_or_assign(symbol name, shared_ptr<type_id> type, llvm::Value* value = nullptr) {
 					auto place = find(name);
 					if (place != end()) {
 						place->second = { value == nullptr ? place->second.first : value,type };
@@ -87,15 +96,15 @@ namespace nkqc {
 						scopes.front()[name] = { value,type };
 					}
 				}
-				pair<llvm::Value*, shared_ptr<type_id>>& at(const string& name) {
+				pair<llvm::Value*, shared_ptr<type_id>>& at(symbol name) {
 					return find(name)->second;
 				}
-				pair<llvm::Value*, shared_ptr<type_id>>& operator[](const string& name) {
+				pair<llvm::Value*, shared_ptr<type_id>>& operator[](symbol name) {
 					return scopes.front()[name];
 				}
 				iterator begin() { return iterator(scopes.begin(), scopes.end(), scopes.front().begin()); }
 				iterator end() { return iterator(scopes.end(), scopes.end(), scopes.front().end()); }
-				iterator find(const string& name) {
+				iterator find(symbol name) {
 					for (auto scp = scopes.begin(); scp != scopes.end(); ++scp) {
 						auto pv = scp->find(name);
 						if (pv != scp->end()) return iterator(scp, scopes.end(), pv);
@@ -122,16 +131,21 @@ namespace nkqc {
 
 			struct type_record {
 				shared_ptr<type_id> type;
-				unordered_map<string, vector<shared_ptr<function>>> static_functions;
+				unordered_map<symbol, vector<shared_ptr<function>>> static_functions;
 			};
-			unordered_map<string, type_record> types;
-			virtual shared_ptr<type_id> type_for_name(const string & name) const override {
+			unordered_map<symbol, type_record> types;
+			virtual shared_ptr<type_id> type_for_name(symbol name) const override {
 				return types.at(name).type;
 			}
 
+			type_universe universe;
+			virtual shared_ptr<type_id> intern(shared_ptr<type_id> t) override {
+				return universe.intern(t);
+			}
+
 			struct binary_llvm_op : public function {
-				llvm::BinaryOperator::BinaryOps op;
-				binary_llvm_op(llvm::BinaryOperator::BinaryOps op) : op(op) {}
+				llvm::BinaryOperator::BinaryOps op, fop; // for integers and floats
+				binary_llvm_op(llvm::BinaryOperator::BinaryOps op, llvm::BinaryOperator::BinaryOps fop) : op(op), fop(fop) {}
 
 				void apply(expr_generator* g, llvm::Value* rcv, const vector<llvm::Value*>& args, shared_ptr<type_id> rcv_t, const vector<shared_ptr<type_id>>& args_t) override;
 
@@ -172,6 +186,93 @@ namespace nkqc {
 				bool can_apply(shared_ptr<type_id> rcv, const vector<shared_ptr<type_id>>& args) override;
 				shared_ptr<type_id> return_type(code_generator* e, shared_ptr<type_id> rcv, const vector<shared_ptr<type_id>>& args);
 			};
+			// s at: i, s at: i put: x on a slice, trapping unless 0 <= i < s size
+			struct slice_index_op : public function {
+				bool store;
+				slice_index_op(bool store) : store(store) {}
+				void apply(expr_generator* g, llvm::Value* rcv, const vector<llvm::Value*>& args, shared_ptr<type_id> rcv_t, const vector<shared_ptr<type_id>>& args_t) override;
+				bool can_apply(shared_ptr<type_id> rcv, const vector<shared_ptr<type_id>>& args) override;
+				shared_ptr<type_id> return_type(code_generator* e, shared_ptr<type_id> rcv, const vector<shared_ptr<type_id>>& args);
+			};
+			// s size
+			struct slice_size_op : public function {
+				slice_size_op() {}
+				void apply(expr_generator* g, llvm::Value* rcv, const vector<llvm::Value*>& args, shared_ptr<type_id> rcv_t, const vector<shared_ptr<type_id>>& args_t) override;
+				bool can_apply(shared_ptr<type_id> rcv, const vector<shared_ptr<type_id>>& args) override;
+				shared_ptr<type_id> return_type(code_generator* e, shared_ptr<type_id> rcv, const vector<shared_ptr<type_id>>& args);
+			};
+			// s from: a to: b, the elements a up to but not including b of s, without copying them
+			struct slice_range_op : public function {
+				slice_range_op() {}
+				void apply(expr_generator* g, llvm::Value* rcv, const vector<llvm::Value*>& args, shared_ptr<type_id> rcv_t, const vector<shared_ptr<type_id>>& args_t) override;
+				bool can_apply(shared_ptr<type_id> rcv, const vector<shared_ptr<type_id>>& args) override;
+				shared_ptr<type_id> return_type(code_generator* e, shared_ptr<type_id> rcv, const vector<shared_ptr<type_id>>& args);
+			};
+			// p slice: n, the n elements starting at p. {t} allocSliceOf: n, n new elements
+			struct make_slice_op : public function {
+				bool alloc;
+				make_slice_op(bool alloc) : alloc(alloc) {}
+				void apply(expr_generator* g, llvm::Value* rcv, const vector<llvm::Value*>& args, shared_ptr<type_id> rcv_t, const vector<shared_ptr<type_id>>& args_t) override;
+				bool can_apply(shared_ptr<type_id> rcv, const vector<shared_ptr<type_id>>& args) override;
+				shared_ptr<type_id> return_type(code_generator* e, shared_ptr<type_id> rcv, const vector<shared_ptr<type_id>>& args);
+			};
+			// {<n>t} splat: x, a vector with x in every lane
+			struct vector_splat_op : public function {
+				vector_splat_op() {}
+				void apply(expr_generator* g, llvm::Value* rcv, const vector<llvm::Value*>& args, shared_ptr<type_id> rcv_t, const vector<shared_ptr<type_id>>& args_t) override;
+				bool can_apply(shared_ptr<type_id> rcv, const vector<shared_ptr<type_id>>& args) override;
+				shared_ptr<type_id> return_type(code_generator* e, shared_ptr<type_id> rcv, const vector<shared_ptr<type_id>>& args);
+			};
+			// v lane: i
+			struct vector_extract_op : public function {
+				vector_extract_op() {}
+				void apply(expr_generator* g, llvm::Value* rcv, const vector<llvm::Value*>& args, shared_ptr<type_id> rcv_t, const vector<shared_ptr<type_id>>& args_t) override;
+				bool can_apply(shared_ptr<type_id> rcv, const vector<shared_ptr<type_id>>& args) override;
+				shared_ptr<type_id> return_type(code_generator* e, shared_ptr<type_id> rcv, const vector<shared_ptr<type_id>>& args);
+			};
+			// v lane: i put: x, a copy of v with lane i replaced by x
+			struct vector_insert_op : public function {
+				vector_insert_op() {}
+				void apply(expr_generator* g, llvm::Value* rcv, const vector<llvm::Value*>& args, shared_ptr<type_id> rcv_t, const vector<shared_ptr<type_id>>& args_t) override;
+				bool can_apply(shared_ptr<type_id> rcv, const vector<shared_ptr<type_id>>& args) override;
+				shared_ptr<type_id> return_type(code_generator* e, shared_ptr<type_id> rcv, const vector<shared_ptr<type_id>>& args);
+			};
+			// v shuffle: w mask: #(...), the lanes of v followed by those of w, picked by a vector literal
+			struct vector_shuffle_op : public function {
+				vector_shuffle_op() {}
+				void apply(expr_generator* g, llvm::Value* rcv, const vector<llvm::Value*>& args, shared_ptr<type_id> rcv_t, const vector<shared_ptr<type_id>>& args_t) override;
+				bool can_apply(shared_ptr<type_id> rcv, const vector<shared_ptr<type_id>>& args) override;
+				shared_ptr<type_id> return_type(code_generator* e, shared_ptr<type_id> rcv, const vector<shared_ptr<type_id>>& args);
+			};
+			// v sum, v product, v min, v max. halves of the vector are combined lane-wise until one lane is left
+			struct vector_reduce_op : public function {
+				enum kind_t { sum, product, min, max } kind;
+				vector_reduce_op(kind_t k) : kind(k) {}
+				void apply(expr_generator* g, llvm::Value* rcv, const vector<llvm::Value*>& args, shared_ptr<type_id> rcv_t, const vector<shared_ptr<type_id>>& args_t) override;
+				bool can_apply(shared_ptr<type_id> rcv, const vector<shared_ptr<type_id>>& args) override;
+				shared_ptr<type_id> return_type(code_generator* e, shared_ptr<type_id> rcv, const vector<shared_ptr<type_id>>& args);
+			};
+			// {<n>t} load: p at: i, the n elements of p starting at i. p only needs the alignment of t
+			struct vector_load_op : public function {
+				vector_load_op() {}
+				void apply(expr_generator* g, llvm::Value* rcv, const vector<llvm::Value*>& args, shared_ptr<type_id> rcv_t, const vector<shared_ptr<type_id>>& args_t) override;
+				bool can_apply(shared_ptr<type_id> rcv, const vector<shared_ptr<type_id>>& args) override;
+				shared_ptr<type_id> return_type(code_generator* e, shared_ptr<type_id> rcv, const vector<shared_ptr<type_id>>& args);
+			};
+			// v store: p at: i, the inverse of load:at:
+			struct vector_store_op : public function {
+				vector_store_op() {}
+				void apply(expr_generator* g, llvm::Value* rcv, const vector<llvm::Value*>& args, shared_ptr<type_id> rcv_t, const vector<shared_ptr<type_id>>& args_t) override;
+				bool can_apply(shared_ptr<type_id> rcv, const vector<shared_ptr<type_id>>& args) override;
+				shared_ptr<type_id> return_type(code_generator* e, shared_ptr<type_id> rcv, const vector<shared_ptr<type_id>>& args);
+			};
+			// b value, b value: x value: y ..., calls the closure b
+			struct closure_call_op : public function {
+				closure_call_op() {}
+				void apply(expr_generator* g, llvm::Value* rcv, const vector<llvm::Value*>& args, shared_ptr<type_id> rcv_t, const vector<shared_ptr<type_id>>& args_t) override;
+				bool can_apply(shared_ptr<type_id> rcv, const vector<shared_ptr<type_id>>& args) override;
+				shared_ptr<type_id> return_type(code_generator* e, shared_ptr<type_id> rcv, const vector<shared_ptr<type_id>>& args);
+			};
 			struct alloc_fn : public function {
 				alloc_fn() {}
 				void apply(expr_generator* g, llvm::Value* rcv, const vector<llvm::Value*>& args, shared_ptr<type_id> rcv_t, const vector<shared_ptr<type_id>>& args_t) override;
@@ -184,8 +285,37 @@ namespace nkqc {
 				bool can_apply(shared_ptr<type_id> rcv, const vector<shared_ptr<type_id>>& args) override;
 				shared_ptr<type_id> return_type(code_generator* e, shared_ptr<type_id> rcv, const vector<shared_ptr<type_id>>& args);
 			};
+			// p free, which hands p back to free(3), and p release, which puts a struct that came from {t} alloc back in
+			// its type's pool for the next alloc to reuse
 			struct free_fn : public function {
-				free_fn() {}
+				bool to_pool;
+				free_fn(bool to_pool) : to_pool(to_pool) {}
+				void apply(expr_generator* g, llvm::Value* rcv, const vector<llvm::Value*>& args, shared_ptr<type_id> rcv_t, const vector<shared_ptr<type_id>>& args_t) override;
+				bool can_apply(shared_ptr<type_id> rcv, const vector<shared_ptr<type_id>>& args) override;
+				shared_ptr<type_id> return_type(code_generator* e, shared_ptr<type_id> rcv, const vector<shared_ptr<type_id>>& args);
+			};
+			// {Arena} new, an empty arena on the heap
+			struct arena_new_fn : public function {
+				shared_ptr<type_id> arena;
+				arena_new_fn(shared_ptr<type_id> arena) : arena(arena) {}
+				void apply(expr_generator* g, llvm::Value* rcv, const vector<llvm::Value*>& args, shared_ptr<type_id> rcv_t, const vector<shared_ptr<type_id>>& args_t) override;
+				bool can_apply(shared_ptr<type_id> rcv, const vector<shared_ptr<type_id>>& args) override;
+				shared_ptr<type_id> return_type(code_generator* e, shared_ptr<type_id> rcv, const vector<shared_ptr<type_id>>& args);
+			};
+			// {t} allocIn: a, {t} allocArrayOf: n in: a
+			struct arena_alloc_fn : public function {
+				shared_ptr<type_id> arena_ptr;
+				bool array;
+				arena_alloc_fn(shared_ptr<type_id> arena_ptr, bool array) : arena_ptr(arena_ptr), array(array) {}
+				void apply(expr_generator* g, llvm::Value* rcv, const vector<llvm::Value*>& args, shared_ptr<type_id> rcv_t, const vector<shared_ptr<type_id>>& args_t) override;
+				bool can_apply(shared_ptr<type_id> rcv, const vector<shared_ptr<type_id>>& args) override;
+				shared_ptr<type_id> return_type(code_generator* e, shared_ptr<type_id> rcv, const vector<shared_ptr<type_id>>& args);
+			};
+			// a reset, which makes everything allocated in a reusable, and a free, which also frees a itself
+			struct arena_release_fn : public function {
+				shared_ptr<type_id> arena_ptr;
+				bool reset;
+				arena_release_fn(shared_ptr<type_id> arena_ptr, bool reset) : arena_ptr(arena_ptr), reset(reset) {}
 				void apply(expr_generator* g, llvm::Value* rcv, const vector<llvm::Value*>& args, shared_ptr<type_id> rcv_t, const vector<shared_ptr<type_id>>& args_t) override;
 				bool can_apply(shared_ptr<type_id> rcv, const vector<shared_ptr<type_id>>& args) override;
 				shared_ptr<type_id> return_type(code_generator* e, shared_ptr<type_id> rcv, const vector<shared_ptr<type_id>>& args);
@@ -193,10 +323,10 @@ namespace nkqc {
 
 			struct extern_fn : public function {
 				llvm::Function* f;
-				vector<pair<string, shared_ptr<type_id>>> args;
+				vector<pair<symbol, shared_ptr<type_id>>> args;
 				shared_ptr<type_id> return_t;
 
-				extern_fn(llvm::Function* f, vector<pair<string, shared_ptr<type_id>>> args,
+				extern_fn(llvm::Function* f, vector<pair<symbol, shared_ptr<type_id>>> args,
 					shared_ptr<type_id> rt) : f(f), args(args), return_t(rt) {}
 
 				void apply(expr_generator* g, llvm::Value* rcv, const vector<llvm::Value*>& args, shared_ptr<type_id> rcv_t, const vector<shared_ptr<type_id>>& args_t) override;
@@ -213,10 +343,16 @@ namespace nkqc {
 				llvm_function(const parser::fn_decl& d, llvm::Function* f) : decl(d), f(f) {}
 
 				void apply(expr_generator* g, llvm::Value* rcv, const vector<llvm::Value*>& args, shared_ptr<type_id> rcv_t, const vector<shared_ptr<type_id>>& args_t) override;
+				// apply, calling fn in place of f. fn must have f's type, like a specialization of it does
+				virtual void apply_as(llvm::Function* fn, expr_generator* g, llvm::Value* rcv, const vector<llvm::Value*>& args, shared_ptr<type_id> rcv_t, const vector<shared_ptr<type_id>>& args_t);
 
 				bool can_apply(shared_ptr<type_id> rcv, const vector<shared_ptr<type_id>>& args) override;
 
+				// returns the declared return type, or the memoized result of infer_return_type
 				shared_ptr<type_id> return_type(code_generator* gen, shared_ptr<type_id> rcv, const vector<shared_ptr<type_id>>& args) override;
+			protected:
+				// types the body of the function to find out what it returns
+				virtual shared_ptr<type_id> infer_return_type(code_generator* gen, shared_ptr<type_id> rcv, const vector<shared_ptr<type_id>>& args);
 			};
 
 			struct global_fn : public llvm_function {
@@ -250,7 +386,7 @@ namespace nkqc {
 				static_fn(const parser::fn_decl& d, llvm::Function* f) : llvm_function(d, f) {}
 
 				bool can_apply(shared_ptr<type_id> rcv, const vector<shared_ptr<type_id>>& args) override {
-					return rcv->equals(this->decl.receiver) && llvm_function::can_apply(rcv, args);
+					return rcv == this->decl.receiver && llvm_function::can_apply(rcv, args);
 				}
 			};
 
@@ -258,32 +394,122 @@ namespace nkqc {
 
 				method(const parser::fn_decl& d, llvm::Function* f) : llvm_function(d,f) {}
 
-				void apply(expr_generator* g, llvm::Value* rcv, const vector<llvm::Value*>& args, shared_ptr<type_id> rcv_t, const vector<shared_ptr<type_id>>& args_t) override;
+				void apply_as(llvm::Function* fn, expr_generator* g, llvm::Value* rcv, const vector<llvm::Value*>& args, shared_ptr<type_id> rcv_t, const vector<shared_ptr<type_id>>& args_t) override;
 
 				bool can_apply(shared_ptr<type_id> rcv, const vector<shared_ptr<type_id>>& args) override;
-
-				shared_ptr<type_id> return_type(code_generator* gen, shared_ptr<type_id> rcv, const vector<shared_ptr<type_id>>& args) override;
+			protected:
+				shared_ptr<type_id> infer_return_type(code_generator* gen, shared_ptr<type_id> rcv, const vector<shared_ptr<type_id>>& args) override;
 			};
 
-			unordered_map<string, vector<shared_ptr<function>>> functions;
+			unordered_map<symbol, vector<shared_ptr<function>>> functions;
+
+			// return types inferred for functions without a declared `-> type`, keyed by the function and the
+			// signature of the receiver and argument types it was applied to. a null entry marks an inference in progress
+			map<pair<const function*, string>, shared_ptr<type_id>> inferred_return_types;
+
+			// resolved types are interned, so a signature is just the identities of the types in it
+			static string type_signature(shared_ptr<type_id> rcv, const vector<shared_ptr<type_id>>& args) {
+				string sig;
+				sig.reserve((args.size() + 1) * sizeof(type_id*));
+				auto p = rcv.get();
+				sig.append((const char*)&p, sizeof(p));
+				for (const auto& a : args) {
+					p = a.get();
+					sig.append((const char*)&p, sizeof(p));
+				}
+				return sig;
+			}
 
 			code_generator(shared_ptr<llvm::Module> mod);
 
-			shared_ptr<function> lookup_function(const string& sel, shared_ptr<type_id> recv, const vector<shared_ptr<type_id>>& args) {
+			// overload resolution results for each selector, keyed by the type signature they were resolved for
+			unordered_map<symbol, unordered_map<string, shared_ptr<function>>> dispatch_index;
+			struct lookup_stats {
+				size_t hits, misses;
+				lookup_stats() : hits(0), misses(0) {}
+			};
+			lookup_stats dispatch_stats;
+
+			void add_function(symbol sel, shared_ptr<function> f) {
+				functions[sel].push_back(f);
+				dispatch_index.erase(sel); // a new overload may change the resolution of any signature
+			}
+
+			shared_ptr<function> lookup_function(symbol sel, shared_ptr<type_id> recv, const vector<shared_ptr<type_id>>& args) {
+				auto& index = dispatch_index[sel];
+				auto sig = type_signature(recv, args);
+				auto hit = index.find(sig);
+				if (hit != index.end()) {
+					dispatch_stats.hits++;
+					return hit->second;
+				}
+				dispatch_stats.misses++;
+				shared_ptr<function> res = nullptr;
 				auto fs = functions.find(sel);
-				if (fs == functions.end()) return nullptr;
-				for (auto& f : fs->second) {
-					if (f->can_apply(recv, args)) return f;
+				if (fs != functions.end()) {
+					for (auto& f : fs->second) {
+						if (f->can_apply(recv, args)) { res = f; break; }
+					}
 				}
-				return nullptr;
+				index[sig] = res;
+				return res;
 			}
 
+			// the type the block literal passed as argument i of a send of sel to rcv is a closure of: the function type of
+			// that parameter of the overloads that accept the send. args are the argument types, null for each argument
+			// in arg_exprs that is a block literal. null if no overload does, or ones with different types there do
+			shared_ptr<function_type> closure_type(symbol sel, shared_ptr<type_id> rcv, const vector<shared_ptr<type_id>>& args,
+				const vector<ast::expr*>& arg_exprs, size_t i);
+
+			// whether a closure passed as argument i of f can outlive the call, so that its environment has to be on the heap.
+			// f may call it and pass it on to parameters that don't escape; anything else, or a function whose body
+			// isn't known, lets it escape
+			bool parameter_escapes(function* f, size_t i);
+			map<pair<const function*, size_t>, bool> escaping_params;
+			// parameters assumed not to escape while their own function is walked, so a recursive call passing one on doesn't count
+			set<pair<const function*, size_t>> escape_assumptions;
+
+			// the code of every closure value made in the function being generated whose code is known: block literals,
+			// and the block parameters of specializations
+			unordered_map<const llvm::Value*, llvm::Function*> closure_code;
+			// the variables of fn that closures on the heap can't capture, because they can change after a closure copies
+			// them (closures.cpp). reassigned holds them for the function being generated
+			set<symbol> reassigned_variables(const parser::fn_decl& fn);
+			set<symbol> reassigned;
+			// a copy of f generated with argument i bound to a closure whose code is always code, so that calling it is a
+			// direct call that can be inlined, like a template instantiated for a lambda. specializations are internal to
+			// mod and memoized per callee, argument and block. null if f's body can't be specialized
+			llvm::Function* specialize(shared_ptr<llvm_function> f, size_t i, llvm::Function* code);
+			map<tuple<const function*, size_t, const llvm::Function*>, llvm::Function*> specializations;
+
+			// resolved type of every expression in the function currently being defined, filled in by a single
+			// annotating expr_typer pass (type_body) so that expr_generator never has to re-type a subtree
+			unordered_map<const ast::expr*, shared_ptr<type_id>> expr_types;
+			// number of expression nodes visited by any expr_typer while defining the current function
+			size_t typer_visits;
+			// the function body that expr_types currently describes
+			const ast::expr* typed_body;
+			// print debugging output while generating code. off in parallel workers, where it would interleave
+			bool trace;
+			// mark floating point arithmetic with every fast-math flag, so that reductions can be reassociated and
+			// vectorized and multiplies and adds contracted
+			bool fast_math;
+			// generate specializations for block literals. off in the repl, where a specialization would keep running
+			// the callee's old body after it is redefined
+			bool specialize_blocks;
+
 			struct expr_typer : public ast::expr_visiter<> {
 				stack<shared_ptr<type_id>> s;
 				code_generator* gen;
 				expr_context* cx;
+				bool record;
 
-				expr_typer(code_generator* g, expr_context* cx) : gen(g), cx(cx) {}
+				expr_typer(code_generator* g, expr_context* cx, bool record = false) : gen(g), cx(cx), record(record) {}
+
+				// type a subexpression, storing its resolved type in gen->expr_types if this typer is recording
+				void annotate(const ast::expr* x);
+				// type a block literal passed for a parameter of type ft, its arguments taking their types from ft
+				shared_ptr<type_id> closure(const ast::block_expr& x, shared_ptr<function_type> ft);
 
 				void visit(const nkqc::ast::id_expr &x) override;
 				void visit(const nkqc::ast::string_expr &x) override;
@@ -301,16 +527,57 @@ namespace nkqc {
 				virtual void visit(const nkqc::ast::cascade_msgsnd &x);
 				virtual void visit(const nkqc::ast::assignment_expr &x);
 			};
-			shared_ptr<type_id> type_of(shared_ptr<ast::expr> expr, expr_context* cx) {
+			shared_ptr<type_id> type_of(const ast::expr* expr, expr_context* cx) {
+				auto known = expr_types.find(expr);
+				if (known != expr_types.end()) return known->second;
 				expr_typer t{ this, cx };
-				expr->visit(&t);
+				t.annotate(expr);
 				return t.s.top()->resolve(this);
 			}
 
 			llvm::Type* type_of(shared_ptr<type_id> expr) {
-				return expr->resolve(this)->llvm_type(mod->getContext());
+				return universe.llvm_type(expr->resolve(this), mod->getContext());
+			}
+
+			// f as it can be called from mod: f itself, or a declaration of it if it was generated into another module
+			llvm::Function* callee(llvm::Function* f) {
+				if (f->getParent() == mod.get()) return f;
+				auto d = llvm::cast<llvm::Function>(mod->getOrInsertFunction(f->getName(), f->getFunctionType()));
+				d->setDLLStorageClass(f->getDLLStorageClass());
+				d->setAttributes(f->getAttributes());
+				return d;
 			}
 
+			// structs bigger than this are passed to functions as byval copies and returned through an sret slot that the
+			// caller provides and the callee builds its result in. smaller ones, like everything else, go in registers
+			static const uint64_t register_struct_bytes = 16;
+			static bool passed_in_memory(llvm::Type* t);
+			// the llvm function for a function taking a receiver (if rcv isn't null) and args and returning ret, declared
+			// with that calling convention. the sret slot comes first, then the receiver
+			llvm::Function* get_or_insert_function(const string& name, shared_ptr<type_id> rcv, const vector<shared_ptr<type_id>>& args, shared_ptr<type_id> ret);
+
+			// slice variables whose at: and at:put: sends in the body of a counted loop, indexed by its counter, can go
+			// unchecked once the loop's range has been checked against their sizes before it runs (loop_bounds.cpp)
+			vector<symbol> slices_indexed_by(symbol counter, const ast::block_expr* body, expr_context* cx);
+			// (where a slice is stored, index) pairs in the loop being generated, with the flag its preheader computed
+			// for whether the loop's whole range is in bounds. their checks pass without comparing when it is set
+			map<pair<const llvm::Value*, const llvm::Value*>, llvm::Value*> in_bounds;
+
+			// the integer type malloc takes its size in, as wide as a pointer. every call to malloc uses it, so mod declares
+			// malloc once
+			llvm::IntegerType* size_type() { return mod->getDataLayout().getIntPtrType(mod->getContext()); }
+
+			// the built in Arena struct, a bump allocator that frees everything it handed out at once
+			shared_ptr<struct_type> arena_t;
+			// the allocation runtime, generated into mod the first time a function in it needs each piece (runtime.cpp)
+			llvm::Function* arena_alloc_function();
+			llvm::Function* arena_reset_function();
+			llvm::Function* arena_free_function();
+			llvm::Function* pool_take_function();
+			llvm::Function* pool_give_function();
+			// the head of the freelist that {t} alloc takes from and release gives back to
+			llvm::GlobalVariable* pool_of(shared_ptr<struct_type> t);
+
 			struct expr_generator : public ast::expr_visiter<> {
 				code_generator* gen;
 				llvm::BasicBlock* bb;
@@ -319,15 +586,33 @@ namespace nkqc {
 				stack<llvm::Value*> s;
 
 				expr_generator(code_generator* gen, llvm::BasicBlock* bb, expr_context* cx)
-					: gen(gen), bb(bb), cx(cx), irb(bb) {}
+					: gen(gen), bb(bb), cx(cx), irb(bb) {
+					if (gen->fast_math) {
+						llvm::FastMathFlags fmf;
+						fmf.setUnsafeAlgebra();
+						fmf.setAllowContract(true);
+						irb.setFastMathFlags(fmf);
+					}
+				}
+
+				// in the entry block, where mem2reg can promote it, even if it is made inside a loop
+				llvm::AllocaInst* entry_alloca(llvm::Type* t, const char* name) {
+					auto& entry = irb.GetInsertBlock()->getParent()->getEntryBlock();
+					llvm::IRBuilder<> eb(&entry, entry.begin());
+					return eb.CreateAlloca(t, nullptr, name);
+				}
 
 				void allocate() {
-					auto a = irb.CreateAlloca(s.top()->getType(), nullptr, "var");
+					auto a = entry_alloca(s.top()->getType(), "var");
 					irb.CreateStore(s.top(), a);
 					s.pop();
 					s.push(a);
 				}
 
+				// calls fn, which was declared by get_or_insert_function, and pushes what it returns. structs it takes
+				// byval are copied to the stack here, and one it returns through memory gets a slot here
+				void call(llvm::Function* fn, vector<llvm::Value*> args);
+
 				virtual void visit(const nkqc::ast::id_expr &x) override;
 				virtual void visit(const nkqc::ast::string_expr &x) override;
 				virtual void visit(const nkqc::ast::number_expr &x) override;
@@ -343,15 +628,38 @@ namespace nkqc {
 				virtual void visit(const nkqc::ast::keyword_msgsnd &x) override;
 				virtual void visit(const nkqc::ast::cascade_msgsnd &x) override;
 				virtual void visit(const nkqc::ast::assignment_expr &x) override;
+
+				// start to: stop do: [ :i | ... ], start to: stop by: step do: [ :i | ... ] and n timesRepeat: [ ... ] as a
+				// loop with an induction variable in a phi, guarded so that it can run zero times
+				void counted_loop(const nkqc::ast::keyword_msgsnd& x, llvm::Value* start, shared_ptr<type_id> counter_t);
+
+				// a block literal as a closure: its body as a function of its own, and an environment holding what the body
+				// refers to from this one. on the stack, the environment points at this function's variables, so it must not
+				// outlive the call it is made for. otherwise it holds a copy of their values on the heap until the closure is
+				// sent free, and can only capture variables that are never assigned once it could have been made
+				void closure(const nkqc::ast::block_expr& x, bool on_stack);
 			};
-			void generate_expr(expr_context cx, shared_ptr<nkqc::ast::expr> expr, llvm::BasicBlock* block) {
+			void generate_expr(expr_context cx, nkqc::ast::expr* expr, llvm::BasicBlock* block) {
 				expr_generator xg{ this, block, &cx };
 				expr->visit(&xg);
 			}
 
+			// declares and then immediately generates a function
 			llvm::Function* define_function(nkqc::parser::fn_decl fn);
 
-			void define_type(const string& name, shared_ptr<type_id> type);
+			// registers a function's signature so that it can be called, without generating its body.
+			// returns nullptr for external functions, which have no body to generate
+			shared_ptr<llvm_function> declare_function(nkqc::parser::fn_decl fn);
+			void generate_body(shared_ptr<llvm_function> f);
+			// generates f's body into fn, with argument block_arg bound to a closure whose code is block_code if that isn't null
+			void generate_body(shared_ptr<llvm_function> f, llvm::Function* fn, size_t block_arg, llvm::Function* block_code);
+
+			// variables visible in a function's body before it assigns any: its arguments and the instance variables of its receiver
+			expr_context function_scope(const parser::fn_decl& fn);
+			// fill in expr_types for the body of fn
+			void type_body(const parser::fn_decl& fn);
+
+			void define_type(symbol name, shared_ptr<type_id> type);
 		};
 	}
 }
@@ -16,6 +16,7 @@
 #include <llvm/IR/Constants.h>
 #include <llvm/IR/LegacyPassManager.h>
 #include <llvm/Support/raw_ostream.h>
+#include <llvm/Support/MemoryBuffer.h>
 #include <llvm/Support/TargetRegistry.h>
 #include <llvm/Support/TargetSelect.h>
 #include <llvm/Target/TargetMachine.h>
@@ -84,34 +85,146 @@ struct result {
 #include "types.h"
 
 #include "llvm_codegen.h"
+#include "parallel_codegen.h"
+#include "build_cache.h"
+#include "interface_file.h"
+#include "backend.h"
+#include "jit.h"
+#include "repl.h"
+#include <thread>
+#include <chrono>
 
 int main(int argc, char* argv[]) {
+	auto started = chrono::steady_clock::now();
 	vector<string> args; for (int i = 1; i < argc; i++) args.push_back(argv[i]);
+	vector<string> inputs; // compiled in order into one program, as if they were a single file
+	string output_path;
+	size_t jobs = 0; // 0 generates each function as soon as it is parsed, otherwise the whole file is generated on this many threads
+	string cache_dir, interface_out;
+	vector<string> preludes;
+	nkqc::codegen::backend_options backend;
+	bool run = false; // JIT compile the program and call its main function instead of writing an object file
+	bool interactive = false; // read declarations and expressions from stdin, compiling and running each one as it is entered
+	for (size_t i = 0; i < args.size(); ++i) {
+		if (backend.parse_opt_flag(args[i]) || backend.parse_target_flag(args[i])) continue;
+		if (args[i] == "-j" && i + 1 < args.size()) {
+			// stoul would take a sign, wrapping -4 to a huge count, and 0 would quietly mean serial
+			const auto& n = args[++i];
+			jobs = 0;
+			if (!n.empty() && n.find_first_not_of("0123456789") == string::npos) {
+				try { jobs = stoul(n); }
+				catch (const out_of_range&) {}
+			}
+			if (jobs == 0) {
+				cout << "error: -j takes a number of threads, not " << n << endl;
+				return 1;
+			}
+		}
+		else if (args[i] == "--cache" && i + 1 < args.size()) cache_dir = args[++i];
+		else if (args[i] == "--prelude" && i + 1 < args.size()) preludes.push_back(args[++i]);
+		else if (args[i] == "--emit-interface" && i + 1 < args.size()) interface_out = args[++i];
+		else if (args[i] == "--target" && i + 1 < args.size()) backend.triple = args[++i];
+		else if (args[i] == "-o" && i + 1 < args.size()) output_path = args[++i];
+		else if (args[i] == "--whole-program") backend.whole_program = true;
+		else if (args[i] == "--fast-math") backend.fast_math = true;
+		else if (args[i] == "--report-promotions") backend.report_promotions = true;
+		else if (args[i] == "--run") run = true;
+		else if (args[i] == "--repl") interactive = true;
+		else inputs.push_back(args[i]);
+	}
+	if (inputs.empty() && !interactive) {
+		cout << "error: no input files" << endl;
+		return 1;
+	}
+	if (output_path.empty() && !inputs.empty()) output_path = inputs[0] + ".o";
+	// code compiled into this process only has to run on this machine. it always targets the host, whatever --target says
+	if ((run || interactive) && backend.cpu.empty()) backend.cpu = "native";
+	// the compiler's listing of what it parsed and generated. --run leaves stdout to the program
+	bool verbose = !run;
+	// the cache works on whole programs, which go through the parallel generator
+	if (!cache_dir.empty() && jobs == 0) jobs = max(1u, thread::hardware_concurrency());
 
 	llvm::LLVMContext ctx;
-	auto mod = make_shared<llvm::Module>(args[0], ctx);
-	try {
-
-		string s;
-		ifstream input_file(args[0]);
-		while (input_file) {
-			string line; getline(input_file, line);
-			s += line + "\n";
+	if (interactive) {
+		llvm::InitializeNativeTarget();
+		llvm::InitializeNativeTargetAsmPrinter();
+		try {
+			nkqc::codegen::repl session{ ctx, nkqc::codegen::create_target_machine(llvm::sys::getProcessTriple(), backend), backend };
+			for (const auto& i : preludes) session.load_prelude(i);
+			session.run(cin, cout);
+		} catch (const nkqc::codegen::internal_codegen_error& e) {
+			cout << "internal error: " << e.what() << endl;
+			return 1;
 		}
-		auto p = nkqc::parser::file_parser{};
+		return 0;
+	}
+	auto mod = make_shared<llvm::Module>(inputs[0], ctx);
+	string parsing; // the input being parsed, for error messages
+	try {
+		// large files are mapped read-only and pipes (or "-" for stdin) are read in one go, the parser works directly on
+		// the bytes. the parallel generator runs after everything is parsed, so every input is kept until the end
+		vector<unique_ptr<llvm::MemoryBuffer>> sources;
+		// owns the AST; declared before the code generator so every node outlives it
+		nkqc::ast::arena nodes;
+		auto p = nkqc::parser::file_parser{ &nodes };
 		auto cg = nkqc::codegen::code_generator{ mod };
+		cg.trace = verbose;
+		cg.fast_math = backend.fast_math;
+		nkqc::codegen::program prog;
+		prog.interfaces = preludes;
+		prog.fast_math = backend.fast_math;
+		for (const auto& i : preludes) {
+			nkqc::codegen::load_interface(cg, i);
+		}
 
-		p.parse_all(s, [&](const nkqc::parser::fn_decl& f) {
-			cout << f.selector << " -> ";
-			f.body->print(cout);
-			cout << endl;
-			cg.define_function(f);
-		}, [&](const string& name, shared_ptr<nkqc::type_id> structure) {
-			cg.define_type(name, structure);
-		});
-		llvm::outs() << *mod << "\n";
+		for (const auto& input_path : inputs) {
+			auto input = llvm::MemoryBuffer::getFileOrSTDIN(input_path);
+			if (!input) {
+				cout << "error: could not read " << input_path << ": " << input.getError().message() << endl;
+				return 1;
+			}
+			sources.push_back(move(*input));
+			parsing = input_path;
+			p.parse_all(sources.back()->getBuffer(), [&](const nkqc::parser::fn_decl& f) {
+				if (verbose) {
+					cout << nkqc::sym_name(f.selector) << " -> ";
+					f.body->print(cout);
+					cout << endl;
+				}
+				if (jobs > 0) {
+					prog.functions.push_back(f);
+					return;
+				}
+				cg.define_function(f);
+				if (verbose) cout << "\ttyper visits: " << cg.typer_visits << endl;
+			}, [&](nkqc::symbol name, shared_ptr<nkqc::type_id> structure) {
+				if (jobs > 0) prog.types.push_back({ name, structure });
+				else cg.define_type(name, structure);
+			});
+		}
+		if (jobs > 0 && !interface_out.empty()) {
+			// the interface is written from cg, so it has to know about everything the workers generate
+			for (const auto& t : prog.types) {
+				auto st = dynamic_pointer_cast<nkqc::struct_type>(t.second);
+				cg.define_type(t.first, st != nullptr ? make_shared<nkqc::struct_type>(st->fields) : t.second);
+			}
+			for (const auto& f : prog.functions) cg.declare_function(f);
+		}
+		if (!cache_dir.empty()) {
+			nkqc::codegen::build_cache cache{ cache_dir };
+			nkqc::codegen::generate_parallel(prog, mod, jobs, 32, &cache);
+			if (verbose) cout << "cache: " << cache.hits << " functions reused, " << cache.misses << " regenerated" << endl;
+		}
+		else if (jobs > 0) nkqc::codegen::generate_parallel(prog, mod, jobs);
+		if (!interface_out.empty()) nkqc::codegen::write_interface(cg, interface_out);
+		if (verbose) {
+			llvm::outs() << *mod << "\n";
+			cout << "ast: " << nodes.node_count << " nodes in " << nodes.bytes_reserved / 1024 << "KiB" << endl;
+			if (jobs == 0)
+				cout << "function lookups: " << cg.dispatch_stats.hits << " hits, " << cg.dispatch_stats.misses << " misses" << endl;
+		}
 	} catch (const nkqc::parser::parse_error& e) {
-		cout << "error parsing at line " << e.line << ", column " << e.col << ": " << e.what() << endl;
+		cout << "error parsing " << parsing << " at line " << e.line << ", column " << e.col << ": " << e.what() << endl;
 		return 1;
 	} catch (const nkqc::codegen::internal_codegen_error& e) {
 		cout << "internal error: " << e.what() << endl;
@@ -124,7 +237,7 @@ int main(int argc, char* argv[]) {
 		cout << "; " << e.what() << endl;
 		return 1;
 	} catch (const nkqc::codegen::no_such_function_error& e) {
-		cout << "error: no such function " << e.selector << endl;
+		cout << "error: no such function " << nkqc::sym_name(e.selector) << endl;
 		if (e.reciever != nullptr) {
 			cout << "\twith receiver: ";
 			e.reciever->print(cout);
@@ -149,17 +262,42 @@ int main(int argc, char* argv[]) {
 	llvm::InitializeAllAsmParsers();
 	llvm::InitializeAllAsmPrinters();
 
-	auto targ_trip = llvm::sys::getDefaultTargetTriple();
+	if (run) {
+		try {
+			auto targ_trip = llvm::sys::getProcessTriple();
+			auto mach = nkqc::codegen::create_target_machine(targ_trip, backend);
+			nkqc::codegen::target_module(*mod, mach.get());
+			if (backend.whole_program) nkqc::codegen::internalize(*mod, { "main" });
+			nkqc::codegen::optimize(*mod, mach.get(), backend);
+			auto entry = mod->getFunction("main");
+			if (entry == nullptr || entry->isDeclaration()) throw nkqc::codegen::internal_codegen_error("no main function to run");
+			nkqc::codegen::jit engine{ move(mach) };
+			engine.add_module(mod);
+			// compile everything up front so that compiling isn't counted as running
+			engine.address_of("main");
+			auto compiled = chrono::steady_clock::now();
+			auto code = engine.call_entry(entry);
+			auto finished = chrono::steady_clock::now();
+			cerr << "compile: " << chrono::duration<double, milli>(compiled - started).count() << "ms, "
+				<< "run: " << chrono::duration<double, milli>(finished - compiled).count() << "ms" << endl;
+			return code;
+		} catch (const nkqc::codegen::internal_codegen_error& e) {
+			cout << "internal error: " << e.what() << endl;
+			return 1;
+		}
+	}
+
+	auto targ_trip = backend.triple.empty() ? llvm::sys::getDefaultTargetTriple() : backend.triple;
 	cout << "target triple: " << targ_trip << endl;
-	mod->setTargetTriple(targ_trip);
-	string err;
-	auto targ = llvm::TargetRegistry::lookupTarget(targ_trip, err);
-	auto mach = targ->createTargetMachine(targ_trip, "generic", "", llvm::TargetOptions{}, llvm::Optional<llvm::Reloc::Model>{});
-	mod->setDataLayout(mach->createDataLayout());
-	error_code ec;
-	llvm::raw_fd_ostream d(args[0] + ".o", ec, llvm::sys::fs::OpenFlags{});
-	llvm::legacy::PassManager pass;
-	mach->addPassesToEmitFile(pass, d, llvm::TargetMachine::CGFT_ObjectFile);
-	pass.run(*mod.get());
-	d.flush();
+	try {
+		auto mach = nkqc::codegen::create_target_machine(targ_trip, backend);
+		nkqc::codegen::target_module(*mod, mach.get());
+		cout << "target cpu: " << mach->getTargetCPU().str() << endl;
+		if (backend.whole_program) nkqc::codegen::internalize(*mod, { "main" });
+		nkqc::codegen::optimize(*mod, mach.get(), backend);
+		nkqc::codegen::emit_object(*mod, mach.get(), output_path);
+	} catch (const nkqc::codegen::internal_codegen_error& e) {
+		cout << "internal error: " << e.what() << endl;
+		return 1;
+	}
 }
@@ -0,0 +1,131 @@
+#include "llvm_codegen.h"
+
+namespace nkqc {
+	namespace codegen {
+		// the slice variables sent at: or at:put: with counter as the index, and the variables assigned, outside of closures
+		struct counter_index_finder : public ast::expr_visiter<> {
+			symbol counter, at, at_put;
+			vector<symbol> slices;
+			set<symbol> assigned;
+
+			counter_index_finder(symbol counter) : counter(counter), at(sym("at:")), at_put(sym("at:put:")) {}
+
+			void walk(const ast::expr* x) {
+				if (dynamic_cast<const parser::type_expr*>(x) == nullptr) x->visit(this);
+			}
+			void walk_inline(const ast::expr* x) {
+				auto blk = dynamic_cast<const ast::block_expr*>(x);
+				walk(blk != nullptr ? blk->body : x);
+			}
+
+			void visit(const ast::id_expr& x) override {}
+			void visit(const ast::string_expr& x) override {}
+			void visit(const ast::number_expr& x) override {}
+			void visit(const ast::block_expr& x) override {}
+			void visit(const ast::symbol_expr& x) override {}
+			void visit(const ast::char_expr& x) override {}
+			void visit(const ast::array_expr& x) override {
+				for (auto v : x.vs) walk(v);
+			}
+			void visit(const ast::tag_expr& x) override {}
+			void visit(const ast::seq_expr& x) override { walk(x.first); walk(x.second); }
+			void visit(const ast::return_expr& x) override { walk(x.val); }
+			void visit(const ast::unary_msgsnd& x) override { walk(x.rcv); }
+			void visit(const ast::binary_msgsnd& x) override { walk(x.rcv); walk(x.rhs); }
+			void visit(const ast::keyword_msgsnd& x) override {
+				if ((x.msgname == at || x.msgname == at_put) && !x.args.empty()) {
+					auto s = dynamic_cast<const ast::id_expr*>(x.rcv);
+					auto i = dynamic_cast<const ast::id_expr*>(x.args[0]);
+					if (s != nullptr && i != nullptr && i->v == counter && find(slices.begin(), slices.end(), s->v) == slices.end())
+						slices.push_back(s->v);
+				}
+				auto ctl = inline_control(x.msgname);
+				if (ctl) walk_inline(x.rcv); else walk(x.rcv);
+				for (auto a : x.args) {
+					if (ctl) walk_inline(a); else walk(a);
+				}
+			}
+			void visit(const ast::cascade_msgsnd& x) override {
+				walk(x.rcv);
+				for (const auto& m : x.msgs) {
+					for (auto a : m.second) walk(a);
+				}
+			}
+			void visit(const ast::assignment_expr& x) override {
+				assigned.insert(x.name);
+				walk(x.val);
+			}
+		};
+
+		// the variables assigned inside closures, which could change them in the middle of a loop that calls one
+		struct closure_assignments : public ast::expr_visiter<> {
+			set<symbol> assigned;
+			int depth;
+
+			closure_assignments() : depth(0) {}
+
+			void walk(const ast::expr* x) {
+				if (dynamic_cast<const parser::type_expr*>(x) == nullptr) x->visit(this);
+			}
+			void walk_inline(const ast::expr* x) {
+				auto blk = dynamic_cast<const ast::block_expr*>(x);
+				walk(blk != nullptr ? blk->body : x);
+			}
+
+			void visit(const ast::id_expr& x) override {}
+			void visit(const ast::string_expr& x) override {}
+			void visit(const ast::number_expr& x) override {}
+			void visit(const ast::block_expr& x) override { depth++; walk(x.body); depth--; }
+			void visit(const ast::symbol_expr& x) override {}
+			void visit(const ast::char_expr& x) override {}
+			void visit(const ast::array_expr& x) override {
+				for (auto v : x.vs) walk(v);
+			}
+			void visit(const ast::tag_expr& x) override {}
+			void visit(const ast::seq_expr& x) override { walk(x.first); walk(x.second); }
+			void visit(const ast::return_expr& x) override { walk(x.val); }
+			void visit(const ast::unary_msgsnd& x) override { walk(x.rcv); }
+			void visit(const ast::binary_msgsnd& x) override { walk(x.rcv); walk(x.rhs); }
+			void visit(const ast::keyword_msgsnd& x) override {
+				auto ctl = inline_control(x.msgname);
+				if (ctl) walk_inline(x.rcv); else walk(x.rcv);
+				for (auto a : x.args) {
+					if (ctl) walk_inline(a); else walk(a);
+				}
+			}
+			void visit(const ast::cascade_msgsnd& x) override {
+				walk(x.rcv);
+				for (const auto& m : x.msgs) {
+					for (auto a : m.second) walk(a);
+				}
+			}
+			void visit(const ast::assignment_expr& x) override {
+				if (depth > 0) assigned.insert(x.name);
+				walk(x.val);
+			}
+		};
+
+		vector<symbol> code_generator::slices_indexed_by(symbol counter, const ast::block_expr* body, expr_context* cx) {
+			if (typed_body == nullptr) return {};
+			counter_index_finder indexed(counter);
+			indexed.walk(body->body);
+			if (indexed.slices.empty()) return {};
+			// a slice that changes while the loop runs could shrink out from under the check
+			closure_assignments in_closures;
+			in_closures.walk(typed_body);
+			vector<symbol> res;
+			for (auto v : indexed.slices) {
+				auto b = cx->find(v);
+				if (b == cx->end() || dynamic_pointer_cast<slice_type>(b->second.second) == nullptr) continue;
+				if (indexed.assigned.count(v) != 0 || in_closures.assigned.count(v) != 0) continue;
+				// only this function's own variables and arguments. an instance variable lives in the receiver, where a
+				// method sent in the loop can assign it, and a variable captured by reference lives in another frame
+				auto place = b->second.first;
+				if (!llvm::isa<llvm::AllocaInst>(place) && !llvm::isa<llvm::Argument>(place) && place->getType() != type_of(b->second.second))
+					continue;
+				res.push_back(v);
+			}
+			return res;
+		}
+	}
+}
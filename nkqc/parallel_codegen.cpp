@@ -0,0 +1,178 @@
+#include "parallel_codegen.h"
+#include "build_cache.h"
+#include "interface_file.h"
+#include <thread>
+#include <atomic>
+#include <exception>
+#include <algorithm>
+
+#include <llvm/Bitcode/BitcodeReader.h>
+#include <llvm/Bitcode/BitcodeWriter.h>
+#include <llvm/Linker/Linker.h>
+#include <llvm/Transforms/Utils/Cloning.h>
+
+namespace nkqc {
+	namespace codegen {
+		// drop the prototypes and private globals nothing in m refers to, the other chunks define or declare their own
+		static void strip_unused(llvm::Module& m) {
+			for (auto f = m.begin(); f != m.end();) {
+				auto& F = *f++;
+				if (F.isDeclaration() && F.use_empty()) F.eraseFromParent();
+			}
+			for (auto g = m.global_begin(); g != m.global_end();) {
+				auto& G = *g++;
+				G.removeDeadConstantUsers();
+				if (G.hasLocalLinkage() && G.use_empty()) G.eraseFromParent();
+			}
+		}
+
+		static string bitcode_of(llvm::Module& m) {
+			strip_unused(m);
+			string bc;
+			llvm::raw_string_ostream os(bc);
+			llvm::WriteBitcodeToFile(&m, os);
+			os.flush();
+			return bc;
+		}
+
+		// defines what every code_generator for p needs before it declares p's functions
+		static void define_types(code_generator& cg, const program& p) {
+			cg.trace = false;
+			cg.fast_math = p.fast_math;
+			// the interfaces' code is linked into the final module once, chunks only need their declarations
+			for (const auto& i : p.interfaces) {
+				load_interface(cg, i, false);
+			}
+			for (const auto& t : p.types) {
+				// struct_type holds its lowered LLVM type, so every context needs its own copy
+				auto st = dynamic_pointer_cast<struct_type>(t.second);
+				cg.define_type(t.first, st != nullptr ? make_shared<struct_type>(st->fields) : t.second);
+			}
+		}
+
+		// declares every function in p once, which types the bodies of those without a return type, and returns
+		// their signatures so that chunks can load them instead of declaring (and typing) all of p again.
+		// with a cache, signatures cached under the function's key are loaded instead of declared
+		static string signatures_of(const program& p, build_cache* cache, const vector<string>& keys) {
+			llvm::LLVMContext ctx;
+			code_generator cg{ make_shared<llvm::Module>("signatures", ctx) };
+			define_types(cg, p);
+			vector<pair<symbol, shared_ptr<code_generator::function>>> fns;
+			unordered_set<llvm::Function*> defined;
+			for (size_t i = 0; i < p.functions.size(); ++i) {
+				const auto& f = p.functions[i];
+				string cached;
+				if (cache != nullptr && cache->load_signature(keys[i], cached)) {
+					fns.push_back({ f.selector, load_signatures(cg, cached).at(0) });
+				}
+				else {
+					shared_ptr<code_generator::function> fobj = cg.declare_function(f);
+					// external functions aren't returned, but are the newest overload of their selector
+					if (fobj == nullptr) fobj = cg.functions.at(f.selector).back();
+					fns.push_back({ f.selector, fobj });
+					if (cache != nullptr) cache->store_signature(keys[i], write_signatures(cg, { fns.back() }));
+				}
+				// no body has been generated yet for declare_function to find, and once the chunks generate them a
+				// duplicate is either defined twice in one module or only found when the chunks are linked
+				auto lf = dynamic_pointer_cast<code_generator::llvm_function>(fns.back().second);
+				if (lf != nullptr && !defined.insert(lf->f).second)
+					throw internal_codegen_error(sym_name(f.selector) + " is defined more than once");
+			}
+			return write_signatures(cg, fns);
+		}
+
+		// generates the bodies of the functions at `which` in p in a private context, returning the module as bitcode
+		// so that it can be read back into the context of the final module. with split set, each function in `which`
+		// is returned in a module of its own, and external functions (which have no body) as an empty string.
+		// signatures is p's functions from signatures_of
+		static vector<string> generate_chunk(const program& p, const string& signatures, const vector<size_t>& which, bool split) {
+			llvm::LLVMContext ctx;
+			auto mod = make_shared<llvm::Module>("chunk", ctx);
+			code_generator cg{ mod };
+			define_types(cg, p);
+			auto fns = load_signatures(cg, signatures);
+			vector<shared_ptr<code_generator::llvm_function>> declared;
+			for (size_t i = 0; i < fns.size(); ++i) {
+				// every function gets its body back, escape analysis and specialization look into callees
+				auto lf = dynamic_pointer_cast<code_generator::llvm_function>(fns[i]);
+				if (lf != nullptr) lf->decl.body = p.functions[i].body;
+				declared.push_back(lf);
+			}
+			for (auto i : which) {
+				if (declared[i] != nullptr) cg.generate_body(declared[i]);
+			}
+			if (!split) return { bitcode_of(*mod) };
+			vector<string> bcs;
+			for (auto i : which) {
+				if (declared[i] == nullptr) {
+					bcs.push_back("");
+					continue;
+				}
+				auto f = declared[i]->f;
+				llvm::ValueToValueMapTy vmap;
+				auto fm = llvm::CloneModule(mod.get(), vmap, [f](const llvm::GlobalValue* gv) {
+					return gv == f || (llvm::isa<llvm::GlobalVariable>(gv) && gv->hasLocalLinkage());
+				});
+				bcs.push_back(bitcode_of(*fm));
+			}
+			return bcs;
+		}
+
+		void generate_parallel(const program& p, shared_ptr<llvm::Module> mod, size_t threads, size_t chunk_size, build_cache* cache) {
+			// with a cache every function gets its own module, so that an edit only regenerates the functions it invalidated
+			auto units = cache != nullptr ? p.functions.size() : (p.functions.size() + chunk_size - 1) / chunk_size;
+			vector<string> bitcode(units), keys;
+			vector<size_t> todo;
+			if (cache != nullptr) {
+				keys = cache->keys(p);
+				for (size_t i = 0; i < units; ++i) {
+					if (!cache->load(keys[i], bitcode[i])) todo.push_back(i);
+				}
+			}
+			else {
+				for (size_t i = 0; i < p.functions.size(); ++i) todo.push_back(i);
+			}
+
+			// the functions that need generating, chunk_size at a time in source order
+			vector<vector<size_t>> chunks;
+			for (size_t i = 0; i < todo.size(); i += chunk_size) {
+				chunks.emplace_back(todo.begin() + i, todo.begin() + min(i + chunk_size, todo.size()));
+			}
+			auto signatures = chunks.empty() ? string() : signatures_of(p, cache, keys);
+			vector<exception_ptr> errors(chunks.size());
+			atomic<size_t> next(0);
+			auto worker = [&]() {
+				for (size_t c = next++; c < chunks.size(); c = next++) {
+					try {
+						auto bcs = generate_chunk(p, signatures, chunks[c], cache != nullptr);
+						if (cache != nullptr) {
+							for (size_t i = 0; i < bcs.size(); ++i) bitcode[chunks[c][i]] = move(bcs[i]);
+						}
+						else bitcode[c] = move(bcs[0]);
+					}
+					catch (...) {
+						errors[c] = current_exception();
+					}
+				}
+			};
+			vector<thread> pool;
+			for (size_t i = 0; i < min(threads, chunks.size()); ++i) pool.emplace_back(worker);
+			for (auto& t : pool) t.join();
+			// errors are reported in chunk order so that every run reports the same one
+			for (const auto& e : errors) {
+				if (e) rethrow_exception(e);
+			}
+			if (cache != nullptr) {
+				for (auto i : todo) cache->store(keys[i], bitcode[i]);
+			}
+
+			for (const auto& bc : bitcode) {
+				if (bc.empty()) continue;
+				auto unit = llvm::parseBitcodeFile(llvm::MemoryBufferRef(bc, "chunk"), mod->getContext());
+				if (!unit) throw internal_codegen_error("failed to read back generated code: " + llvm::toString(unit.takeError()));
+				if (llvm::Linker::linkModules(*mod, move(*unit)))
+					throw internal_codegen_error("failed to link generated code");
+			}
+		}
+	}
+}
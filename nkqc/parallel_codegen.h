@@ -0,0 +1,26 @@
+#pragma once
+#include "llvm_codegen.h"
+
+namespace nkqc {
+	namespace codegen {
+		// every declaration in a source file, collected before any of it is generated
+		struct program {
+			vector<string> interfaces; // interface files loaded before any of the program's own declarations
+			vector<pair<symbol, shared_ptr<type_id>>> types;
+			vector<parser::fn_decl> functions;
+			bool fast_math; // generate with code_generator::fast_math
+			program() : fast_math(false) {}
+		};
+
+		struct build_cache;
+
+		// generates every function in p on up to `threads` threads and links the result into mod.
+		// p's signatures are resolved (and return types inferred) once, up front; then the functions are split into
+		// chunks of chunk_size in source order, and each chunk gets its own LLVMContext, module and code_generator that
+		// loads those signatures but only generates the bodies in that chunk.
+		// chunks are linked in source order, so the output depends on chunk_size but never on the thread count.
+		// with a cache, functions whose key is already cached are not generated at all, and the rest are cached along
+		// with their signatures, which later builds load instead of inferring them again
+		void generate_parallel(const program& p, shared_ptr<llvm::Module> mod, size_t threads, size_t chunk_size = 32, build_cache* cache = nullptr);
+	}
+}
@@ -12,26 +12,53 @@ namespace nkqc {
 				return make_shared<ptr_type>(parse_type());
 			case '[': {
 				next_char();
-				string numv;
+				if (curr_char() == ']') {
+					next_char();
+					return make_shared<slice_type>(parse_type());
+				}
+				auto start = idx;
 				do {
-					numv += curr_char();
 					next_char();
 				} while (more_token() && isdigit(curr_char()));
+				uint64_t count = 0;
+				buf.substr(start, idx - start).getAsInteger(10, count);
 				expect(curr_char() == ']', "expected closing square bracket for array"); next_char();
-				return make_shared<array_type>(atoll(numv.c_str()), parse_type());
+				return make_shared<array_type>(count, parse_type());
+			}
+			case '<': {
+				next_char();
+				auto start = idx;
+				while (more_char() && isdigit(curr_char())) next_char();
+				uint64_t count = 0;
+				buf.substr(start, idx - start).getAsInteger(10, count);
+				expect(count > 0 && curr_char() == '>', "expected lane count and closing angle bracket for vector"); next_char();
+				return make_shared<vector_type>(count, parse_type());
 			}
 			case 'u':
 			case 'i': {
 				char type = curr_char();
 				next_char();
-				string numv;
+				auto start = idx;
 				do {
-					numv += curr_char();
 					next_char();
 				} while (more_token() && isdigit(curr_char()));
+				unsigned bitwidth = 0;
+				buf.substr(start, idx - start).getAsInteger(10, bitwidth);
 				// this should fall through to default case if there isn't a number afterwards
-				return make_shared<integer_type>(type == 'i', atoi(numv.c_str()));
+				return make_shared<integer_type>(type == 'i', bitwidth);
 			}
+			case 'f':
+				if (isdigit(peek_char())) {
+					next_char();
+					auto start = idx;
+					while (more_token() && isdigit(curr_char())) next_char();
+					unsigned bitwidth = 0;
+					buf.substr(start, idx - start).getAsInteger(10, bitwidth);
+					expect(bitwidth == 32 || bitwidth == 64, "floating point types are f32 or f64");
+					return make_shared<float_type>(bitwidth);
+				}
+				// a name that starts with f, which the default case would have parsed
+				return make_shared<plain_type>(sym(get_token()));
 			case '(': {
 				next_char();
 				if (curr_char() == ')') {
@@ -56,67 +83,77 @@ namespace nkqc {
 			default: {
 				auto tk = get_token();
 				if (tk == "bool") return make_shared<bool_type>();
-				return make_shared<plain_type>(tk);
+				return make_shared<plain_type>(sym(tk));
 			}
 			}
 		}
 
 
 		//TODO: fix this so that it is std compliant
-		shared_ptr<ast::number_expr> expr_parser::parse_number()
+		ast::number_expr* expr_parser::parse_number()
 		{
-			string numv;
+			auto start = idx;
+			// a dot is only a decimal point if a digit follows it, otherwise it ends the statement, as in `x := 1.`
 			do {
-				numv += curr_char();
 				next_char();
-			} while (more_token() && (isdigit(curr_char()) || curr_char() == '.'));
-			if (numv.find('.') != numv.npos)
-				return make_shared<number_expr>(atof(numv.c_str()));
-			else
-				return make_shared<number_expr>(atoll(numv.c_str()));
+			} while (more_char() && (isdigit(curr_char()) || (curr_char() == '.' && isdigit(peek_char()))));
+			auto numv = buf.substr(start, idx - start);
+			if (numv.find('.') != numv.npos) {
+				double fv = 0;
+				numv.getAsDouble(fv);
+				return nodes->make<number_expr>(fv);
+			}
+			else {
+				int64_t iv = 0;
+				numv.getAsInteger(10, iv);
+				return nodes->make<number_expr>(iv);
+			}
 		}
 		
 		string expr_parser::parse_string_lit() {
-			string v;
+			auto start = idx;
 			while (more_char() && curr_char() != '\'') {
-				v += curr_char(); next_char();
+				next_char();
 			}
+			auto v = buf.substr(start, idx - start);
 			expect(curr_char() == '\'', "missing closing quote for string");
 			next_char();
-			return v;
+			return v.str();
 		}
 		
-		pair<pair<string, vector<shared_ptr<expr>>>,int>  expr_parser::parse_msgsnd_core() {
-			string tst = peek_token(true);
+		pair<pair<symbol, vector<expr*>>,int>  expr_parser::parse_msgsnd_core() {
+			token tst = peek_token(true);
 			expect(tst.size() > 0, "expect token");
-			pair<string, vector<shared_ptr<expr>>> msg;
+			pair<symbol, vector<expr*>> msg;
 			int msgt = -1;
 			if (tst[tst.size() - 1] == ':') {
-				string msgn; vector<shared_ptr<expr>> args;
+				auto& symbols = symbol_table::global();
+				symbol msgn; bool first = true; vector<expr*> args;
 				while (more_token()) {
-					string mnp = get_token(true);
+					token mnp = get_token(true);
 					expect(mnp[mnp.size() - 1] == ':', "expect selector to end with :");
-					msgn += mnp;
+					msgn = first ? sym(mnp) : symbols.concat(msgn, sym(mnp));
+					first = false;
 					next_ws();
 					args.push_back(_parse(false, false));
 				}
-				msg = { tst == "value:" ? tst : msgn, args }; //hacky way to make sure that varadic messages of form (value: 1 value: 2 value: 3) work
+				msg = { tst == "value:" ? sym_value_ : msgn, args }; //hacky way to make sure that varadic messages of form (value: 1 value: 2 value: 3) work
 				msgt = 0;
 			}
 			else if (is_binary_op()) {
 				auto op = get_binary_op();
 				next_ws();
-				msg = { op,{ _parse(false,true) } };
+				msg = { sym(op),{ _parse(false,true) } };
 				msgt = 1;
 			}
 			else {
-				msg = { get_token(),{} };
+				msg = { sym(get_token()),{} };
 				msgt = 2;
 			}
 			return { msg,msgt };
 		}
 
-		shared_ptr<ast::msgsnd_expr> expr_parser::parse_msgsnd(shared_ptr<expr> rcv, bool akm) {
+		ast::msgsnd_expr* expr_parser::parse_msgsnd(expr* rcv, bool akm) {
 			if (!more_char() || isterm(0,false)) return nullptr;
 			if (!akm) {
 				auto t = peek_token(true);
@@ -125,32 +162,32 @@ namespace nkqc {
 			auto M = parse_msgsnd_core();
 			next_ws();
 			if (curr_char() == ';') {
-				vector<pair<string, vector<shared_ptr<expr>>>> msgs;
+				vector<pair<symbol, vector<expr*>>> msgs;
 				msgs.push_back(M.first);
 				do {
 					next_char_ws();
 					msgs.push_back(parse_msgsnd_core().first);
 					next_ws();
 				} while (curr_char() == ';');
-				return make_shared<cascade_msgsnd>(rcv, msgs);
+				return nodes->make<cascade_msgsnd>(rcv, msgs);
 			}
 			else {
 				auto msg = M.first;
 				switch (M.second)
 				{
 				case 0:
-					return make_shared<keyword_msgsnd>(rcv, msg.first, msg.second);
+					return nodes->make<keyword_msgsnd>(rcv, msg.first, msg.second);
 				case 1:
-					return make_shared<binary_msgsnd>(rcv, msg.first, msg.second[0]);
+					return nodes->make<binary_msgsnd>(rcv, msg.first, msg.second[0]);
 				case 2:
-					return make_shared<unary_msgsnd>(rcv, msg.first);
+					return nodes->make<unary_msgsnd>(rcv, msg.first);
 				}
 			}
 		}
 
-		shared_ptr<expr> expr_parser::_parse(bool allow_compound, bool allow_keyword_msgsnd, bool allow_any_msgsnd) {
+		expr* expr_parser::_parse(bool allow_compound, bool allow_keyword_msgsnd, bool allow_any_msgsnd) {
 			next_ws();
-			shared_ptr<expr> current_expr = nullptr;
+			expr* current_expr = nullptr;
 			if(curr_char() == '(') {
 				next_char_ws();
 				current_expr = _parse(true,true);
@@ -160,17 +197,17 @@ namespace nkqc {
 			}
 			else if (curr_char() == '^') {
 				next_char_ws();
-				return make_shared<return_expr>(_parse(false, true));
+				return nodes->make<return_expr>(_parse(false, true));
 			}
 			//	-- literals --
 			else if (curr_char() == '[') {
 				next_char_ws();
-				vector<string> args;
+				vector<symbol> args;
 				if (curr_char() == ':') { //begining of first arg
 					while (curr_char() != '|') {
-						string a = get_token();
+						auto a = get_token();
 						expect(a[0] == ':', "expected block argument to start with :");
-						args.push_back(a.substr(1));
+						args.push_back(sym(a.substr(1)));
 						next_ws();
 					}
 				}
@@ -182,38 +219,38 @@ namespace nkqc {
 				next_ws();
 				expect(curr_char() == ']', "expected closing square bracket");
 				next_char();
-				current_expr = make_shared<block_expr>(args, b);
+				current_expr = nodes->make<block_expr>(args, b);
 			}
 			else if (next_is_number()) {
 				current_expr = parse_number();
 			}
 			else if (curr_char() == '>' && peek_char() == '-') {
 				next_char();next_char();
-				string v;
+				auto start = idx;
 				while (curr_char() != '<') {
-					v += curr_char();
 					next_char();
 				}
+				auto v = buf.substr(start, idx - start);
 				next_char();
-				current_expr = make_shared<tag_expr>(v);
+				current_expr = nodes->make<tag_expr>(v.str());
 			}
 			else if (curr_char() == '\'') {
 				next_char();
-				current_expr = make_shared<string_expr>(parse_string_lit());
+				current_expr = nodes->make<string_expr>(parse_string_lit());
 			}
 			else if (curr_char() == '$') {
 				next_char();
-				current_expr = make_shared<char_expr>(get_token());
+				current_expr = nodes->make<char_expr>(get_token().str());
 			}
 			else if (curr_char() == '#') {
 				next_char();
 				if (curr_char() == '\'') {
 					next_char();
-					current_expr = make_shared<symbol_expr>(parse_string_lit());
+					current_expr = nodes->make<symbol_expr>(sym(parse_string_lit()));
 				}
 				else if (curr_char() == '(') {
 					next_char();
-					vector<shared_ptr<expr>> xs;
+					vector<expr*> xs;
 					while (curr_char() != ')') {
 						next_ws();
 						xs.push_back(_parse(false, false, false));
@@ -221,26 +258,26 @@ namespace nkqc {
 					}
 					expect(curr_char() == ')', "missing closing paren for array");
 					next_char();
-					current_expr = make_shared<array_expr>(xs);
+					current_expr = nodes->make<array_expr>(xs);
 				}
 				else {
-					current_expr = make_shared<symbol_expr>(get_token());
+					current_expr = nodes->make<symbol_expr>(sym(get_token()));
 				}
 			}
 			else if (curr_char() == '{') {
 				next_char();
-				current_expr = make_shared<type_expr>(parse_type());
+				current_expr = nodes->make<type_expr>(parse_type());
 				expect(curr_char() == '}', "missing closing curly brace for type");
 				next_char();
 			}
 			// -- id --
 			else {
-				auto idx = make_shared<id_expr>(get_token());
+				auto idx = nodes->make<id_expr>(sym(get_token()));
 				current_expr = idx;
 				next_ws();
 				if (allow_compound && curr_char() == ':' && peek_char() == '=') {
 					next_char(); next_char();
-					current_expr = make_shared<assignment_expr>(idx->v, _parse(false, true));
+					current_expr = nodes->make<assignment_expr>(idx->v, _parse(false, true));
 				}
 			}
 			next_ws();
@@ -252,7 +289,7 @@ namespace nkqc {
 			// -- compound --
 			if (allow_compound && curr_char() == '.') {
 				next_char();
-				current_expr = make_shared<seq_expr>(current_expr, _parse(true,true));
+				current_expr = nodes->make<seq_expr>(current_expr, _parse(true,true));
 			}
 			return current_expr;
 		}
@@ -271,41 +308,45 @@ namespace nkqc {
 			return fs + s.substr(lfqp);
 		}
 
-		pair<string, shared_ptr<type_id>> file_parser::parse_name_type_pair() {
+		pair<symbol, shared_ptr<type_id>> file_parser::parse_name_type_pair() {
 			expect(curr_char() == '{', "missing opening curly brace for name-type pair"); next_char();
 			next_ws();
-			auto n = get_token();
+			auto n = sym(get_token());
 			next_ws();
-			pair<string, shared_ptr<type_id>> p = { n, expr_parser::parse_type() };
+			pair<symbol, shared_ptr<type_id>> p = { n, expr_parser::parse_type() };
 			next_ws();
 			expect(curr_char() == '}', "missing closing curly brace for name-type pair"); next_char();
 			return p;
 		}
 
-		tuple<string, vector<pair<string, shared_ptr<type_id>>>> file_parser::parse_sel() {
-			string sel; vector<pair<string, shared_ptr<type_id>>> args;
-			string t = peek_token(true);
+		tuple<symbol, vector<pair<symbol, shared_ptr<type_id>>>> file_parser::parse_sel() {
+			auto& symbols = symbol_table::global();
+			symbol sel; vector<pair<symbol, shared_ptr<type_id>>> args;
+			token t = peek_token(true);
 			expect(t.size() > 0, "expect token");
 			if (t[t.size() - 1] == ':') {
+				bool first = true;
 				while (more_token()) {
 					t = get_token(true);
 					expect(t[t.size() - 1] == ':', "expect selector words to end with :");
-					sel += t;
+					sel = first ? sym(t) : symbols.concat(sel, sym(t));
+					first = false;
 					next_ws();
 					args.push_back(parse_name_type_pair());
 					next_ws();
 				}
 			}
 			else {
-				sel = get_token();
+				sel = sym(get_token());
 			}
 			return { sel, args };
 		}
 
-		void file_parser::parse_all(const string& s, function<void(const fn_decl&)> FN, function<void(const string&, shared_ptr<type_id>)> S) {
-			buf = s; idx = 0;
+		void file_parser::parse_all(token s, function<void(const fn_decl&)> FN, function<void(symbol, shared_ptr<type_id>)> S) {
+			reset(s);
 			while (more()) {
 				next_ws();
+				auto decl_start = idx;
 				auto t = get_token();
 				next_ws();
 				if (t == "fn") {
@@ -321,7 +362,7 @@ namespace nkqc {
 						expect(curr_char() == (opening == '{' ? '}' : ')'), "expect closing token for reciever type");
 						next_char_ws();
 					}
-					string sel; vector<pair<string, shared_ptr<type_id>>> args;
+					symbol sel; vector<pair<symbol, shared_ptr<type_id>>> args;
 					tie(sel, args) = parse_sel();
 					next_ws();
 					if (curr_char() == '-' && peek_char(1) == '>') {
@@ -329,15 +370,18 @@ namespace nkqc {
 						ret = expr_parser::parse_type();
 						next_ws();
 					}
-					FN(fn_decl(static_, rcv, sel, args, _parse(false, false, false), ret));
+					fn_decl d(static_, rcv, sel, args, _parse(false, false, false), ret);
+					auto text = buf.substr(decl_start, idx - decl_start);
+					d.source_hash = fnv1a(text.data(), text.size());
+					FN(d);
 				}
 				else if (t == "struct") {
 					next_ws();
-					string name = get_token();
+					symbol name = sym(get_token());
 					next_ws();
 					expect(curr_char() == '|', "opening pipe for fields");
 					next_char();
-					vector<pair<string, shared_ptr<type_id>>> fields;
+					vector<pair<symbol, shared_ptr<type_id>>> fields;
 					while (curr_char() != '|') {
 						next_ws();
 						fields.push_back(parse_name_type_pair());
@@ -3,6 +3,7 @@
 #include "types.h"
 #include <cassert>
 #include <sstream>
+#include <llvm/ADT/StringRef.h>
 
 namespace nkqc {
 	namespace parser {
@@ -11,28 +12,42 @@ namespace nkqc {
 			parse_error(const string& m, uint32_t ln, uint32_t cl)
 				: runtime_error(m), line(ln), col(cl) {}
 		};
+		// tokens are views into the parser's source buffer, they never own or copy characters
+		typedef llvm::StringRef token;
+
+		inline symbol sym(token t) { return nkqc::sym(t.data(), t.size()); }
+
 		struct parser {
-			string buf;
+			// the source is not owned by the parser; it must outlive parsing and every token taken from it
+			token buf;
 			uint32_t idx, line, col;
 			inline bool more() { return idx < buf.size(); }
-			inline void reset(const string& s) {
+			inline void reset(token s) {
 				buf = s;
 				idx = line = col = 0;
+				lookahead.valid = false;
 			}
 			inline void copy_state(const parser& p) {
 				buf = p.buf;
 				idx = p.idx;
 				line = p.line;
 				col = p.col;
+				lookahead.valid = false;
 			}
 		protected:
+			// the most recently peeked token, so that the get_token that usually follows a peek_token doesn't lex it again
+			struct {
+				bool valid = false, sel;
+				uint32_t start, end, end_line, end_col;
+				token tok;
+			} lookahead;
 
 			inline void next_char() {
 				idx++; col++;
 				if (curr_char() == '\n') { line++; col = 0; }
 			}
-			inline char curr_char() { if (idx > buf.size()) return '\0'; return buf[idx]; }
-			inline char peek_char(int of = 1) { if (idx + of > buf.size()) return '\0'; return buf[idx + of]; }
+			inline char curr_char() { if (idx >= buf.size()) return '\0'; return buf[idx]; }
+			inline char peek_char(int of = 1) { if (idx + of >= buf.size()) return '\0'; return buf[idx + of]; }
 			inline bool more_char() { return idx < buf.size(); }
 
 			inline void next_ws() {
@@ -79,33 +94,41 @@ namespace nkqc {
 					|| c == '&' || c == '|'*/;
 			}
 
-			inline string get_binary_op() {
-				if (!is_binary_op()) return "";
-				auto c = curr_char(); auto nc = peek_char();
-				string res(1, c);
+			inline token get_binary_op() {
+				if (!is_binary_op()) return token();
+				auto start = idx;
+				auto nc = peek_char();
 				if (!istermc(nc) && !isalnum(nc)/*(c == '!' || c == '<' || c == '>') && nc == '='*/) {
-					res += nc;
 					next_char();
 				}
 				next_char();
-				return res;
+				return buf.substr(start, idx - start);
 			}
 
 			//TODO: message selector parsing in both method headers and sends expects get_token and peek_token to return tokens ending in ':', but it doesn't do that
-			inline string get_token(bool isSel = false) {
-				string n;
+			inline token get_token(bool isSel = false) {
+				if (lookahead.valid && lookahead.start == idx && lookahead.sel == isSel) {
+					idx = lookahead.end;
+					line = lookahead.end_line; col = lookahead.end_col;
+					lookahead.valid = false;
+					return lookahead.tok;
+				}
+				auto start = idx;
 				do {
-					n += curr_char();
 					next_char();
 				} while (more_char() && !isterm(0,!isSel));
-				if (isSel && curr_char() == ':') { n += ':'; next_char(); }
-				return n;
+				if (isSel && curr_char() == ':') next_char();
+				return buf.substr(start, idx - start);
 			}
 
-			inline string peek_token(bool isSel = false) {
+			inline token peek_token(bool isSel = false) {
 				int oi = idx;
 				size_t ol = line, oc = col;
-				string n = get_token(isSel);
+				token n = get_token(isSel);
+				lookahead.valid = true;
+				lookahead.sel = isSel;
+				lookahead.start = oi; lookahead.tok = n;
+				lookahead.end = idx; lookahead.end_line = line; lookahead.end_col = col;
 				idx = oi;
 				line = ol; col = oc;
 				return n;
@@ -140,24 +163,28 @@ namespace nkqc {
 
 		class expr_parser : public parser {
 		public:
+			// every node this parser creates is allocated in, and owned by, this arena
+			ast::arena* nodes;
+
+			expr_parser(ast::arena* nodes) : nodes(nodes) {}
 
-			inline shared_ptr<ast::expr> parse(const string& s) {
+			inline ast::expr* parse(token s) {
 				reset(s);
 				return _parse(true,true);
 			}
-			inline shared_ptr<ast::expr> parse(parser& p) {
+			inline ast::expr* parse(parser& p) {
 				copy_state(p);
 				auto rv = _parse(true, true);
 				p.copy_state(*this);
 				return rv;
 			}
 		protected:
-			shared_ptr<ast::number_expr> parse_number();
+			ast::number_expr* parse_number();
 			string parse_string_lit();
-			shared_ptr<ast::msgsnd_expr> parse_msgsnd(shared_ptr<ast::expr> rcv, bool akm);
-			pair<pair<string, vector<shared_ptr<ast::expr>>>, int> parse_msgsnd_core();
+			ast::msgsnd_expr* parse_msgsnd(ast::expr* rcv, bool akm);
+			pair<pair<symbol, vector<ast::expr*>>, int> parse_msgsnd_core();
 
-			shared_ptr<ast::expr> _parse(bool allow_compound, bool allow_keyword_msgsnd, bool allow_any_msgsend = true);
+			ast::expr* _parse(bool allow_compound, bool allow_keyword_msgsnd, bool allow_any_msgsend = true);
 
 		};
 
@@ -170,26 +197,28 @@ namespace nkqc {
 		struct fn_decl {
 			shared_ptr<type_id> receiver, return_type;
 			bool static_function;
-			string selector;
-			vector<pair<string, shared_ptr<type_id>>> args;
-			shared_ptr<nkqc::ast::expr> body;
-
-			fn_decl(const string& sel, vector<pair<string, shared_ptr<type_id>>> args, shared_ptr<nkqc::ast::expr> body, shared_ptr<type_id> ret)
-				: static_function(false), selector(sel), args(args), body(body), return_type(ret) {}
-			fn_decl(bool static_, shared_ptr<type_id> rev, const string& sel, vector<pair<string, shared_ptr<type_id>>> args, shared_ptr<nkqc::ast::expr> body, shared_ptr<type_id> ret)
-				: static_function(static_), receiver(rev), selector(sel), args(args), body(body), return_type(ret) {}
+			symbol selector;
+			vector<pair<symbol, shared_ptr<type_id>>> args;
+			nkqc::ast::expr* body;
+			uint64_t source_hash; // of the declaration's source text, set by file_parser
+
+			fn_decl(symbol sel, vector<pair<symbol, shared_ptr<type_id>>> args, nkqc::ast::expr* body, shared_ptr<type_id> ret)
+				: static_function(false), selector(sel), args(args), body(body), return_type(ret), source_hash(0) {}
+			fn_decl(bool static_, shared_ptr<type_id> rev, symbol sel, vector<pair<symbol, shared_ptr<type_id>>> args, nkqc::ast::expr* body, shared_ptr<type_id> ret)
+				: static_function(static_), receiver(rev), selector(sel), args(args), body(body), return_type(ret), source_hash(0) {}
 		};
 
 		struct file_parser : public expr_parser {
+			file_parser(ast::arena* nodes) : expr_parser(nodes) {}
 
-			pair<string, shared_ptr<type_id>> parse_name_type_pair();
+			pair<symbol, shared_ptr<type_id>> parse_name_type_pair();
 
-			tuple<string, vector<pair<string, shared_ptr<type_id>>>> parse_sel();
+			tuple<symbol, vector<pair<symbol, shared_ptr<type_id>>>> parse_sel();
 
-			void parse_all(const string& s, function<void(const fn_decl&)> FN, function<void(const string&, shared_ptr<type_id>)> S);
+			void parse_all(token s, function<void(const fn_decl&)> FN, function<void(symbol, shared_ptr<type_id>)> S);
 
-			shared_ptr<type_id> parse_type(const string& s) {
-				buf = s; idx = 0;
+			shared_ptr<type_id> parse_type(token s) {
+				reset(s);
 				return expr_parser::parse_type();
 			}
 		};
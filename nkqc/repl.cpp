@@ -0,0 +1,301 @@
+#include "repl.h"
+#include "interface_file.h"
+
+namespace nkqc {
+	namespace codegen {
+		repl::repl(llvm::LLVMContext& ctx, unique_ptr<llvm::TargetMachine> tm, const backend_options& opts)
+			: ctx(ctx), opts(opts), engine(move(tm)), p(&nodes), cg(make_shared<llvm::Module>("repl", ctx)), entries(0) {
+			cg.trace = false;
+			cg.fast_math = opts.fast_math;
+			// every call has to go through the stub of the function it calls, so that redefining it takes effect
+			cg.specialize_blocks = false;
+		}
+
+		shared_ptr<llvm::Module> repl::begin_module() {
+			auto m = make_shared<llvm::Module>("repl" + to_string(++entries), ctx);
+			m->setTargetTriple(engine.tm->getTargetTriple().str());
+			m->setDataLayout(engine.dl);
+			cg.mod = m;
+			return m;
+		}
+
+		jit::module_handle repl::finish_module(shared_ptr<llvm::Module> m) {
+			target_module(*m, engine.tm.get());
+			optimize(*m, engine.tm.get(), opts);
+			return engine.add_module(m);
+		}
+
+		void repl::load_prelude(const string& path) {
+			auto m = begin_module();
+			load_interface(cg, path);
+			// preludes are never replaced, so their code stays in the jit for the whole session
+			finish_module(m);
+			declarations.push_back(m);
+		}
+
+		// whether a function that has already been declared takes the same receiver and arguments as fn
+		static bool same_signature(code_generator& cg, const parser::fn_decl& declared, const parser::fn_decl& fn) {
+			if (declared.static_function != fn.static_function || declared.args.size() != fn.args.size()) return false;
+			if ((declared.receiver == nullptr) != (fn.receiver == nullptr)) return false;
+			if (fn.receiver != nullptr) {
+				auto r = fn.receiver->resolve(&cg);
+				if (!fn.static_function) r = cg.universe.ptr_to(r);
+				if (r != declared.receiver) return false;
+			}
+			for (size_t i = 0; i < fn.args.size(); ++i) {
+				if (declared.args[i].second != fn.args[i].second->resolve(&cg)) return false;
+			}
+			return true;
+		}
+
+		// drops what cg has memoized about f, which is going away
+		static void forget(code_generator& cg, const code_generator::function* f) {
+			for (auto i = cg.inferred_return_types.begin(); i != cg.inferred_return_types.end();) {
+				if (i->first.first == f) i = cg.inferred_return_types.erase(i);
+				else ++i;
+			}
+			for (auto i = cg.escaping_params.begin(); i != cg.escaping_params.end();) {
+				if (i->first.first == f) i = cg.escaping_params.erase(i);
+				else ++i;
+			}
+		}
+
+		void repl::define(const parser::fn_decl& fn) {
+			auto& overloads = cg.functions[fn.selector];
+			// a definition with the same receiver and argument types as an earlier one replaces it. the old one is
+			// taken out first so that the new body's sends, recursive ones included, resolve to the new definition
+			shared_ptr<code_generator::llvm_function> old;
+			size_t old_at = 0;
+			for (; old_at < overloads.size(); ++old_at) {
+				auto f = dynamic_pointer_cast<code_generator::llvm_function>(overloads[old_at]);
+				if (f != nullptr && same_signature(cg, f->decl, fn)) { old = f; break; }
+			}
+			if (old != nullptr) overloads.erase(overloads.begin() + old_at);
+			cg.dispatch_index.erase(fn.selector);
+
+			auto m = begin_module();
+			shared_ptr<code_generator::llvm_function> f;
+			try {
+				f = cg.declare_function(fn);
+				if (f != nullptr) {
+					if (old != nullptr && old->f->getFunctionType() != f->f->getFunctionType())
+						throw internal_codegen_error("redefining " + sym_name(fn.selector) + " would change its type, which the code that calls it was compiled against");
+					if (old != nullptr) {
+						for (size_t i = 0; i < f->decl.args.size(); ++i) {
+							if (dynamic_pointer_cast<function_type>(f->decl.args[i].second) != nullptr
+								&& !cg.parameter_escapes(old.get(), i) && cg.parameter_escapes(f.get(), i))
+								throw internal_codegen_error("redefining " + sym_name(fn.selector) + " would let a block escape that its callers keep on the stack");
+						}
+					}
+					cg.generate_body(f);
+				}
+			} catch (...) {
+				if (f != nullptr) {
+					overloads.erase(find(overloads.begin(), overloads.end(), f));
+					forget(cg, f.get());
+				}
+				if (old != nullptr) overloads.insert(overloads.begin() + old_at, old);
+				cg.dispatch_index.erase(fn.selector);
+				throw;
+			}
+			if (f == nullptr) { // an extern, which only needs its declaration kept
+				declarations.push_back(m);
+				return;
+			}
+
+			auto name = f->f->getName().str();
+			auto h = finish_module(m);
+			engine.redirect(name, h);
+			auto prev = bodies.find(name);
+			if (prev != bodies.end()) engine.remove_module(prev->second.second);
+			bodies[name] = { m, h };
+			if (old != nullptr) forget(cg, old.get());
+		}
+
+		// x with its last expression returned, as a function body needs
+		static ast::expr* returning(ast::arena& nodes, ast::expr* x) {
+			auto sq = dynamic_cast<ast::seq_expr*>(x);
+			if (sq != nullptr) {
+				sq->second = returning(nodes, sq->second);
+				return sq;
+			}
+			if (dynamic_cast<ast::return_expr*>(x) != nullptr) return x;
+			return nodes.make<ast::return_expr>(x);
+		}
+
+		template<typename T> static T call(uint64_t addr) { return ((T(*)())addr)(); }
+
+		// whether show_result can call a function returning a t and print what it returns
+		static bool printable(shared_ptr<type_id> t) {
+			if (dynamic_pointer_cast<bool_type>(t) != nullptr || dynamic_pointer_cast<ptr_type>(t) != nullptr) return true;
+			if (dynamic_pointer_cast<float_type>(t) != nullptr) return true;
+			auto it = dynamic_pointer_cast<integer_type>(t);
+			return it != nullptr && (it->bitwidth == 8 || it->bitwidth == 16 || it->bitwidth == 32 || it->bitwidth == 64);
+		}
+
+		// calls the function at addr, which returns a t that is printable, and prints what it returns
+		static void show_result(ostream& os, uint64_t addr, shared_ptr<type_id> t) {
+			if (dynamic_pointer_cast<bool_type>(t) != nullptr) {
+				os << (call<bool>(addr) ? "true" : "false");
+			}
+			else if (dynamic_pointer_cast<ptr_type>(t) != nullptr) {
+				os << call<void*>(addr);
+			}
+			else if (auto it = dynamic_pointer_cast<integer_type>(t)) {
+				switch (it->bitwidth) {
+				case 8: if (it->signed_) os << (int)call<int8_t>(addr); else os << (unsigned)call<uint8_t>(addr); break;
+				case 16: if (it->signed_) os << call<int16_t>(addr); else os << call<uint16_t>(addr); break;
+				case 32: if (it->signed_) os << call<int32_t>(addr); else os << call<uint32_t>(addr); break;
+				case 64: if (it->signed_) os << call<int64_t>(addr); else os << call<uint64_t>(addr); break;
+				}
+			}
+			else if (auto ft = dynamic_pointer_cast<float_type>(t)) {
+				if (ft->bitwidth == 32) os << call<float>(addr);
+				else os << call<double>(addr);
+			}
+			os << " : ";
+			t->print(os);
+			os << endl;
+		}
+
+		// a function that calls F and throws away what it returns, for a value that can't be printed but whose
+		// expression still has to run. F takes no arguments besides an sret slot
+		static string discarding_call(llvm::Function* F) {
+			auto& c = F->getContext();
+			auto W = llvm::Function::Create(llvm::FunctionType::get(llvm::Type::getVoidTy(c), false),
+				llvm::Function::ExternalLinkage, F->getName() + ".run", F->getParent());
+			llvm::IRBuilder<> irb(llvm::BasicBlock::Create(c, "entry", W));
+			if (F->hasStructRetAttr()) irb.CreateCall(F, { irb.CreateAlloca(F->arg_begin()->getType()->getPointerElementType()) });
+			else irb.CreateCall(F);
+			irb.CreateRetVoid();
+			return W->getName().str();
+		}
+
+		void repl::evaluate(ast::expr* x, ostream& os) {
+			// the expression becomes the body of a function that returns its value, called once and thrown away
+			auto m = begin_module();
+			auto name = "__eval" + to_string(entries);
+			parser::fn_decl fn(sym(name), {}, nodes.make<ast::block_expr>(vector<symbol>{}, returning(nodes, x)), nullptr);
+			shared_ptr<type_id> rt;
+			string entry = name;
+			try {
+				auto f = cg.declare_function(fn);
+				rt = f->return_type(&cg, nullptr, {});
+				cg.generate_body(f);
+				cg.inferred_return_types.erase({ f.get(), code_generator::type_signature(nullptr, {}) });
+				if (rt != cg.universe.unit() && !printable(rt)) entry = discarding_call(f->f);
+			} catch (...) {
+				cg.functions.erase(fn.selector);
+				throw;
+			}
+			cg.functions.erase(fn.selector);
+			cg.dispatch_index.erase(fn.selector);
+
+			// unit shows nothing, and a value there's no way to print shows its type
+			auto h = finish_module(m);
+			auto addr = engine.address_of(entry);
+			if (printable(rt)) show_result(os, addr, rt);
+			else {
+				call<void>(addr);
+				if (rt != cg.universe.unit()) {
+					os << "- : ";
+					rt->print(os);
+					os << endl;
+				}
+			}
+			engine.remove_module(h);
+		}
+
+		// the first word of an entry, skipping whitespace and comments
+		static parser::token first_word(parser::token s) {
+			size_t i = 0;
+			while (i < s.size()) {
+				if (s[i] == '"') {
+					i = s.find('"', i + 1);
+					if (i == parser::token::npos) return {};
+					i++;
+				}
+				else if (isspace(s[i])) i++;
+				else break;
+			}
+			auto j = i;
+			while (j < s.size() && isalnum(s[j])) j++;
+			return s.substr(i, j - i);
+		}
+
+		void repl::enter(const string& src, ostream& os) {
+			sources.push_back(src);
+			parser::token s = sources.back();
+			auto w = first_word(s);
+			if (w == "fn" || w == "struct") {
+				p.parse_all(s, [&](const parser::fn_decl& f) { define(f); },
+					[&](symbol name, shared_ptr<type_id> structure) {
+					// a redefined struct replaces its initializer along with its type
+					auto old = cg.types.find(name);
+					if (old != cg.types.end()) {
+						for (auto& fs : cg.functions) {
+							fs.second.erase(remove_if(fs.second.begin(), fs.second.end(), [&](const shared_ptr<code_generator::function>& f) {
+								auto init = dynamic_pointer_cast<code_generator::struct_initializer>(f);
+								return init != nullptr && init->type.get() == old->second.type.get();
+							}), fs.second.end());
+						}
+						cg.dispatch_index.clear();
+					}
+					cg.define_type(name, structure);
+				});
+			}
+			else if (s.find_first_not_of(" \t\r\n") != parser::token::npos) evaluate(p.parse(s), os);
+		}
+
+		// how many more brackets line opens than it closes, outside of strings and comments
+		static int bracket_depth(const string& line) {
+			int depth = 0;
+			char quote = 0;
+			for (auto c : line) {
+				if (quote != 0) {
+					if (c == quote) quote = 0;
+				}
+				else if (c == '\'' || c == '"') quote = c;
+				else if (c == '[' || c == '(' || c == '{') depth++;
+				else if (c == ']' || c == ')' || c == '}') depth--;
+			}
+			return depth;
+		}
+
+		void repl::run(istream& is, ostream& os) {
+			string entry, line;
+			int depth = 0;
+			os << "nkqc> " << flush;
+			while (getline(is, line)) {
+				if (entry.empty() && (line == ":q" || line == ":quit")) break;
+				entry += line;
+				entry += '\n';
+				depth += bracket_depth(line);
+				if (depth > 0) {
+					os << "  ... " << flush;
+					continue;
+				}
+				try {
+					enter(entry, os);
+				} catch (const parser::parse_error& e) {
+					os << "error parsing at line " << e.line << ", column " << e.col << ": " << e.what() << endl;
+				} catch (const internal_codegen_error& e) {
+					os << "internal error: " << e.what() << endl;
+				} catch (const type_mismatch_error& e) {
+					os << "error: type mismatch types: ";
+					e.a->print(os);
+					os << ", ";
+					e.b->print(os);
+					os << "; " << e.what() << endl;
+				} catch (const no_such_function_error& e) {
+					os << "error: no such function " << sym_name(e.selector) << endl;
+				} catch (const exception& e) {
+					os << "error: " << e.what() << endl;
+				}
+				entry.clear();
+				depth = 0;
+				os << "nkqc> " << flush;
+			}
+		}
+	}
+}
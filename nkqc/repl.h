@@ -0,0 +1,45 @@
+#pragma once
+#include "jit.h"
+#include "backend.h"
+
+namespace nkqc {
+	namespace codegen {
+		// an interactive session. each declaration or expression entered is generated into its own small module and
+		// added to one jit, against everything entered before it. functions are called through stubs, so redefining one
+		// only compiles the new definition
+		struct repl {
+			llvm::LLVMContext& ctx;
+			backend_options opts;
+			jit engine;
+			// owns the AST of every entry; declared before the code generator so every node outlives it
+			ast::arena nodes;
+			parser::file_parser p;
+			code_generator cg;
+			// the text of every entry, which the AST may point into
+			list<string> sources;
+			// the module holding the current definition of each function entered, and its handle in the jit
+			unordered_map<string, pair<shared_ptr<llvm::Module>, jit::module_handle>> bodies;
+			// modules with no code to compile that still own functions cg refers to: extern declarations and preludes
+			vector<shared_ptr<llvm::Module>> declarations;
+			size_t entries;
+
+			repl(llvm::LLVMContext& ctx, unique_ptr<llvm::TargetMachine> tm, const backend_options& opts);
+
+			// loads an interface file and compiles its code
+			void load_prelude(const string& path);
+
+			// parses, generates and compiles one entry. declarations are added to the session, an expression is run
+			// and its value printed to os
+			void enter(const string& src, ostream& os);
+
+			// prompts for entries on os and enters them until is ends or reads :q. an entry continues over as many
+			// lines as it takes to close its brackets. errors are reported and leave the session as it was
+			void run(istream& is, ostream& os);
+		private:
+			shared_ptr<llvm::Module> begin_module();
+			jit::module_handle finish_module(shared_ptr<llvm::Module> m);
+			void define(const parser::fn_decl& fn);
+			void evaluate(ast::expr* x, ostream& os);
+		};
+	}
+}
@@ -0,0 +1,195 @@
+#include "llvm_codegen.h"
+
+namespace nkqc {
+	namespace codegen {
+		// the runtime is generated into each module that uses it, linkonce_odr so that modules that each have a copy
+		// link into one. returns null if mod already has name's body
+		static llvm::Function* runtime_function(code_generator* gen, const string& name, llvm::FunctionType* t) {
+			auto F = gen->mod->getFunction(name);
+			if (F != nullptr && !F->empty()) return nullptr;
+			if (F == nullptr) F = llvm::Function::Create(t, llvm::Function::LinkOnceODRLinkage, name, gen->mod.get());
+			else F->setLinkage(llvm::Function::LinkOnceODRLinkage);
+			return F;
+		}
+
+		static llvm::Value* call_malloc(code_generator* gen, llvm::IRBuilder<>& irb, llvm::Value* size) {
+			auto i8 = llvm::Type::getInt8Ty(irb.getContext());
+			auto it = gen->size_type();
+			auto m = llvm::CallInst::CreateMalloc(irb.GetInsertBlock(), it, i8, llvm::ConstantInt::get(it, 1), irb.CreateZExtOrTrunc(size, it), nullptr, "");
+			irb.GetInsertBlock()->getInstList().push_back(llvm::cast<llvm::Instruction>(m));
+			return m;
+		}
+
+		static void call_free(llvm::IRBuilder<>& irb, llvm::Value* p) {
+			irb.GetInsertBlock()->getInstList().push_back(llvm::CallInst::CreateFree(p, irb.GetInsertBlock()));
+		}
+
+		// frees the list of chunks starting at first, each of which starts with a pointer to the next
+		static void free_chunks(llvm::IRBuilder<>& irb, llvm::Function* F, llvm::Value* first) {
+			auto& c = irb.getContext();
+			auto i8pp = llvm::Type::getInt8PtrTy(c)->getPointerTo();
+			auto before = irb.GetInsertBlock();
+			auto loop = llvm::BasicBlock::Create(c, "chunk", F);
+			auto body = llvm::BasicBlock::Create(c, "free", F);
+			auto done = llvm::BasicBlock::Create(c, "done", F);
+			irb.CreateBr(loop);
+			irb.SetInsertPoint(loop);
+			auto p = irb.CreatePHI(first->getType(), 2);
+			p->addIncoming(first, before);
+			irb.CreateCondBr(irb.CreateIsNull(p), done, body);
+			irb.SetInsertPoint(body);
+			auto next = irb.CreateLoad(irb.CreateBitCast(p, i8pp));
+			call_free(irb, p);
+			p->addIncoming(next, irb.GetInsertBlock());
+			irb.CreateBr(loop);
+			irb.SetInsertPoint(done);
+		}
+
+		// an Arena is { cur, end, chunks }: the free part of its newest chunk, and its chunks, newest first. every
+		// chunk starts with a 16 byte header whose first word points to the chunk before it
+		static const uint64_t arena_chunk_bytes = 64 * 1024, arena_header_bytes = 16;
+
+		llvm::Function* code_generator::arena_alloc_function() {
+			auto& c = mod->getContext();
+			auto i8p = llvm::Type::getInt8PtrTy(c);
+			auto i64 = llvm::Type::getInt64Ty(c);
+			auto arena_p = arena_t->llvm_type(c)->getPointerTo();
+			auto fn_t = llvm::FunctionType::get(i8p, { arena_p, i64, i64 }, false);
+
+			// the slow path, when the request doesn't fit in the current chunk, is out of line so the fast path inlines
+			auto G = runtime_function(this, "nkqc.arena.grow", fn_t);
+			if (G != nullptr) {
+				G->addFnAttr(llvm::Attribute::NoInline);
+				auto args = G->arg_begin();
+				llvm::Value *a = &*args++, *size = &*args++, *align = &*args++;
+				llvm::IRBuilder<> irb(llvm::BasicBlock::Create(c, "entry", G));
+				auto need = irb.CreateAdd(size, irb.CreateAdd(align, llvm::ConstantInt::get(i64, arena_header_bytes)));
+				auto big = irb.CreateSelect(irb.CreateICmpUGT(need, llvm::ConstantInt::get(i64, arena_chunk_bytes)),
+					need, llvm::ConstantInt::get(i64, arena_chunk_bytes));
+				auto chunk = call_malloc(this, irb, big);
+				auto chunks = irb.CreateStructGEP(nullptr, a, 2);
+				irb.CreateStore(irb.CreateLoad(chunks), irb.CreateBitCast(chunk, i8p->getPointerTo()));
+				irb.CreateStore(chunk, chunks);
+				auto start = irb.CreateGEP(chunk, llvm::ConstantInt::get(i64, arena_header_bytes));
+				auto pad = irb.CreateAnd(irb.CreateNeg(irb.CreatePtrToInt(start, i64)), irb.CreateSub(align, llvm::ConstantInt::get(i64, 1)));
+				auto p = irb.CreateGEP(start, pad);
+				irb.CreateStore(irb.CreateGEP(p, size), irb.CreateStructGEP(nullptr, a, 0));
+				irb.CreateStore(irb.CreateGEP(chunk, big), irb.CreateStructGEP(nullptr, a, 1));
+				irb.CreateRet(p);
+			}
+			G = mod->getFunction("nkqc.arena.grow");
+
+			auto F = runtime_function(this, "nkqc.arena.alloc", fn_t);
+			if (F == nullptr) return mod->getFunction("nkqc.arena.alloc");
+			F->addFnAttr(llvm::Attribute::InlineHint);
+			auto args = F->arg_begin();
+			llvm::Value *a = &*args++, *size = &*args++, *align = &*args++;
+			auto entry = llvm::BasicBlock::Create(c, "entry", F);
+			auto fast = llvm::BasicBlock::Create(c, "fits", F);
+			auto slow = llvm::BasicBlock::Create(c, "grow", F);
+			llvm::IRBuilder<> irb(entry);
+			auto cur_p = irb.CreateStructGEP(nullptr, a, 0);
+			auto cur = irb.CreateLoad(cur_p);
+			auto pad = irb.CreateAnd(irb.CreateNeg(irb.CreatePtrToInt(cur, i64)), irb.CreateSub(align, llvm::ConstantInt::get(i64, 1)));
+			auto p = irb.CreateGEP(cur, pad);
+			auto next = irb.CreateGEP(p, size);
+			// a new arena has no chunk, and null for both ends, so nothing but an empty request fits
+			irb.CreateCondBr(irb.CreateICmpULE(next, irb.CreateLoad(irb.CreateStructGEP(nullptr, a, 1))), fast, slow);
+			irb.SetInsertPoint(fast);
+			irb.CreateStore(next, cur_p);
+			irb.CreateRet(p);
+			irb.SetInsertPoint(slow);
+			irb.CreateRet(irb.CreateCall(G, { a, size, align }));
+			return F;
+		}
+
+		llvm::Function* code_generator::arena_reset_function() {
+			auto& c = mod->getContext();
+			auto i8p = llvm::Type::getInt8PtrTy(c);
+			auto fn_t = llvm::FunctionType::get(llvm::Type::getVoidTy(c), { arena_t->llvm_type(c)->getPointerTo() }, false);
+			auto F = runtime_function(this, "nkqc.arena.reset", fn_t);
+			if (F == nullptr) return mod->getFunction("nkqc.arena.reset");
+			// the newest chunk is kept for what comes next, the rest go back to malloc
+			llvm::Value* a = &*F->arg_begin();
+			auto entry = llvm::BasicBlock::Create(c, "entry", F);
+			auto keep = llvm::BasicBlock::Create(c, "keep", F);
+			auto empty = llvm::BasicBlock::Create(c, "empty", F);
+			llvm::IRBuilder<> irb(entry);
+			auto newest = irb.CreateLoad(irb.CreateStructGEP(nullptr, a, 2));
+			irb.CreateCondBr(irb.CreateIsNull(newest), empty, keep);
+			irb.SetInsertPoint(keep);
+			auto link = irb.CreateBitCast(newest, i8p->getPointerTo());
+			auto older = irb.CreateLoad(link);
+			irb.CreateStore(llvm::ConstantPointerNull::get(i8p), link);
+			irb.CreateStore(irb.CreateGEP(newest, llvm::ConstantInt::get(llvm::Type::getInt64Ty(c), arena_header_bytes)), irb.CreateStructGEP(nullptr, a, 0));
+			free_chunks(irb, F, older);
+			irb.CreateRetVoid();
+			irb.SetInsertPoint(empty);
+			irb.CreateRetVoid();
+			return F;
+		}
+
+		llvm::Function* code_generator::arena_free_function() {
+			auto& c = mod->getContext();
+			auto fn_t = llvm::FunctionType::get(llvm::Type::getVoidTy(c), { arena_t->llvm_type(c)->getPointerTo() }, false);
+			auto F = runtime_function(this, "nkqc.arena.free", fn_t);
+			if (F == nullptr) return mod->getFunction("nkqc.arena.free");
+			llvm::Value* a = &*F->arg_begin();
+			llvm::IRBuilder<> irb(llvm::BasicBlock::Create(c, "entry", F));
+			free_chunks(irb, F, irb.CreateLoad(irb.CreateStructGEP(nullptr, a, 2)));
+			call_free(irb, irb.CreateBitCast(a, llvm::Type::getInt8PtrTy(c)));
+			irb.CreateRetVoid();
+			return F;
+		}
+
+		llvm::GlobalVariable* code_generator::pool_of(shared_ptr<struct_type> t) {
+			auto& c = mod->getContext();
+			auto i8p = llvm::Type::getInt8PtrTy(c);
+			auto name = "nkqc.pool." + llvm::cast<llvm::StructType>(t->llvm_type(c))->getName().str();
+			auto g = mod->getGlobalVariable(name);
+			if (g == nullptr)
+				g = new llvm::GlobalVariable(*mod, i8p, false, llvm::GlobalValue::LinkOnceODRLinkage, llvm::ConstantPointerNull::get(i8p), name);
+			return g;
+		}
+
+		llvm::Function* code_generator::pool_take_function() {
+			auto& c = mod->getContext();
+			auto i8p = llvm::Type::getInt8PtrTy(c);
+			auto i64 = llvm::Type::getInt64Ty(c);
+			auto F = runtime_function(this, "nkqc.pool.take", llvm::FunctionType::get(i8p, { i8p->getPointerTo(), i64 }, false));
+			if (F == nullptr) return mod->getFunction("nkqc.pool.take");
+			F->addFnAttr(llvm::Attribute::InlineHint);
+			auto args = F->arg_begin();
+			llvm::Value *pool = &*args++, *size = &*args++;
+			auto entry = llvm::BasicBlock::Create(c, "entry", F);
+			auto reuse = llvm::BasicBlock::Create(c, "reuse", F);
+			auto fresh = llvm::BasicBlock::Create(c, "fresh", F);
+			llvm::IRBuilder<> irb(entry);
+			auto head = irb.CreateLoad(pool);
+			irb.CreateCondBr(irb.CreateIsNull(head), fresh, reuse);
+			irb.SetInsertPoint(reuse);
+			irb.CreateStore(irb.CreateLoad(irb.CreateBitCast(head, i8p->getPointerTo())), pool);
+			irb.CreateRet(head);
+			irb.SetInsertPoint(fresh);
+			// every slot has room for the link it holds while it is in the pool
+			auto word = llvm::ConstantInt::get(i64, 8);
+			irb.CreateRet(call_malloc(this, irb, irb.CreateSelect(irb.CreateICmpULT(size, word), word, size)));
+			return F;
+		}
+
+		llvm::Function* code_generator::pool_give_function() {
+			auto& c = mod->getContext();
+			auto i8p = llvm::Type::getInt8PtrTy(c);
+			auto F = runtime_function(this, "nkqc.pool.give", llvm::FunctionType::get(llvm::Type::getVoidTy(c), { i8p->getPointerTo(), i8p }, false));
+			if (F == nullptr) return mod->getFunction("nkqc.pool.give");
+			F->addFnAttr(llvm::Attribute::InlineHint);
+			auto args = F->arg_begin();
+			llvm::Value *pool = &*args++, *p = &*args++;
+			llvm::IRBuilder<> irb(llvm::BasicBlock::Create(c, "entry", F));
+			irb.CreateStore(irb.CreateLoad(pool), irb.CreateBitCast(p, i8p->getPointerTo()));
+			irb.CreateStore(p, pool);
+			irb.CreateRetVoid();
+			return F;
+		}
+	}
+}
@@ -0,0 +1,102 @@
+#pragma once
+#include <string>
+#include <deque>
+#include <unordered_map>
+#include <cstdint>
+#include <cstring>
+#include <mutex>
+using namespace std;
+
+namespace nkqc {
+	// 64-bit FNV-1a, pass a previous result as h to hash several pieces as one
+	inline uint64_t fnv1a(const char* p, size_t n, uint64_t h = 14695981039346656037ull) {
+		for (size_t i = 0; i < n; ++i) h = (h ^ (unsigned char)p[i]) * 1099511628211ull;
+		return h;
+	}
+
+	// selectors, identifiers and type names are interned into dense integer ids as they are parsed,
+	// so the rest of the compiler hashes and compares integers instead of strings
+	typedef uint32_t symbol;
+
+	// symbols the compiler itself looks for, interned in this order when the table is created
+	enum well_known_symbol : symbol {
+		sym_true,
+		sym_false,
+		sym_self,
+		sym_G,
+		sym_new,
+		sym_value_,
+		sym_whileTrue_,
+		sym_ifTrue_ifFalse_,
+		sym_to_do_,
+		sym_to_by_do_,
+		sym_timesRepeat_,
+		sym_value,
+		sym_Arena,
+	};
+
+	struct symbol_table {
+		symbol_table() {
+			for (auto s : { "true", "false", "self", "G", "new", "value:", "whileTrue:", "ifTrue:ifFalse:", "to:do:", "to:by:do:", "timesRepeat:", "value", "Arena" })
+				intern(s);
+		}
+
+		symbol intern(const string& s) { return intern(s.data(), s.size()); }
+
+		// looks up the characters [p, p+n) without copying them unless they are new
+		symbol intern(const char* p, size_t n) {
+			lock_guard<mutex> l(lock);
+			return intern_locked(p, n);
+		}
+
+		const string& name(symbol s) const {
+			lock_guard<mutex> l(lock);
+			return names[s];
+		}
+
+		// interns the concatenation of two symbols, used to build keyword selectors out of their parts
+		symbol concat(symbol a, symbol b) {
+			lock_guard<mutex> l(lock);
+			auto key = (uint64_t)a << 32 | b;
+			auto e = concats.find(key);
+			if (e != concats.end()) return e->second;
+			auto cs = names[a] + names[b];
+			auto id = intern_locked(cs.data(), cs.size());
+			concats[key] = id;
+			return id;
+		}
+
+		static symbol_table& global() {
+			static symbol_table table;
+			return table;
+		}
+	private:
+		symbol intern_locked(const char* p, size_t n) {
+			auto e = ids.find(view{ p, n });
+			if (e != ids.end()) return e->second;
+			auto id = (symbol)names.size();
+			names.emplace_back(p, n);
+			ids[view{ names.back().data(), n }] = id;
+			return id;
+		}
+
+		// keys point into names, so looking up a symbol never has to build a string
+		struct view {
+			const char* p;
+			size_t n;
+			bool operator==(const view& o) const { return n == o.n && memcmp(p, o.p, n) == 0; }
+		};
+		struct view_hash {
+			size_t operator()(const view& v) const { return (size_t)fnv1a(v.p, v.n); }
+		};
+		unordered_map<view, symbol, view_hash> ids;
+		deque<string> names; // deque so that references returned by name() and keys in ids stay valid
+		unordered_map<uint64_t, symbol> concats;
+		// the table is shared by the parallel code generator's workers
+		mutable mutex lock;
+	};
+
+	inline symbol sym(const string& s) { return symbol_table::global().intern(s); }
+	inline symbol sym(const char* p, size_t n) { return symbol_table::global().intern(p, n); }
+	inline const string& sym_name(symbol s) { return symbol_table::global().name(s); }
+}
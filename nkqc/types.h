@@ -11,19 +11,25 @@
 #include <llvm/IR/IRBuilder.h>
 #include "parser.h"
 #include <unordered_map>
+#include <unordered_set>
 
 namespace nkqc {
 
 	struct type_id;
 	struct typing_context {
-		virtual shared_ptr<type_id> type_for_name(const string& name) const = 0;
+		virtual shared_ptr<type_id> type_for_name(symbol name) const = 0;
+		// returns the canonical instance of a type that is structurally equal to t
+		virtual shared_ptr<type_id> intern(shared_ptr<type_id> t) = 0;
 	};
 
+	// resolved types are interned by their typing_context, so two resolved types are equal iff they are the same object.
+	// equals() and hash() give the structural comparison that the interning itself is built on
 	struct type_id : public enable_shared_from_this<type_id> {
-		virtual shared_ptr<type_id> resolve(typing_context*) { return shared_from_this(); }
+		virtual shared_ptr<type_id> resolve(typing_context* cx) { return cx->intern(shared_from_this()); }
 
 		virtual llvm::Type* llvm_type(llvm::LLVMContext&) const = 0;
 		virtual bool equals(shared_ptr<type_id> o) const = 0; // welcome to Java-land
+		virtual size_t hash() const = 0;
 		virtual void print(ostream& os) const = 0;
 
 		virtual bool can_cast_to(shared_ptr<type_id>) const { return false; }
@@ -51,6 +57,7 @@ namespace nkqc {
 		virtual bool equals(shared_ptr<type_id> o) const override {
 			return dynamic_pointer_cast<unit_type>(o) != nullptr;
 		}
+		virtual size_t hash() const override { return 1; }
 		virtual void print(ostream& os) const override {
 			os << "()";
 		}
@@ -62,10 +69,13 @@ namespace nkqc {
 		function_type(const vector<shared_ptr<type_id>>& args, shared_ptr<type_id> rt)
 			:args(args), return_type(rt) {}
 
+		// a closure: the code of a block, which takes the block's environment before its arguments, and the environment
 		virtual llvm::Type* llvm_type(llvm::LLVMContext& c) const override {
-			vector<llvm::Type*> arg_t;
+			auto env_t = llvm::Type::getInt8PtrTy(c);
+			vector<llvm::Type*> arg_t{ env_t };
 			for (const auto& t : args) arg_t.push_back(t->llvm_type(c));
-			return llvm::FunctionType::get(return_type->llvm_type(c), arg_t, false);
+			auto code_t = llvm::FunctionType::get(return_type->llvm_type(c), arg_t, false);
+			return llvm::StructType::get(c, { code_t->getPointerTo(), env_t });
 		}
 		virtual bool equals(shared_ptr<type_id> o) const override {
 			auto of = dynamic_pointer_cast<function_type>(o);
@@ -78,6 +88,11 @@ namespace nkqc {
 			}
 			else return false;
 		}
+		virtual size_t hash() const override {
+			size_t h = return_type->hash() * 31 + 2;
+			for (const auto& t : args) h = h * 31 + t->hash();
+			return h;
+		}
 		virtual void print(ostream& os) const override {
 			os << "( ";
 			for (const auto& t : args) {
@@ -91,7 +106,7 @@ namespace nkqc {
 		virtual shared_ptr<type_id> resolve(typing_context* cx) {
 			vector<shared_ptr<type_id>> ra;
 			for (const auto& t : args) ra.push_back(t->resolve(cx));
-			return make_shared<function_type>(ra, return_type->resolve(cx));
+			return cx->intern(make_shared<function_type>(ra, return_type->resolve(cx)));
 		}
 	};
 	struct bool_type : public type_id {
@@ -101,11 +116,13 @@ namespace nkqc {
 		virtual bool equals(shared_ptr<type_id> o) const override {
 			return dynamic_pointer_cast<bool_type>(o) != nullptr;
 		}
+		virtual size_t hash() const override { return 3; }
 		virtual void print(ostream& os) const override {
 			os << "bool";
 		}
 	};
 	struct ptr_type;
+	struct float_type;
 	struct integer_type : public type_id {
 		uint8_t bitwidth;
 		bool signed_;
@@ -121,15 +138,20 @@ namespace nkqc {
 			auto p = dynamic_pointer_cast<integer_type>(o);
 			return p != nullptr && p->bitwidth == bitwidth && p->signed_ == signed_;
 		}
+		virtual size_t hash() const override { return (bitwidth << 2 | signed_ << 1) * 31 + 4; }
 		
 		virtual void print(ostream& os) const override {
 			os << (signed_ ? "i" : "u") << (int)bitwidth;
 		}
 
 		virtual bool can_cast_to(shared_ptr<type_id> t) const {
-			return dynamic_pointer_cast<integer_type>(t) != nullptr || dynamic_pointer_cast<ptr_type>(t) != nullptr;
+			return dynamic_pointer_cast<integer_type>(t) != nullptr || dynamic_pointer_cast<ptr_type>(t) != nullptr
+				|| dynamic_pointer_cast<float_type>(t) != nullptr;
 		}
 		virtual llvm::Value* cast_to(llvm::LLVMContext& cx, shared_ptr<type_id> target_type, llvm::Value* src, llvm::IRBuilder<>& irb) const {
+			if (dynamic_pointer_cast<float_type>(target_type) != nullptr) {
+				return signed_ ? irb.CreateSIToFP(src, target_type->llvm_type(cx)) : irb.CreateUIToFP(src, target_type->llvm_type(cx));
+			}
 			auto intag = dynamic_pointer_cast<integer_type>(target_type);
 			if (intag == nullptr) {
 				return irb.CreateBitOrPointerCast(src, target_type->llvm_type(cx));
@@ -137,9 +159,39 @@ namespace nkqc {
 			return irb.CreateIntCast(src, intag->llvm_type(cx), intag->signed_);
 		}
 	};
+	struct float_type : public type_id {
+		uint8_t bitwidth; // 32 or 64
+
+		float_type(uint8_t bw) : bitwidth(bw) {}
+
+		virtual llvm::Type* llvm_type(llvm::LLVMContext& c) const override {
+			return bitwidth == 32 ? llvm::Type::getFloatTy(c) : llvm::Type::getDoubleTy(c);
+		}
+
+		virtual bool equals(shared_ptr<type_id> o) const override {
+			auto p = dynamic_pointer_cast<float_type>(o);
+			return p != nullptr && p->bitwidth == bitwidth;
+		}
+		virtual size_t hash() const override { return bitwidth * 31 + 8; }
+
+		virtual void print(ostream& os) const override {
+			os << "f" << (int)bitwidth;
+		}
+
+		virtual bool can_cast_to(shared_ptr<type_id> t) const {
+			return dynamic_pointer_cast<integer_type>(t) != nullptr || dynamic_pointer_cast<float_type>(t) != nullptr;
+		}
+		virtual llvm::Value* cast_to(llvm::LLVMContext& cx, shared_ptr<type_id> target_type, llvm::Value* src, llvm::IRBuilder<>& irb) const {
+			auto intag = dynamic_pointer_cast<integer_type>(target_type);
+			if (intag != nullptr) {
+				return intag->signed_ ? irb.CreateFPToSI(src, intag->llvm_type(cx)) : irb.CreateFPToUI(src, intag->llvm_type(cx));
+			}
+			return irb.CreateFPCast(src, target_type->llvm_type(cx));
+		}
+	};
 	struct plain_type : public type_id {
-		string name;
-		plain_type(const string& n) : name(n) {}
+		symbol name;
+		plain_type(symbol n) : name(n) {}
 
 		virtual llvm::Type* llvm_type(llvm::LLVMContext&) const override {
 			return nullptr;
@@ -148,8 +200,9 @@ namespace nkqc {
 			auto p = dynamic_pointer_cast<plain_type>(o);
 			return p != nullptr && p->name == name;
 		}
+		virtual size_t hash() const override { return (size_t)name * 31 + 5; }
 		virtual void print(ostream& os) const override {
-			os << name;
+			os << sym_name(name);
 		}
 		virtual shared_ptr<type_id> resolve(typing_context* cx) override {
 			return cx->type_for_name(name);
@@ -166,6 +219,7 @@ namespace nkqc {
 			auto p = dynamic_pointer_cast<ptr_type>(o);
 			return p != nullptr && inner->equals(p->inner);
 		}
+		virtual size_t hash() const override { return inner->hash() * 31 + 6; }
 		virtual void print(ostream& os) const override {
 			os << "*";
 			inner->print(os);
@@ -179,13 +233,15 @@ namespace nkqc {
 		}
 
 		virtual shared_ptr<type_id> resolve(typing_context* cx) {
-			return make_shared<ptr_type>(inner->resolve(cx));
+			auto ri = inner->resolve(cx);
+			if (ri == inner) return cx->intern(shared_from_this());
+			return cx->intern(make_shared<ptr_type>(ri));
 		}
 	};
 	struct array_type : public type_id {
 		size_t count;
 		shared_ptr<type_id> element;
-		array_type(size_t count, shared_ptr<type_id> e) : element(e), count(count) {}
+		array_type(size_t count, shared_ptr<type_id> e) : count(count), element(e) {}
 
 		virtual llvm::Type* llvm_type(llvm::LLVMContext& c) const override {
 			return llvm::ArrayType::get(element->llvm_type(c), count);
@@ -195,6 +251,7 @@ namespace nkqc {
 			auto p = dynamic_pointer_cast<array_type>(o);
 			return p != nullptr && count == p->count && element->equals(p->element);
 		}
+		virtual size_t hash() const override { return (element->hash() * 31 + count) * 31 + 7; }
 		virtual void print(ostream& os) const override {
 			os << "[" << count << "]";
 			element->print(os);
@@ -213,15 +270,68 @@ namespace nkqc {
 		}
 
 		virtual shared_ptr<type_id> resolve(typing_context* cx) {
-			return make_shared<array_type>(count, element->resolve(cx));
+			auto re = element->resolve(cx);
+			if (re == element) return cx->intern(shared_from_this());
+			return cx->intern(make_shared<array_type>(count, re));
+		}
+	};
+	// []T, a pointer to some Ts and how many there are, which at: and at:put: check indices against
+	struct slice_type : public type_id {
+		shared_ptr<type_id> element;
+		slice_type(shared_ptr<type_id> e) : element(e) {}
+
+		virtual llvm::Type* llvm_type(llvm::LLVMContext& c) const override {
+			return llvm::StructType::get(c, { element->llvm_type(c)->getPointerTo(), llvm::Type::getInt32Ty(c) });
+		}
+
+		virtual bool equals(shared_ptr<type_id> o) const override {
+			auto p = dynamic_pointer_cast<slice_type>(o);
+			return p != nullptr && element->equals(p->element);
+		}
+		virtual size_t hash() const override { return element->hash() * 31 + 11; }
+		virtual void print(ostream& os) const override {
+			os << "[]";
+			element->print(os);
+		}
+
+		virtual shared_ptr<type_id> resolve(typing_context* cx) {
+			auto re = element->resolve(cx);
+			if (re == element) return cx->intern(shared_from_this());
+			return cx->intern(make_shared<slice_type>(re));
+		}
+	};
+	// a SIMD vector, operated on a lane at a time. the element is an integer, float or bool type
+	struct vector_type : public type_id {
+		size_t count;
+		shared_ptr<type_id> element;
+		vector_type(size_t count, shared_ptr<type_id> e) : count(count), element(e) {}
+
+		virtual llvm::Type* llvm_type(llvm::LLVMContext& c) const override {
+			return llvm::VectorType::get(element->llvm_type(c), (unsigned)count);
+		}
+
+		virtual bool equals(shared_ptr<type_id> o) const override {
+			auto p = dynamic_pointer_cast<vector_type>(o);
+			return p != nullptr && count == p->count && element->equals(p->element);
+		}
+		virtual size_t hash() const override { return (element->hash() * 31 + count) * 31 + 9; }
+		virtual void print(ostream& os) const override {
+			os << "<" << count << ">";
+			element->print(os);
+		}
+
+		virtual shared_ptr<type_id> resolve(typing_context* cx) {
+			auto re = element->resolve(cx);
+			if (re == element) return cx->intern(shared_from_this());
+			return cx->intern(make_shared<vector_type>(count, re));
 		}
 	};
 
 	struct struct_type : public type_id {
-		vector<pair<string, shared_ptr<type_id>>> fields;
+		vector<pair<symbol, shared_ptr<type_id>>> fields;
 		llvm::Type* t;
 
-		struct_type(vector<pair<string, shared_ptr<type_id>>> fields) : fields(fields), t(nullptr) {}
+		struct_type(vector<pair<symbol, shared_ptr<type_id>>> fields) : fields(fields), t(nullptr) {}
 
 		void init(llvm::LLVMContext& c, const string& name) {
 			vector<llvm::Type*> elem;
@@ -238,27 +348,99 @@ namespace nkqc {
 
 		virtual bool receive_by_ref() const { return true; }
 
+		// structs are nominal: every `struct` declaration introduces exactly one struct_type
 		virtual bool equals(shared_ptr<type_id> o) const override {
-			auto ot = dynamic_pointer_cast<struct_type>(o);
-			if (ot != nullptr) {
-				if (fields.size() != ot->fields.size()) return false;
-				for (int i = 0; i < fields.size(); ++i) {
-					if (fields[i].first != ot->fields[i].first) return false;
-					if (!fields[i].second->equals(ot->fields[i].second)) return false;
-				}
-				return true;
-			}
-			else return false;
+			return o.get() == this;
 		}
+		virtual size_t hash() const override { return std::hash<const void*>()(this); }
+		virtual shared_ptr<type_id> resolve(typing_context* cx) override { return shared_from_this(); }
 
 		virtual void print(ostream& os) const override {
 			os << "| ";
 			for (const auto& p : fields) {
-				os << "{" << p.first << " ";
+				os << "{" << sym_name(p.first) << " ";
 				p.second->print(os);
 				os << "} ";
 			}
 			os << "|";
 		}
 	};
-}
\ No newline at end of file
+
+	// hash-consing table for resolved types. the common leaf and pointer types are served from small caches
+	// so that typing a literal or wrapping a receiver in a pointer does not allocate
+	struct type_universe {
+		shared_ptr<type_id> intern(shared_ptr<type_id> t) {
+			auto e = table.find(t);
+			if (e != table.end()) return *e;
+			table.insert(t);
+			return t;
+		}
+
+		shared_ptr<type_id> unit() {
+			if (unit_t == nullptr) unit_t = intern(make_shared<unit_type>());
+			return unit_t;
+		}
+		shared_ptr<type_id> boolean() {
+			if (bool_t == nullptr) bool_t = intern(make_shared<bool_type>());
+			return bool_t;
+		}
+		shared_ptr<type_id> integer(bool signed_, uint8_t bitwidth) {
+			auto& t = integer_ts[bitwidth << 1 | signed_];
+			if (t == nullptr) t = intern(make_shared<integer_type>(signed_, bitwidth));
+			return t;
+		}
+		shared_ptr<type_id> floating(uint8_t bitwidth) {
+			auto& t = float_ts[bitwidth];
+			if (t == nullptr) t = intern(make_shared<float_type>(bitwidth));
+			return t;
+		}
+		// inner must already be interned
+		shared_ptr<type_id> ptr_to(shared_ptr<type_id> inner) {
+			auto& t = ptr_ts[inner.get()];
+			if (t == nullptr) t = intern(make_shared<ptr_type>(inner));
+			return t;
+		}
+		// element must already be interned
+		shared_ptr<type_id> slice_of(shared_ptr<type_id> element) {
+			auto& t = slice_ts[element.get()];
+			if (t == nullptr) t = intern(make_shared<slice_type>(element));
+			return t;
+		}
+		// element must already be interned
+		shared_ptr<type_id> array_of(size_t count, shared_ptr<type_id> element) {
+			auto& t = array_ts[{ count, element.get() }];
+			if (t == nullptr) t = intern(make_shared<array_type>(count, element));
+			return t;
+		}
+
+		// element must already be interned
+		shared_ptr<type_id> vector_of(size_t count, shared_ptr<type_id> element) {
+			auto& t = vector_ts[{ count, element.get() }];
+			if (t == nullptr) t = intern(make_shared<vector_type>(count, element));
+			return t;
+		}
+
+		// LLVM lowering of interned types, so composite types are only ever lowered once per context
+		llvm::Type* llvm_type(shared_ptr<type_id> t, llvm::LLVMContext& c) {
+			auto& lt = llvm_ts[t.get()];
+			if (lt == nullptr) lt = t->llvm_type(c);
+			return lt;
+		}
+	private:
+		struct structural_hash {
+			size_t operator()(const shared_ptr<type_id>& t) const { return t->hash(); }
+		};
+		struct structural_equal {
+			bool operator()(const shared_ptr<type_id>& a, const shared_ptr<type_id>& b) const { return a == b || a->equals(b); }
+		};
+		struct array_key_hash {
+			size_t operator()(const pair<size_t, const type_id*>& k) const { return std::hash<const type_id*>()(k.second) * 31 + k.first; }
+		};
+		unordered_set<shared_ptr<type_id>, structural_hash, structural_equal> table;
+		shared_ptr<type_id> unit_t, bool_t;
+		unordered_map<int, shared_ptr<type_id>> integer_ts, float_ts;
+		unordered_map<const type_id*, shared_ptr<type_id>> ptr_ts, slice_ts;
+		unordered_map<pair<size_t, const type_id*>, shared_ptr<type_id>, array_key_hash> array_ts, vector_ts;
+		unordered_map<const type_id*, llvm::Type*> llvm_ts;
+	};
+}